@@ -0,0 +1,158 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+// Distance reported when a model saturates (or two sequences share no sites)
+static const float saturated_distance = 5.0f;
+
+// Sequences are compared in blocks of rows over chunks of sites, so a chunk
+// of every row in a block stays in cache while all pairs in the block use it
+static const int block_rows = 32;
+static const size_t chunk_words = 256;
+
+bool is_alignment_method(const std::string& method) {
+    return method == "p" || method == "jc69" || method == "k2p";
+}
+
+// Bit planes per site: A=(0,0) G=(0,1) C=(1,0) T=(1,1) as (pyrimidine, second bit),
+// so transitions flip only the second bit and transversions flip the first.
+// Gaps, N and ambiguity codes are cleared in the valid plane.
+packed_alignment pack_alignment(const sequence_view& alignment) {
+    packed_alignment packed;
+    packed.count = alignment.seq.size();
+    packed.sites = packed.count ? alignment.seq[0].size() : 0;
+    packed.words = (packed.sites + 63) / 64;
+    packed.bits.assign(packed.count * 3 * packed.words, 0);
+
+    for (size_t i = 0; i < packed.count; i++) {
+        uint64_t* pyrimidine = packed.plane(i, 0);
+        uint64_t* second = packed.plane(i, 1);
+        uint64_t* valid = packed.plane(i, 2);
+        std::string_view seq = alignment.seq[i];
+
+        for (size_t s = 0; s < seq.size() && s < packed.sites; s++) {
+            uint64_t bit = 1ULL << (s % 64);
+            size_t w = s / 64;
+            switch (seq[s]) {
+                case 'A': case 'a': valid[w] |= bit; break;
+                case 'G': case 'g': valid[w] |= bit; second[w] |= bit; break;
+                case 'C': case 'c': valid[w] |= bit; pyrimidine[w] |= bit; break;
+                case 'T': case 't': case 'U': case 'u':
+                    valid[w] |= bit; pyrimidine[w] |= bit; second[w] |= bit; break;
+                default: break;
+            }
+        }
+    }
+    return packed;
+}
+
+// Resolved once per matrix rather than compared for every pair
+enum class site_model { p, jc69, k2p };
+
+static site_model parse_site_model(const std::string& method) {
+    return method == "jc69" ? site_model::jc69 : method == "k2p" ? site_model::k2p : site_model::p;
+}
+
+static float site_distance(const site_counts& counts, site_model model) {
+    if (counts.sites == 0) return saturated_distance;
+    double p = double(counts.transitions + counts.transversions) / counts.sites;
+
+    if (model == site_model::jc69) {
+        double arg = 1.0 - 4.0 * p / 3.0;
+        return arg > 0 ? -0.75 * std::log(arg) : saturated_distance;
+    }
+    if (model == site_model::k2p) {
+        double P = double(counts.transitions) / counts.sites;
+        double Q = double(counts.transversions) / counts.sites;
+        double arg1 = 1.0 - 2.0 * P - Q, arg2 = 1.0 - 2.0 * Q;
+        if (arg1 <= 0 || arg2 <= 0) return saturated_distance;
+        return -0.5 * std::log(arg1) - 0.25 * std::log(arg2);
+    }
+    return p;
+}
+
+// Transition, transversion and comparable-site counts for words [begin, end) of one pair
+static inline void count_sites(const packed_alignment& packed, size_t a, size_t b, size_t begin, size_t end, site_counts& counts) {
+    const uint64_t* ry_a = packed.plane(a, 0);
+    const uint64_t* ry_b = packed.plane(b, 0);
+    const uint64_t* sb_a = packed.plane(a, 1);
+    const uint64_t* sb_b = packed.plane(b, 1);
+    const uint64_t* v_a = packed.plane(a, 2);
+    const uint64_t* v_b = packed.plane(b, 2);
+    uint64_t transitions = 0, transversions = 0, sites = 0;
+
+    for (size_t w = begin; w < end; w++) {
+        uint64_t valid = v_a[w] & v_b[w];
+        uint64_t ry = (ry_a[w] ^ ry_b[w]) & valid;
+        uint64_t sb = (sb_a[w] ^ sb_b[w]) & valid;
+        transversions += __builtin_popcountll(ry);
+        transitions += __builtin_popcountll(sb & ~ry);
+        sites += __builtin_popcountll(valid);
+    }
+    counts.transitions += transitions;
+    counts.transversions += transversions;
+    counts.sites += sites;
+}
+
+site_counts compare_sites(const packed_alignment& packed, size_t a, size_t b) {
+    site_counts counts;
+    count_sites(packed, a, b, 0, packed.words, counts);
+    return counts;
+}
+
+std::vector<dmatrix_row> alignment_distance_matrix(const packed_alignment& packed, std::string method, int threads) {
+    int n = packed.count;
+    site_model model = parse_site_model(method);
+    std::vector<dmatrix_row> D(n);
+    for (int i = 0; i < n; i++) {
+        D[i].distances.assign(n, 0.0f);
+        D[i].id = i;
+        D[i].sum = 0;
+    }
+
+    // Tiles of the lower triangle: block row bi against block columns 0..bi
+    int blocks = (n + block_rows - 1) / block_rows;
+    std::vector<std::pair<int, int>> tiles;
+    for (int bi = 0; bi < blocks; bi++) {
+        for (int bj = 0; bj <= bi; bj++) tiles.emplace_back(bi, bj);
+    }
+
+    parallel_for(0, tiles.size(), threads, [&](int t) {
+        int i0 = tiles[t].first * block_rows, i1 = std::min(n, i0 + block_rows);
+        int j0 = tiles[t].second * block_rows, j1 = std::min(n, j0 + block_rows);
+        std::vector<site_counts> counts(block_rows * block_rows);
+
+        for (size_t w = 0; w < packed.words; w += chunk_words) {
+            size_t w1 = std::min(packed.words, w + chunk_words);
+            for (int i = i0; i < i1; i++) {
+                for (int j = j0; j < j1 && j < i; j++) {
+                    count_sites(packed, i, j, w, w1, counts[(i - i0) * block_rows + (j - j0)]);
+                }
+            }
+        }
+        for (int i = i0; i < i1; i++) {
+            for (int j = j0; j < j1 && j < i; j++) {
+                float distance = site_distance(counts[(i - i0) * block_rows + (j - j0)], model);
+                D[i].distances[j] = distance;
+                D[j].distances[i] = distance;
+            }
+        }
+    });
+
+    for (int i = 0; i < n; i++) {
+        for (float d : D[i].distances) D[i].sum += d;
+    }
+    return D;
+}
+
+std::vector<dmatrix_row> alignment_distance_matrix(const sequence_view& alignment, std::string method, int threads) {
+    for (size_t i = 1; i < alignment.seq.size(); i++) {
+        if (alignment.seq[i].size() != alignment.seq[0].size()) {
+            std::cerr << "Error: '" << alignment.name[i] << "' has " << alignment.seq[i].size()
+                      << " sites, expected " << alignment.seq[0].size() << " for an alignment" << std::endl;
+            return {};
+        }
+    }
+    return alignment_distance_matrix(pack_alignment(alignment), method, threads);
+}
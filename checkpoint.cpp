@@ -0,0 +1,179 @@
+#include "tree.hpp"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+// Merge snapshot: "PHYMERG1", algorithm, value size, leaf count, names,
+//                 join count, per join child1, child2 and both branch
+//                 lengths, active slot count m, nodes[m], value count,
+//                 values, then the m(m-1)/2 stored distances of the matrix
+static const char merge_magic[8] = {'P', 'H', 'Y', 'M', 'E', 'R', 'G', '1'};
+
+template <typename T>
+static void write_value(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+static bool read_value(std::ifstream& in, T& value) {
+    return bool(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+template <typename T>
+static void write_array(std::ofstream& out, const T* values, size_t count) {
+    out.write(reinterpret_cast<const char*>(values), count * sizeof(T));
+}
+
+template <typename T>
+static bool read_array(std::ifstream& in, std::vector<T>& values, size_t count) {
+    values.resize(count);
+    return bool(in.read(reinterpret_cast<char*>(values.data()), count * sizeof(T)));
+}
+
+static void write_string(std::ofstream& out, const std::string& s) {
+    write_value<uint32_t>(out, s.size());
+    out.write(s.data(), s.size());
+}
+
+static bool read_string(std::ifstream& in, std::string& s) {
+    uint32_t length;
+    if (!read_value(in, length)) return false;
+    s.resize(length);
+    return bool(in.read(&s[0], length));
+}
+
+merge_checkpoint::merge_checkpoint(const std::string& filename, const std::string& algorithm, double interval)
+    : filename(filename), algorithm(algorithm), interval(interval), last(std::chrono::steady_clock::now()) {}
+
+bool merge_checkpoint::due() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - last).count() >= interval;
+}
+
+// Written to a temporary file and renamed over the old snapshot, so a run
+// killed while writing still leaves the previous one intact
+template <typename T>
+bool merge_checkpoint::save(const packed_triangle<T>& D, const Tree& tree, const merge_state& state) {
+    last = std::chrono::steady_clock::now();
+    std::string temporary = filename + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        if (!out) {
+            std::cerr << "Error: could not write checkpoint '" << temporary << "'" << std::endl;
+            return false;
+        }
+        out.write(merge_magic, sizeof(merge_magic));
+        write_string(out, algorithm);
+        write_value<uint32_t>(out, sizeof(T));
+        write_value<uint32_t>(out, tree.leaves());
+        for (int i = 0; i < tree.leaves(); i++) write_string(out, std::string(tree.name(i)));
+
+        write_value<uint32_t>(out, tree.size() - tree.leaves());
+        for (int v = tree.leaves(); v < tree.size(); v++) {
+            write_value<int32_t>(out, tree.child1[v]);
+            write_value<int32_t>(out, tree.child2[v]);
+            write_value<float>(out, tree.length[tree.child1[v]]);
+            write_value<float>(out, tree.length[tree.child2[v]]);
+        }
+
+        write_value<uint32_t>(out, state.m);
+        write_array(out, state.nodes.data(), state.m);
+        write_value<uint64_t>(out, state.values.size());
+        write_array(out, state.values.data(), state.values.size());
+        // Rows 0..m-1 are the front of the packed triangle
+        write_array(out, D.values.data(), size_t(state.m) * (state.m - 1) / 2);
+        if (!out) {
+            std::cerr << "Error: could not write checkpoint '" << temporary << "'" << std::endl;
+            return false;
+        }
+    }
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Error: could not replace checkpoint '" << filename << "'" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template <typename T>
+bool merge_checkpoint::load(std::vector<std::string>& names, packed_triangle<T>& D) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) return false;
+
+    char magic[8];
+    std::string saved_algorithm;
+    uint32_t value_size, leaves, joins, m;
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, merge_magic, sizeof(magic)) != 0) {
+        std::cerr << "Error: '" << filename << "' is not a merge checkpoint" << std::endl;
+        return false;
+    }
+    if (!read_string(in, saved_algorithm) || !read_value(in, value_size) || !read_value(in, leaves)) {
+        std::cerr << "Error: truncated checkpoint '" << filename << "'" << std::endl;
+        return false;
+    }
+    if (saved_algorithm != algorithm || value_size != sizeof(T)) {
+        std::cerr << "Error: checkpoint '" << filename << "' was written by -" << saved_algorithm
+                  << " with " << 8 * value_size << "-bit distances; starting over" << std::endl;
+        return false;
+    }
+
+    names.resize(leaves);
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < leaves; i++) ok = read_string(in, names[i]);
+    ok = ok && read_value(in, joins);
+    joined1.resize(ok ? joins : 0);
+    joined2.resize(joined1.size());
+    lengths1.resize(joined1.size());
+    lengths2.resize(joined1.size());
+    for (uint32_t k = 0; ok && k < joins; k++) {
+        ok = read_value(in, joined1[k]) && read_value(in, joined2[k]) &&
+             read_value(in, lengths1[k]) && read_value(in, lengths2[k]);
+    }
+    uint64_t value_count = 0;
+    ok = ok && read_value(in, m) && m <= leaves && read_array(in, restored.nodes, m) &&
+         read_value(in, value_count) && read_array(in, restored.values, value_count);
+    if (ok) {
+        D = packed_triangle<T>(m);
+        ok = bool(in.read(reinterpret_cast<char*>(D.values.data()), D.values.size() * sizeof(T)));
+    }
+    if (!ok) {
+        std::cerr << "Error: truncated checkpoint '" << filename << "'" << std::endl;
+        joined1.clear();
+        return false;
+    }
+    // Join k makes node leaves + k from two earlier nodes not yet joined,
+    // and the active slots hold nodes that exist
+    std::vector<char> joined(size_t(leaves) + joins, 0);
+    for (uint32_t k = 0; ok && k < joins; k++) {
+        int32_t a = joined1[k], b = joined2[k];
+        int64_t made = int64_t(leaves) + k;
+        ok = a >= 0 && b >= 0 && a != b && a < made && b < made && !joined[a] && !joined[b];
+        if (ok) joined[a] = joined[b] = 1;
+    }
+    for (uint32_t i = 0; ok && i < m; i++) {
+        ok = restored.nodes[i] >= 0 && restored.nodes[i] < int64_t(leaves) + joins && !joined[restored.nodes[i]];
+    }
+    if (!ok) {
+        std::cerr << "Error: checkpoint '" << filename << "' has invalid joins; starting over" << std::endl;
+        joined1.clear();
+        return false;
+    }
+    // A snapshot without joins is just the distance matrix: the build starts fresh
+    restored.m = joins ? m : 0;
+    return true;
+}
+
+void merge_checkpoint::replay(Tree& tree) const {
+    for (size_t k = 0; k < joined1.size(); k++) {
+        tree.joinNodes(joined1[k], joined2[k], lengths1[k], lengths2[k]);
+    }
+}
+
+void merge_checkpoint::remove() const {
+    std::remove(filename.c_str());
+}
+
+template bool merge_checkpoint::save<float>(const packed_triangle<float>&, const Tree&, const merge_state&);
+template bool merge_checkpoint::save<double>(const packed_triangle<double>&, const Tree&, const merge_state&);
+template bool merge_checkpoint::save<half>(const packed_triangle<half>&, const Tree&, const merge_state&);
+template bool merge_checkpoint::load<float>(std::vector<std::string>&, packed_triangle<float>&);
+template bool merge_checkpoint::load<double>(std::vector<std::string>&, packed_triangle<double>&);
+template bool merge_checkpoint::load<half>(std::vector<std::string>&, packed_triangle<half>&);
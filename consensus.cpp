@@ -0,0 +1,137 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <cmath>
+
+consensus_builder::consensus_builder(int leaves)
+    : leaves(leaves), words((leaves + 63) / 64), keys(leaf_keys(leaves)) {}
+
+// Splits are hashed as in tree_bipartitions. Only the first tree holding a
+// split pays for its leaf set, which is stored as the side without leaf 0.
+void consensus_builder::add(const tree_view& tree) {
+    std::vector<uint64_t> hash(tree.nodes, 0);
+    std::vector<int> size(tree.nodes, 0);
+    uint64_t all = 0;
+    for (int i = 0; i < tree.leaves; i++) {
+        hash[i] = keys[i];
+        size[i] = 1;
+        all ^= keys[i];
+    }
+
+    std::vector<std::pair<uint64_t, int>> splits;
+    for (int i = 0; i < tree.nodes; i++) {
+        int p = tree.parent[i];
+        if (p < 0) continue;
+        hash[p] ^= hash[i];
+        size[p] += size[i];
+        if (size[i] > 1 && size[i] < tree.leaves - 1) {
+            splits.emplace_back(std::min(hash[i], hash[i] ^ all), i);
+        }
+    }
+    std::sort(splits.begin(), splits.end());
+
+    std::vector<int> first, children;
+    for (size_t s = 0; s < splits.size(); s++) {
+        // The two edges at a bifurcating root are one split of summed length
+        float length = tree.length[splits[s].second];
+        if (s > 0 && splits[s].first == splits[s - 1].first) {
+            entries[splits[s].first].length += length;
+            continue;
+        }
+        auto [entry, added] = entries.try_emplace(splits[s].first);
+        entry->second.count++;
+        entry->second.length += length;
+        if (!added) continue;
+
+        if (first.empty()) tree_children(tree, first, children);
+        entry->second.offset = leaf_sets.size();
+        leaf_sets.resize(leaf_sets.size() + words, 0);
+        uint64_t* set = leaf_sets.data() + entry->second.offset;
+        std::vector<int> stack = {splits[s].second};
+        while (!stack.empty()) {
+            int v = stack.back();
+            stack.pop_back();
+            if (v < tree.leaves) set[v / 64] |= 1ULL << (v % 64);
+            for (int c = first[v]; c < first[v + 1]; c++) stack.push_back(children[c]);
+        }
+        if (set[0] & 1) {
+            for (int w = 0; w < words; w++) set[w] = ~set[w];
+            if (leaves % 64) set[words - 1] &= (1ULL << (leaves % 64)) - 1;
+        }
+    }
+    // Leaf edges are in every tree; keep their mean lengths too
+    if (leaf_length.empty()) leaf_length.assign(leaves, 0.0);
+    for (int i = 0; i < tree.leaves && i < tree.nodes; i++) leaf_length[i] += tree.length[i];
+    count++;
+}
+
+// Leaf sets on the same side of leaf 0 are compatible when nested or disjoint
+bool consensus_builder::compatible(const uint64_t* a, const uint64_t* b) const {
+    bool a_in_b = true, b_in_a = true, disjoint = true;
+    for (int w = 0; w < words; w++) {
+        if (a[w] & ~b[w]) a_in_b = false;
+        if (b[w] & ~a[w]) b_in_a = false;
+        if (a[w] & b[w]) disjoint = false;
+    }
+    return a_in_b || b_in_a || disjoint;
+}
+
+compact_tree consensus_builder::build(bool greedy) const {
+    std::vector<std::pair<uint64_t, const split_entry*>> ranked;
+    for (const auto& [hash, entry] : entries) ranked.emplace_back(hash, &entry);
+    std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+        return a.second->count != b.second->count ? a.second->count > b.second->count : a.first < b.first;
+    });
+
+    // Majority splits are always compatible; greedy adds the rest by support
+    // whenever they fit the splits accepted so far
+    std::vector<const split_entry*> accepted;
+    for (const auto& [hash, entry] : ranked) {
+        if (2 * entry->count <= count) {
+            if (!greedy) break;
+            bool fits = std::all_of(accepted.begin(), accepted.end(), [&](const split_entry* other) {
+                return compatible(leaf_sets.data() + entry->offset, leaf_sets.data() + other->offset);
+            });
+            if (!fits) continue;
+        }
+        accepted.push_back(entry);
+    }
+
+    // Accepted leaf sets, smallest first, each become a node over the current
+    // topmost nodes of their leaves; the root collects whatever is left
+    std::vector<std::pair<int, const split_entry*>> clades;
+    for (const split_entry* entry : accepted) {
+        int size = 0;
+        for (int w = 0; w < words; w++) size += __builtin_popcountll(leaf_sets[entry->offset + w]);
+        clades.emplace_back(size, entry);
+    }
+    std::sort(clades.begin(), clades.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    compact_tree tree;
+    tree.leaves = leaves;
+    int nodes = leaves + clades.size() + 1;
+    tree.parent.assign(nodes, -1);
+    tree.length.assign(nodes, 0.0f);
+    tree.support.assign(nodes, 0.0f);
+    for (int i = 0; i < leaves; i++) {
+        tree.length[i] = count ? leaf_length[i] / count : 0.0f;
+    }
+
+    std::vector<int> top(leaves);
+    for (int i = 0; i < leaves; i++) top[i] = i;
+    int next = leaves;
+    for (const auto& [size, entry] : clades) {
+        const uint64_t* set = leaf_sets.data() + entry->offset;
+        for (int i = 0; i < leaves; i++) {
+            if (!(set[i / 64] >> (i % 64) & 1)) continue;
+            if (tree.parent[top[i]] < 0) tree.parent[top[i]] = next;
+            top[i] = next;
+        }
+        tree.length[next] = entry->length / entry->count;
+        tree.support[next] = std::round(1000.0 * entry->count / count) / 10.0;
+        next++;
+    }
+    for (int i = 0; i < leaves; i++) {
+        if (tree.parent[top[i]] < 0) tree.parent[top[i]] = next;
+    }
+    return tree;
+}
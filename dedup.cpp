@@ -0,0 +1,116 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <limits>
+
+// Below this many representatives a sequence is compared on the calling thread
+static const int parallel_leaders = 256;
+
+sequence_clusters exact_duplicates(const sequence_view& sequences) {
+    sequence_clusters clusters;
+    int n = sequences.seq.size();
+    clusters.cluster_of.resize(n);
+    clusters.duplicate_of.resize(n);
+    clusters.offset.assign(n, 0.0f);
+
+    std::unordered_map<std::string_view, int> seen;
+    seen.reserve(n);
+    for (int i = 0; i < n; i++) {
+        auto [found, added] = seen.try_emplace(sequences.seq[i], clusters.representatives.size());
+        if (added) clusters.representatives.push_back(i);
+        clusters.cluster_of[i] = found->second;
+        clusters.duplicate_of[i] = clusters.representatives[found->second];
+    }
+    return clusters;
+}
+
+// Greedy leader clustering in input order: each representative joins the
+// nearest earlier leader within the threshold or becomes a leader itself
+void collapse_near_duplicates(sequence_clusters& clusters, std::vector<kmer_profile>& profiles,
+                              profile_distance_fn distance, double threshold, int threads) {
+    int count = profiles.size();
+    std::vector<int> leaders, leader_of(count);
+    std::vector<float> offset(count, 0.0f), to_leader;
+    for (int u = 0; u < count; u++) {
+        to_leader.resize(leaders.size());
+        int workers = leaders.size() >= size_t(parallel_leaders) ? threads : 1;
+        parallel_for_blocks(0, leaders.size(), parallel_leaders, workers, [&](int lo, int hi) {
+            for (int l = lo; l < hi; l++) to_leader[l] = distance(profiles[leaders[l]], profiles[u]);
+        });
+
+        int nearest = -1;
+        float best = std::numeric_limits<float>::max();
+        for (size_t l = 0; l < leaders.size(); l++) {
+            if (to_leader[l] < best) {
+                best = to_leader[l];
+                nearest = l;
+            }
+        }
+        if (nearest >= 0 && best <= threshold) {
+            leader_of[u] = nearest;
+            offset[u] = best;
+        } else {
+            leader_of[u] = leaders.size();
+            leaders.push_back(u);
+        }
+    }
+
+    // Renumber clusters by leader and keep only the leaders' profiles
+    for (size_t i = 0; i < clusters.cluster_of.size(); i++) {
+        int u = clusters.cluster_of[i];
+        clusters.cluster_of[i] = leader_of[u];
+        clusters.offset[i] = offset[u];
+    }
+    std::vector<int> representatives;
+    std::vector<kmer_profile> kept;
+    for (int u : leaders) {
+        representatives.push_back(clusters.representatives[u]);
+        kept.push_back(std::move(profiles[u]));
+    }
+    clusters.representatives = std::move(representatives);
+    profiles = std::move(kept);
+}
+
+// Copies of a sequence join it with zero-length branches, then clustered
+// sequences join their representative at their distance to it, so each
+// representative's leaf becomes a run of zero-length joins. The reduced
+// tree's joins are replayed above them.
+pipeline_result graft_clusters(const pipeline_result& reduced, const sequence_clusters& clusters,
+                               const std::vector<std::string>& names) {
+    int n = clusters.cluster_of.size();
+    int count = clusters.representatives.size();
+    Tree tree(names);
+    std::vector<int> top(n);
+    for (int i = 0; i < n; i++) top[i] = i;
+    for (int i = 0; i < n; i++) {
+        int original = clusters.duplicate_of[i];
+        if (original != i) top[original] = tree.joinNodes(top[original], i, 0.0f, 0.0f);
+    }
+    for (int i = 0; i < n; i++) {
+        int r = clusters.representatives[clusters.cluster_of[i]];
+        if (clusters.duplicate_of[i] == i && i != r) top[r] = tree.joinNodes(top[r], top[i], 0.0f, clusters.offset[i]);
+    }
+
+    const compact_tree& shape = reduced.tree;
+    std::vector<int> first, children;
+    tree_view view = view_tree(shape);
+    tree_children(view, first, children);
+    std::vector<int> mapped(view.nodes);
+    for (int v = 0; v < view.nodes; v++) {
+        if (v < count) {
+            mapped[v] = top[clusters.representatives[v]];
+            continue;
+        }
+        int a = children[first[v]], b = children[first[v] + 1];
+        mapped[v] = tree.joinNodes(mapped[a], mapped[b], shape.length[a], shape.length[b]);
+    }
+
+    pipeline_result result;
+    result.matrix = reduced.matrix;
+    result.fit = reduced.fit;
+    result.newick = tree.newick();
+    result.tree = to_compact_tree(tree);
+    if (result.newick.empty() && n == 1) {
+        result.newick = names[0] + ";";
+    }
+    return result;
+}
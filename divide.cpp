@@ -0,0 +1,220 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <iostream>
+
+// Neighbours per taxon in the sketch graph behind each guide tree
+static const int guide_neighbors = 10;
+
+// Cuts the guide tree into connected pieces of at most `limit` leaves. Going
+// up, a node keeps the leaves its children have not given away; when they
+// are too many, its largest child becomes a subset of its own. Every subset
+// but the one left at the root therefore has more than limit / 2 leaves.
+static std::vector<std::vector<int>> partition_guide(const compact_tree& guide, int limit) {
+    tree_view view = view_tree(guide);
+    std::vector<int> first, children;
+    tree_children(view, first, children);
+    std::vector<int> open(view.nodes, 0);
+    std::vector<char> cut(view.nodes, 0);
+    for (int v = 0; v < view.nodes; v++) {
+        if (v < view.leaves) {
+            open[v] = 1;
+            continue;
+        }
+        int total = 0;
+        for (int c = first[v]; c < first[v + 1]; c++) total += open[children[c]];
+        while (total > limit) {
+            int largest = -1;
+            for (int c = first[v]; c < first[v + 1]; c++) {
+                int child = children[c];
+                if (!cut[child] && (largest < 0 || open[child] > open[largest])) largest = child;
+            }
+            cut[largest] = 1;
+            total -= open[largest];
+        }
+        open[v] = total;
+    }
+    cut[view.nodes - 1] = open[view.nodes - 1] > 0;
+
+    // Parents follow their children, so a backward pass sees each parent first
+    std::vector<int> subset(view.nodes, -1);
+    int count = 0;
+    for (int v = view.nodes - 1; v >= 0; v--) {
+        subset[v] = cut[v] ? count++ : view.parent[v] >= 0 ? subset[view.parent[v]] : -1;
+    }
+    std::vector<std::vector<int>> members(count);
+    for (int leaf = 0; leaf < view.leaves; leaf++) members[subset[leaf]].push_back(leaf);
+    return members;
+}
+
+// Adds `shape`, a tree of a subset's taxa followed by its outgroup, to `tree`
+// rooted where the outgroup joined it, without the outgroup. Nodes left with
+// one child are skipped. Returns the root and sets `nearest` to the taxon
+// closest to it and `reach` to that distance.
+static int graft_rooted(const compact_tree& shape, const std::vector<int>& taxa, Tree& tree, int& nearest, float& reach) {
+    tree_view view = view_tree(shape);
+    std::vector<int> first, children;
+    tree_children(view, first, children);
+    int outgroup = shape.leaves - 1;
+    int start = shape.parent[outgroup];
+
+    // Breadth-first from the outgroup's neighbour, away from the outgroup
+    std::vector<int> order = {start}, from(view.nodes, -1);
+    std::vector<float> edge(view.nodes, 0), depth(view.nodes, 0);
+    from[start] = outgroup;
+    for (size_t k = 0; k < order.size(); k++) {
+        int v = order[k];
+        auto visit = [&](int w, float length) {
+            if (w < 0 || w == from[v]) return;
+            from[w] = v;
+            edge[w] = length;
+            depth[w] = depth[v] + length;
+            order.push_back(w);
+        };
+        visit(shape.parent[v], shape.length[v]);
+        for (int c = first[v]; c < first[v + 1]; c++) visit(children[c], shape.length[children[c]]);
+    }
+
+    std::vector<int> mapped(view.nodes, -1);
+    std::vector<float> above(view.nodes, 0);  // length carried up from skipped nodes
+    int closest = -1;
+    for (size_t k = order.size(); k-- > 0;) {
+        int v = order[k];
+        if (v < shape.leaves) {
+            mapped[v] = taxa[v];
+            if (closest < 0 || depth[v] < depth[closest]) closest = v;
+            continue;
+        }
+        int kids[2], count = 0;
+        if (shape.parent[v] >= 0 && from[shape.parent[v]] == v) kids[count++] = shape.parent[v];
+        for (int c = first[v]; c < first[v + 1]; c++) {
+            if (from[children[c]] == v) kids[count++] = children[c];
+        }
+        if (count == 1) {
+            mapped[v] = mapped[kids[0]];
+            above[v] = above[kids[0]] + edge[kids[0]];
+        } else {
+            int a = kids[0], b = kids[1];
+            mapped[v] = tree.joinNodes(mapped[a], mapped[b], edge[a] + above[a], edge[b] + above[b]);
+        }
+    }
+    nearest = taxa[closest];
+    reach = depth[closest] - above[start];
+    return mapped[start];
+}
+
+template <typename T>
+static Tree divide_level(const std::vector<kmer_profile>& profiles, const std::vector<std::string>& names,
+                         const pipeline_options& options, int level) {
+    distance_method method = parse_distance_method(options.method);
+    profile_distance_fn distance = profile_distance_function(method);
+    int n = profiles.size();
+    Tree tree(names);
+    if (n <= options.divide_size) {
+        packed_triangle<T> D = profile_distance_triangle<T>(profiles, method, options.threads);
+        build_tree_from_matrix(D, tree, options.algorithm, false, options.threads);
+        return tree;
+    }
+
+    std::vector<sparse_edge> edges = knn_graph(profiles, guide_neighbors, distance, options.threads);
+    std::vector<std::vector<int>> members;
+    {
+        Tree guide(names);
+        sparse_upgma(edges, guide, [&](int a, int b) { return distance(profiles[a], profiles[b]); }, false, options.threads);
+        members = partition_guide(to_compact_tree(guide), options.divide_size);
+    }
+    int count = members.size();
+    std::vector<int> subset_of(n);
+    for (int s = 0; s < count; s++) {
+        for (int taxon : members[s]) subset_of[taxon] = s;
+    }
+    if (options.verbose) {
+        std::cout << "Level " << level << ": " << n << " taxa in " << count << " subsets of at most "
+                  << options.divide_size << std::endl;
+    }
+
+    // Each subset is rooted by its closest outside neighbour in the graph
+    std::vector<int> outgroup(count, -1);
+    std::vector<float> outgroup_distance(count);
+    for (const sparse_edge& e : edges) {
+        for (int side = 0; side < 2; side++) {
+            int s = subset_of[side ? e.j : e.i], other = side ? e.i : e.j;
+            if (subset_of[other] != s && (outgroup[s] < 0 || e.d < outgroup_distance[s])) {
+                outgroup[s] = other;
+                outgroup_distance[s] = e.d;
+            }
+        }
+    }
+    for (int s = 0; s < count; s++) {
+        if (outgroup[s] < 0) outgroup[s] = members[(s + 1) % count][0];
+    }
+    edges = std::vector<sparse_edge>();
+
+    // Subset trees are built concurrently, each on its own small matrix
+    std::vector<compact_tree> shapes(count);
+    parallel_for(0, count, options.threads, [&](int s) {
+        const std::vector<int>& taxa = members[s];
+        int size = taxa.size() + 1;
+        if (size < 4) return;
+        auto taxon = [&](int i) { return i < size - 1 ? taxa[i] : outgroup[s]; };
+        packed_triangle<T> D(size);
+        std::vector<std::string> local(size);
+        for (int i = 0; i < size; i++) {
+            local[i] = names[taxon(i)];
+            for (int j = 0; j < i; j++) D.row(i)[j] = T(distance(profiles[taxon(i)], profiles[taxon(j)]));
+        }
+        Tree subtree(local);
+        build_tree_from_matrix(D, subtree, options.algorithm, false, 1);
+        shapes[s] = to_compact_tree(subtree);
+    });
+
+    std::vector<int> top(count), nearest(count);
+    std::vector<float> reach(count, 0);
+    for (int s = 0; s < count; s++) {
+        const std::vector<int>& taxa = members[s];
+        nearest[s] = top[s] = taxa[0];
+        if (taxa.size() == 2) {
+            reach[s] = distance(profiles[taxa[0]], profiles[taxa[1]]) / 2;
+            top[s] = tree.joinNodes(taxa[0], taxa[1], reach[s], reach[s]);
+        } else if (taxa.size() > 2) {
+            top[s] = graft_rooted(shapes[s], taxa, tree, nearest[s], reach[s]);
+        }
+        shapes[s] = compact_tree();
+    }
+
+    // The backbone joins the subsets through their taxa nearest the roots;
+    // each backbone leaf stands for the path from its subset's root down to it
+    std::vector<kmer_profile> representatives(count);
+    std::vector<std::string> representative_names(count);
+    for (int s = 0; s < count; s++) {
+        representatives[s] = profiles[nearest[s]];
+        representative_names[s] = names[nearest[s]];
+    }
+    compact_tree backbone = to_compact_tree(divide_level<T>(representatives, representative_names, options, level + 1));
+    tree_view view = view_tree(backbone);
+    std::vector<int> first, children;
+    tree_children(view, first, children);
+    std::vector<int> mapped(view.nodes);
+    auto length = [&](int v) { return v < count ? std::max(0.0f, backbone.length[v] - reach[v]) : backbone.length[v]; };
+    for (int v = 0; v < view.nodes; v++) {
+        if (v < count) {
+            mapped[v] = top[v];
+            continue;
+        }
+        int a = children[first[v]], b = children[first[v] + 1];
+        mapped[v] = tree.joinNodes(mapped[a], mapped[b], length(a), length(b));
+    }
+    return tree;
+}
+
+template <typename T>
+pipeline_result divide_tree(const std::vector<kmer_profile>& profiles, const std::vector<std::string>& names, const pipeline_options& options) {
+    Tree tree = divide_level<T>(profiles, names, options, 1);
+    pipeline_result result;
+    result.newick = tree.newick();
+    result.tree = to_compact_tree(tree);
+    return result;
+}
+
+template pipeline_result divide_tree<float>(const std::vector<kmer_profile>&, const std::vector<std::string>&, const pipeline_options&);
+template pipeline_result divide_tree<double>(const std::vector<kmer_profile>&, const std::vector<std::string>&, const pipeline_options&);
+template pipeline_result divide_tree<half>(const std::vector<kmer_profile>&, const std::vector<std::string>&, const pipeline_options&);
@@ -12,7 +12,7 @@
 using namespace std;
 
 // Function to parse a Newick tree and store its structure
-void parseNewick(const std::string &tree, std::unordered_map<std::string, int> &cladeCounts) {
+static void parseNewick(const std::string &tree, std::unordered_map<std::string, int> &cladeCounts) {
     std::stack<std::string> cladeStack;
     std::string clade;
     
@@ -65,12 +65,12 @@ void computeBootstrapSupport(const vector<string> &bootstrapTrees, int numBootst
 
 
 // Function to check if a nucleotide is a purine (A or G)
-bool isPurine(char base) {
+static bool isPurine(char base) {
     return base == 'A' || base == 'G';
 }
 
 // Function to count transitions and transversions between two sequences
-pair<int, int> countTransitionsTransversions(const string &seq1, const string &seq2) {
+static pair<int, int> countTransitionsTransversions(const string &seq1, const string &seq2) {
     int transitions = 0, transversions = 0;
     for (size_t i = 0; i < seq1.length(); i++) {
         char b1 = seq1[i], b2 = seq2[i];
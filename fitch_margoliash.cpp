@@ -1,4 +1,6 @@
+#include "tree.hpp"
 #include <iostream>
+#include <functional>
 #include <vector>
 #include <string>
 #include <limits>
@@ -23,49 +25,42 @@ struct TreeNode {
     }
 };
 
-// Recursively build pairwise distances in tree
-void traverse_distances(TreeNode* node, vector<pair<string, double>> path,
-                        map<string, int>& label_index, vector<vector<double>>& dist_matrix, double acc_dist) {
-    if (!node) return;
-
+// Leaves below node with their distance to it. Each pair of leaves is
+// scored once, at the node where their lists meet, so one call is O(n^2).
+static void subtree_errors(TreeNode* node, const vector<vector<double>>& D, const map<string, int>& label_index,
+                           vector<pair<int, double>>& below, double& error) {
     if (node->is_leaf()) {
-        for (auto& [other, d] : path) {
-            int i = label_index[node->name];
-            int j = label_index[other];
-            dist_matrix[i][j] = dist_matrix[j][i] = acc_dist + d;
+        below.emplace_back(label_index.at(node->name), 0.0);
+        return;
+    }
+    vector<pair<int, double>> right;
+    subtree_errors(node->left, D, label_index, below, error);
+    subtree_errors(node->right, D, label_index, right, error);
+    for (auto& [i, di] : below) {
+        for (auto& [j, dj] : right) {
+            double d = di + node->branch_length_left + dj + node->branch_length_right;
+            error += (D[i][j] - d) * (D[i][j] - d);
         }
-        path.emplace_back(node->name, 0.0);
-    } else {
-        auto path_left = path;
-        path_left.emplace_back(node->left->name, node->branch_length_left);
-        traverse_distances(node->left, path_left, label_index, dist_matrix, acc_dist + node->branch_length_left);
-
-        auto path_right = path;
-        path_right.emplace_back(node->right->name, node->branch_length_right);
-        traverse_distances(node->right, path_right, label_index, dist_matrix, acc_dist + node->branch_length_right);
     }
+    for (auto& leaf : below) leaf.second += node->branch_length_left;
+    for (auto& leaf : right) below.emplace_back(leaf.first, leaf.second + node->branch_length_right);
 }
 
 // Compute least squares error
-double compute_least_squares_error(const vector<vector<double>>& D, TreeNode* tree, const vector<string>& labels) {
+static double compute_least_squares_error(const vector<vector<double>>& D, TreeNode* tree, const vector<string>& labels) {
     int n = labels.size();
-    vector<vector<double>> dist_matrix(n, vector<double>(n, 0.0));
     map<string, int> label_index;
     for (int i = 0; i < n; ++i)
         label_index[labels[i]] = i;
 
-    traverse_distances(tree, {}, label_index, dist_matrix, 0.0);
-
+    vector<pair<int, double>> leaves;
     double error = 0.0;
-    for (int i = 0; i < n; ++i)
-        for (int j = i + 1; j < n; ++j)
-            error += pow(D[i][j] - dist_matrix[i][j], 2);
-
+    subtree_errors(tree, D, label_index, leaves, error);
     return error;
 }
 
-// Neighbor joining tree construction
-TreeNode* neighbor_joining(vector<vector<double>> D, vector<string> labels) {
+// Neighbor joining tree construction on its own copy of D
+static TreeNode* neighbor_joining(vector<vector<double>> D, const vector<string>& labels) {
     int n = D.size();
     vector<TreeNode*> nodes(n);
     for (int i = 0; i < n; ++i)
@@ -81,20 +76,15 @@ TreeNode* neighbor_joining(vector<vector<double>> D, vector<string> labels) {
             for (int j : active)
                 total_d[i] += D[i][j];
 
-        vector<vector<double>> Q(n, vector<double>(n, numeric_limits<double>::infinity()));
-        for (int i : active) {
-            for (int j : active) {
-                if (i < j)
-                    Q[i][j] = (m - 2) * D[i][j] - total_d[i] - total_d[j];
-            }
-        }
-
+        // Q(i, j) is compared as it is computed, so no Q matrix is held
         int min_i = -1, min_j = -1;
         double min_val = numeric_limits<double>::infinity();
         for (int i : active) {
             for (int j : active) {
-                if (i < j && Q[i][j] < min_val) {
-                    min_val = Q[i][j];
+                if (i >= j) continue;
+                double q = (m - 2) * D[i][j] - total_d[i] - total_d[j];
+                if (q < min_val) {
+                    min_val = q;
                     min_i = i;
                     min_j = j;
                 }
@@ -138,7 +128,7 @@ TreeNode* neighbor_joining(vector<vector<double>> D, vector<string> labels) {
 }
 
 // Gradient-free branch length optimization
-void optimize_branch_lengths(TreeNode* tree, const vector<vector<double>>& D, const vector<string>& labels, double lr = 0.01, int iterations = 100) {
+static void optimize_branch_lengths(TreeNode* tree, const vector<vector<double>>& D, const vector<string>& labels, double lr = 0.01, int iterations = 100) {
     for (int iter = 0; iter < iterations; ++iter) {
         function<void(TreeNode*)> update_branch = [&](TreeNode* node) {
             if (!node || node->is_leaf()) return;
@@ -162,7 +152,7 @@ void optimize_branch_lengths(TreeNode* tree, const vector<vector<double>>& D, co
     }
 }
 
-TreeNode* run_fitch_margoliash(vector<vector<double>> D, vector<string> labels, double& final_error) {
+static TreeNode* run_fitch_margoliash(const vector<vector<double>>& D, const vector<string>& labels, double& final_error) {
     TreeNode* tree = neighbor_joining(D, labels);
     optimize_branch_lengths(tree, D, labels);
     final_error = compute_least_squares_error(D, tree, labels);
@@ -170,7 +160,7 @@ TreeNode* run_fitch_margoliash(vector<vector<double>> D, vector<string> labels,
 }
 
 // Convert tree to Newick string
-string to_newick(TreeNode* node) {
+static string to_newick(TreeNode* node) {
     if (node->is_leaf()) return node->name;
 
     string left = to_newick(node->left);
@@ -181,6 +171,78 @@ string to_newick(TreeNode* node) {
     return ss.str();
 }
 
+// Fitch-Margoliash over the square matrix M, recording joins in the Tree.
+// M and neighbour-joining's copy of it are the two n x n double matrices
+// the build holds.
+static void fitch_margoliash(const vector<vector<double>>& M, Tree& tree, bool verbose) {
+    int n = M.size();
+    vector<string> labels;
+    for (int i = 0; i < n; i++) labels.push_back(to_string(i));
+
+    double error;
+    TreeNode* root = run_fitch_margoliash(M, labels, error);
+    if (verbose) {
+        cout << "Fitch-Margoliash least squares error: " << error << endl;
+    }
+
+    // Replay the joins bottom-up; leaf i is tree node i
+    function<int(TreeNode*)> replay = [&](TreeNode* node) -> int {
+        if (node->is_leaf()) return stoi(node->name);
+        int child1 = replay(node->left);
+        int child2 = replay(node->right);
+        return tree.joinNodes(child1, child2, node->branch_length_left, node->branch_length_right);
+    };
+    replay(root);
+
+    function<void(TreeNode*)> release = [&](TreeNode* node) {
+        if (!node) return;
+        release(node->left);
+        release(node->right);
+        delete node;
+    };
+    release(root);
+}
+
+void fitch_margoliash(std::vector<dmatrix_row>& D, Tree& tree, bool verbose) {
+    int n = D.size();
+    if (n < 2) return;
+    vector<vector<double>> M(n, vector<double>(n, 0.0));
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < i; j++) M[i][j] = M[j][i] = D[i].distances[j];
+    }
+    fitch_margoliash(M, tree, verbose);
+}
+
+// Straight from the packed triangle, without float rows in between
+template <typename T>
+void fitch_margoliash(const packed_triangle<T>& D, Tree& tree, bool verbose) {
+    int n = D.n;
+    if (n < 2) return;
+    vector<vector<double>> M(n, vector<double>(n, 0.0));
+    for (int i = 0; i < n; i++) {
+        const T* row = D.row(i);
+        for (int j = 0; j < i; j++) M[i][j] = M[j][i] = double(row[j]);
+    }
+    fitch_margoliash(M, tree, verbose);
+}
+
+template void fitch_margoliash<float>(const packed_triangle<float>&, Tree&, bool);
+template void fitch_margoliash<double>(const packed_triangle<double>&, Tree&, bool);
+template void fitch_margoliash<half>(const packed_triangle<half>&, Tree&, bool);
+
+void fitch_margoliash_tree(std::vector<dmatrix_row>& D, std::string output, bool verbose) {
+    std::vector<std::string> names;
+    for (int i = 0; i < D.size(); i++) {
+        names.push_back(std::to_string(i));
+    }
+    Tree tree(names);
+    fitch_margoliash(D, tree, verbose);
+    std::vector<std::string> to_write = {tree.newick()};
+    write_to_file(output, to_write);
+}
+
+// Standalone demo on a 4-taxon matrix: g++ -DFM_DEMO fitch_margoliash.cpp tree.cpp tree_io.cpp
+#ifdef FM_DEMO
 int main() {
     vector<string> labels = {"A", "B", "C", "D"};
     vector<vector<double>> D = {
@@ -198,4 +260,5 @@ int main() {
     cout << "Newick format:\n" << newick << endl;
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
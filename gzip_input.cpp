@@ -0,0 +1,179 @@
+#include "tree.hpp"
+#include <iostream>
+#include <zlib.h>
+
+// BGZF blocks inflated per batch and thread; a block holds at most 64 KiB
+static const int blocks_per_thread = 16;
+
+static uint32_t read_le(const unsigned char* p, int bytes) {
+    uint32_t value = 0;
+    for (int b = bytes - 1; b >= 0; b--) value = value << 8 | p[b];
+    return value;
+}
+
+// Any gzip member: single-stream inflate. Concatenated members (as written
+// by `cat a.gz b.gz`) are read one after another.
+class gzip_buffer : public std::streambuf {
+public:
+    gzip_buffer(std::istream& file, const std::string& filename) : file(file), filename(filename), in(1 << 16), out(1 << 18) {
+        inflateInit2(&stream, 15 + 16);
+    }
+    ~gzip_buffer() override { inflateEnd(&stream); }
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        while (!failed) {
+            if (stream.avail_in == 0) {
+                file.read(in.data(), in.size());
+                stream.next_in = reinterpret_cast<Bytef*>(in.data());
+                stream.avail_in = file.gcount();
+                if (stream.avail_in == 0) {
+                    if (in_member) std::cerr << "Error: '" << filename << "' ends in the middle of a gzip stream" << std::endl;
+                    return traits_type::eof();
+                }
+            }
+            stream.next_out = reinterpret_cast<Bytef*>(out.data());
+            stream.avail_out = out.size();
+            in_member = true;
+            int status = inflate(&stream, Z_NO_FLUSH);
+            if (status == Z_STREAM_END) {
+                in_member = false;
+                inflateReset(&stream);
+            } else if (status != Z_OK && status != Z_BUF_ERROR) {
+                std::cerr << "Error: corrupt gzip data in '" << filename << "'" << std::endl;
+                failed = true;
+            }
+            size_t produced = out.size() - stream.avail_out;
+            if (produced > 0) {
+                setg(out.data(), out.data(), out.data() + produced);
+                return traits_type::to_int_type(*gptr());
+            }
+        }
+        return traits_type::eof();
+    }
+
+private:
+    std::istream& file;
+    std::string filename;
+    std::vector<char> in, out;
+    z_stream stream{};
+    bool in_member = false, failed = false;
+};
+
+// BGZF: independent deflate blocks whose header records the block size, so
+// a batch of blocks is read whole and inflated across threads
+class bgzf_buffer : public std::streambuf {
+public:
+    bgzf_buffer(std::istream& file, const std::string& filename, int threads)
+        : file(file), filename(filename), threads(resolve_threads(threads)) {}
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        // Blocks may inflate to nothing (the end-of-file marker)
+        while (refill()) {
+            if (!out.empty()) {
+                setg(out.data(), out.data(), out.data() + out.size());
+                return traits_type::to_int_type(*gptr());
+            }
+        }
+        return traits_type::eof();
+    }
+
+private:
+    std::istream& file;
+    std::string filename;
+    int threads;
+    std::vector<std::string> blocks;
+    std::vector<size_t> offset;
+    std::vector<char> out;
+    bool failed = false;
+
+    // The part of a block after its header: deflate data, CRC32 and size
+    bool read_block(std::string& block) {
+        unsigned char header[12];
+        if (!file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+            if (file.gcount() == 0) return false;
+            return corrupt("truncated block header");
+        }
+        if (header[0] != 0x1f || header[1] != 0x8b || !(header[3] & 4)) return corrupt("block is not BGZF");
+        uint32_t extra_length = read_le(header + 10, 2);
+        std::string extra(extra_length, '\0');
+        if (!file.read(&extra[0], extra_length)) return corrupt("truncated block header");
+
+        uint32_t block_size = 0;
+        for (size_t p = 0; p + 4 <= extra.size();) {
+            const unsigned char* field = reinterpret_cast<const unsigned char*>(extra.data() + p);
+            uint32_t length = read_le(field + 2, 2);
+            if (field[0] == 'B' && field[1] == 'C' && length == 2) block_size = read_le(field + 4, 2) + 1;
+            p += 4 + length;
+        }
+        if (block_size < sizeof(header) + extra_length + 8) return corrupt("block has no size field");
+
+        block.resize(block_size - sizeof(header) - extra_length);
+        if (!file.read(&block[0], block.size())) return corrupt("truncated block");
+        return true;
+    }
+
+    bool corrupt(const char* reason) {
+        std::cerr << "Error: " << reason << " in '" << filename << "'" << std::endl;
+        failed = true;
+        return false;
+    }
+
+    // Blocks read before a damaged one are still delivered
+    bool refill() {
+        if (failed) return false;
+        blocks.resize(size_t(threads) * blocks_per_thread);
+        size_t count = 0;
+        while (count < blocks.size() && read_block(blocks[count])) count++;
+        if (count == 0) return false;
+
+        // Each block ends with CRC32 and the inflated size
+        offset.assign(count + 1, 0);
+        for (size_t b = 0; b < count; b++) {
+            const std::string& block = blocks[b];
+            offset[b + 1] = offset[b] + read_le(reinterpret_cast<const unsigned char*>(block.data() + block.size() - 4), 4);
+        }
+        out.resize(offset[count]);
+
+        std::vector<char> ok(count, 1);
+        parallel_for(0, count, threads, [&](int b) {
+            const std::string& block = blocks[b];
+            const unsigned char* trailer = reinterpret_cast<const unsigned char*>(block.data() + block.size() - 8);
+            size_t expected = offset[b + 1] - offset[b];
+
+            z_stream stream{};
+            inflateInit2(&stream, -15);
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.data()));
+            stream.avail_in = block.size() - 8;
+            stream.next_out = reinterpret_cast<Bytef*>(out.data() + offset[b]);
+            stream.avail_out = expected;
+            int status = inflate(&stream, Z_FINISH);
+            bool complete = status == Z_STREAM_END && stream.total_out == expected;
+            inflateEnd(&stream);
+            uint32_t crc = crc32(0L, reinterpret_cast<const Bytef*>(out.data() + offset[b]), expected);
+            ok[b] = complete && crc == read_le(trailer, 4);
+        });
+        for (size_t b = 0; b < count; b++) {
+            if (!ok[b]) return corrupt("corrupt BGZF block");
+        }
+        return true;
+    }
+};
+
+std::unique_ptr<std::streambuf> open_decompressed(std::istream& file, const std::string& filename, int threads) {
+    unsigned char header[18] = {0};
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    size_t got = file.gcount();
+    file.clear();
+    file.seekg(0);
+    if (got < 2 || header[0] != 0x1f || header[1] != 0x8b) return nullptr;
+
+    // BGZF puts a 6-byte "BC" extra field first in every block header
+    bool bgzf = got == sizeof(header) && (header[3] & 4) && read_le(header + 10, 2) == 6 &&
+                header[12] == 'B' && header[13] == 'C' && read_le(header + 14, 2) == 2;
+    if (bgzf) return std::unique_ptr<std::streambuf>(new bgzf_buffer(file, filename, threads));
+    return std::unique_ptr<std::streambuf>(new gzip_buffer(file, filename));
+}
@@ -0,0 +1,429 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <cmath>
+
+// A sequence longer than chunk_bases is counted in chunks on several threads.
+// Its k-mers are sharded by code range into about shard_count shards, with
+// splitters taken from sample_windows windows of sample_bases spread over it.
+static const size_t chunk_bases = 1 << 22;
+static const int shard_count = 256;
+static const int sample_windows = 64;
+static const size_t sample_bases = 1024;
+static const int shard_index_bits = 16;
+// Codes are sorted radix_bits at a time once a list has radix_min_size codes
+static const int radix_bits = 11;
+static const size_t radix_min_size = 256;
+
+// Character -> symbol code table for an alphabet given as comma separated
+// groups; every character of a group maps to the group's index
+struct symbol_table {
+    int8_t code[256];
+
+    constexpr symbol_table(const char* groups) : code() {
+        for (int c = 0; c < 256; c++) code[c] = -1;
+        int group = 0;
+        for (const char* p = groups; *p; p++) {
+            if (*p == ',') {
+                group++;
+                continue;
+            }
+            code[(unsigned char)*p] = group;
+            if (*p >= 'A' && *p <= 'Z') code[(unsigned char)(*p - 'A' + 'a')] = group;
+        }
+    }
+};
+
+// Each alphabet fixes its symbol table and code width at compile time
+struct dna_alphabet {
+    static constexpr int bits = 2;
+    static constexpr bool complement = true;  // code 3 - c is the complementary base
+    static constexpr symbol_table table{"A,C,G,T"};
+};
+
+struct protein_alphabet {
+    static constexpr int bits = 5;
+    static constexpr bool complement = false;
+    static constexpr symbol_table table{"A,C,D,E,F,G,H,I,K,L,M,N,P,Q,R,S,T,V,W,Y"};
+};
+
+// Murphy et al. (2000) 10-letter reduction
+struct murphy10_alphabet {
+    static constexpr int bits = 4;
+    static constexpr bool complement = false;
+    static constexpr symbol_table table{"LVIM,C,A,G,ST,P,FYW,EDNQ,KR,H"};
+};
+
+// Dayhoff 6-letter groups
+struct dayhoff6_alphabet {
+    static constexpr int bits = 3;
+    static constexpr bool complement = false;
+    static constexpr symbol_table table{"AGPST,DENQ,HKR,ILMV,FWY,C"};
+};
+
+bool is_alphabet(const std::string& alphabet) {
+    return alphabet == "dna" || alphabet == "protein" || alphabet == "murphy10" || alphabet == "dayhoff6";
+}
+
+int max_kmer_length(const std::string& alphabet) {
+    if (alphabet == "protein") return 64 / protein_alphabet::bits;
+    if (alphabet == "murphy10") return 64 / murphy10_alphabet::bits;
+    if (alphabet == "dayhoff6") return 64 / dayhoff6_alphabet::bits;
+    return 64 / dna_alphabet::bits;
+}
+
+static inline uint64_t kmer_mask(int kmer_length, int bits) {
+    return kmer_length * bits >= 64 ? ~0ULL : (1ULL << (bits * kmer_length)) - 1;
+}
+
+// LSD radix sort, radix_bits at a time, over the bits in which the codes
+// differ from the smallest; short lists go to std::sort
+static void radix_sort(uint64_t* begin, uint64_t* end) {
+    size_t size = end - begin;
+    if (size < radix_min_size) {
+        std::sort(begin, end);
+        return;
+    }
+    auto [low, high] = std::minmax_element(begin, end);
+    uint64_t base = *low, range = *high - *low;
+    int passes = 0;
+    while (passes * radix_bits < 64 && range >> (passes * radix_bits)) passes++;
+    if (passes == 0) return;
+
+    const size_t buckets = size_t(1) << radix_bits;
+    std::vector<size_t> counts(buckets * passes, 0);
+    for (const uint64_t* p = begin; p < end; p++) {
+        uint64_t key = *p - base;
+        for (int pass = 0; pass < passes; pass++) counts[pass * buckets + ((key >> (pass * radix_bits)) & (buckets - 1))]++;
+    }
+    std::vector<uint64_t> buffer(size);
+    uint64_t *from = begin, *to = buffer.data();
+    for (int pass = 0; pass < passes; pass++) {
+        size_t* count = counts.data() + pass * buckets;
+        for (size_t b = 0, position = 0; b < buckets; b++) {
+            size_t n = count[b];
+            count[b] = position;
+            position += n;
+        }
+        for (const uint64_t* p = from; p < from + size; p++) to[count[((*p - base) >> (pass * radix_bits)) & (buckets - 1)]++] = *p;
+        std::swap(from, to);
+    }
+    if (from != begin) std::copy(from, from + size, begin);
+}
+
+// Collapse a list of k-mer codes into sorted distinct codes and counts
+static void collapse(std::vector<uint64_t>::iterator begin, std::vector<uint64_t>::iterator end,
+                     std::vector<uint64_t>& kmers, std::vector<float>& counts) {
+    radix_sort(&*begin, &*begin + (end - begin));
+    for (auto i = begin; i != end;) {
+        auto j = i;
+        while (j != end && *j == *i) j++;
+        kmers.push_back(*i);
+        counts.push_back(j - i);
+        i = j;
+    }
+}
+
+static kmer_profile to_profile(std::vector<uint64_t>& codes) {
+    kmer_profile profile;
+    collapse(codes.begin(), codes.end(), profile.kmers, profile.counts);
+    profile.total = codes.size();
+    return profile;
+}
+
+// One scan of `seq`: the encoding of the longest k (and, for DNA, its reverse
+// complement) is rolled once, and every shorter k is sliced out of it. The
+// first `skip` characters only prime the encoding; k-mers ending in them
+// belong to the chunk before.
+template <typename Alphabet>
+static void collect_kmers(std::string_view seq, const std::vector<int>& kmer_lengths, bool canonical,
+                          std::vector<std::vector<uint64_t>>& codes, size_t skip = 0) {
+    constexpr int bits = Alphabet::bits;
+    int max_k = *std::max_element(kmer_lengths.begin(), kmer_lengths.end());
+    uint64_t max_mask = kmer_mask(max_k, bits);
+    uint64_t forward = 0, reverse = 0;
+    int valid = 0;  // Length of the current run of alphabet symbols
+
+    std::vector<uint64_t> masks(kmer_lengths.size());
+    for (size_t k = 0; k < kmer_lengths.size(); k++) {
+        masks[k] = kmer_mask(kmer_lengths[k], bits);
+        codes[k].clear();
+        if (seq.size() >= kmer_lengths[k] + skip) codes[k].reserve(seq.size() - skip - kmer_lengths[k] + 1);
+    }
+
+    for (size_t position = 0; position < seq.size(); position++) {
+        int code = Alphabet::table.code[(unsigned char)seq[position]];
+        if (code < 0) {
+            valid = 0;
+            continue;
+        }
+        forward = ((forward << bits) | code) & max_mask;
+        if constexpr (Alphabet::complement) {
+            reverse = (reverse >> bits) | (uint64_t(3 - code) << (bits * (max_k - 1)));
+        }
+        valid++;
+        if (position < skip) continue;
+
+        for (size_t k = 0; k < kmer_lengths.size(); k++) {
+            int length = kmer_lengths[k];
+            if (valid < length) continue;
+            uint64_t kmer = forward & masks[k];
+            if constexpr (Alphabet::complement) {
+                if (canonical) {
+                    uint64_t rc = reverse >> (bits * (max_k - length));
+                    kmer = std::min(kmer, rc);
+                }
+            }
+            codes[k].push_back(kmer);
+        }
+    }
+}
+
+// One long sequence, for one k. Chunks are scanned in parallel, each also
+// scanning the k - 1 bases before it, and their codes are placed by shard
+// into one array: one pass counts every chunk's share of every shard, a
+// second scan writes the codes. Each shard is then sorted and collapsed by
+// itself, and as the shards are ranges of codes, the profile is the shards'
+// results in order, exactly as a serial count.
+template <typename Alphabet>
+static kmer_profile count_long(std::string_view seq, int kmer_length, bool canonical, int threads) {
+    std::vector<int> lengths{kmer_length};
+    size_t overlap = kmer_length - 1;
+    size_t chunks = (seq.size() + chunk_bases - 1) / chunk_bases;
+    auto scan = [&](size_t c, std::vector<std::vector<uint64_t>>& codes) {
+        size_t begin = c * chunk_bases, from = begin - std::min(begin, overlap);
+        collect_kmers<Alphabet>(seq.substr(from, std::min(seq.size(), begin + chunk_bases) - from), lengths, canonical, codes, begin - from);
+    };
+
+    std::vector<uint64_t> samples, splitters;
+    std::vector<std::vector<uint64_t>> codes(1);
+    for (int w = 0; w < sample_windows; w++) {
+        collect_kmers<Alphabet>(seq.substr(seq.size() / sample_windows * w, sample_bases + overlap), lengths, canonical, codes);
+        samples.insert(samples.end(), codes[0].begin(), codes[0].end());
+    }
+    std::sort(samples.begin(), samples.end());
+    for (int s = 1; s < shard_count && !samples.empty(); s++) splitters.push_back(samples[samples.size() * s / shard_count]);
+    splitters.erase(std::unique(splitters.begin(), splitters.end()), splitters.end());
+    size_t shards = splitters.size() + 1;
+    // The top bits of a code give its first candidate shard
+    int width = std::min(64, Alphabet::bits * kmer_length);
+    int shift = std::max(0, width - shard_index_bits);
+    std::vector<uint32_t> first_shard(((kmer_mask(kmer_length, Alphabet::bits) >> shift) + 1));
+    for (size_t top = 0; top < first_shard.size(); top++) {
+        first_shard[top] = std::upper_bound(splitters.begin(), splitters.end(), uint64_t(top) << shift) - splitters.begin();
+    }
+    auto shard_of = [&](uint64_t code) {
+        size_t shard = first_shard[code >> shift];
+        while (shard < splitters.size() && splitters[shard] <= code) shard++;
+        return shard;
+    };
+
+    std::vector<std::vector<size_t>> offset(chunks, std::vector<size_t>(shards + 1, 0));
+    parallel_for(0, chunks, threads, [&](int c) {
+        std::vector<std::vector<uint64_t>> codes(1);
+        scan(c, codes);
+        for (uint64_t code : codes[0]) offset[c][shard_of(code)]++;
+    });
+    // Shard-major layout: shard s holds the codes of chunk 0, then chunk 1...
+    std::vector<size_t> start(shards + 1, 0);
+    size_t position = 0;
+    for (size_t s = 0; s < shards; s++) {
+        start[s] = position;
+        for (size_t c = 0; c < chunks; c++) {
+            size_t count = offset[c][s];
+            offset[c][s] = position;
+            position += count;
+        }
+    }
+    start[shards] = position;
+    std::vector<uint64_t> placed(position);
+    parallel_for(0, chunks, threads, [&](int c) {
+        std::vector<std::vector<uint64_t>> codes(1);
+        scan(c, codes);
+        std::vector<size_t>& next = offset[c];
+        for (uint64_t code : codes[0]) placed[next[shard_of(code)]++] = code;
+    });
+
+    std::vector<kmer_profile> parts(shards);
+    parallel_for(0, shards, threads, [&](int s) {
+        collapse(placed.begin() + start[s], placed.begin() + start[s + 1], parts[s].kmers, parts[s].counts);
+    });
+    std::vector<uint64_t>().swap(placed);
+    std::vector<size_t> first(shards + 1, 0);
+    for (size_t s = 0; s < shards; s++) first[s + 1] = first[s] + parts[s].kmers.size();
+    kmer_profile profile;
+    profile.kmers.resize(first[shards]);
+    profile.counts.resize(first[shards]);
+    parallel_for(0, shards, threads, [&](int s) {
+        std::copy(parts[s].kmers.begin(), parts[s].kmers.end(), profile.kmers.begin() + first[s]);
+        std::copy(parts[s].counts.begin(), parts[s].counts.end(), profile.counts.begin() + first[s]);
+        parts[s] = kmer_profile();
+    });
+    profile.total = position;
+    return profile;
+}
+
+// Sequences up to chunk_bases are counted in parallel, one per task; each
+// longer one is then counted with all threads
+template <typename Alphabet>
+static std::vector<std::vector<kmer_profile>> count_profiles(const sequence_view& sequences, const std::vector<int>& kmer_lengths,
+                                                             bool canonical, int threads) {
+    std::vector<std::vector<kmer_profile>> profiles(kmer_lengths.size(), std::vector<kmer_profile>(sequences.seq.size()));
+    std::vector<int> shorter, longer;
+    for (size_t i = 0; i < sequences.seq.size(); i++) (sequences.seq[i].size() > chunk_bases ? longer : shorter).push_back(i);
+
+    parallel_for(0, shorter.size(), threads, [&](int s) {
+        int i = shorter[s];
+        std::vector<std::vector<uint64_t>> codes(kmer_lengths.size());
+        collect_kmers<Alphabet>(sequences.seq[i], kmer_lengths, canonical, codes);
+        for (size_t k = 0; k < kmer_lengths.size(); k++) {
+            profiles[k][i] = to_profile(codes[k]);
+        }
+    });
+    for (int i : longer) {
+        for (size_t k = 0; k < kmer_lengths.size(); k++) {
+            profiles[k][i] = count_long<Alphabet>(sequences.seq[i], kmer_lengths[k], canonical, threads);
+        }
+    }
+    return profiles;
+}
+
+std::vector<std::vector<kmer_profile>> count_kmer_profiles(const sequence_view& sequences, const std::vector<int>& kmer_lengths, bool canonical,
+                                                           const std::string& alphabet, int threads) {
+    if (alphabet == "protein") return count_profiles<protein_alphabet>(sequences, kmer_lengths, canonical, threads);
+    if (alphabet == "murphy10") return count_profiles<murphy10_alphabet>(sequences, kmer_lengths, canonical, threads);
+    if (alphabet == "dayhoff6") return count_profiles<dayhoff6_alphabet>(sequences, kmer_lengths, canonical, threads);
+    return count_profiles<dna_alphabet>(sequences, kmer_lengths, canonical, threads);
+}
+
+std::vector<kmer_profile> count_kmer_profiles(const sequence_view& sequences, int kmer_length, bool canonical, const std::string& alphabet, int threads) {
+    return std::move(count_kmer_profiles(sequences, std::vector<int>{kmer_length}, canonical, alphabet, threads)[0]);
+}
+
+bool is_distance_method(const std::string& method) {
+    return method == "fractional" || method == "mahalanobis" || method == "cosine" || is_alignment_method(method);
+}
+
+distance_method parse_distance_method(const std::string& method) {
+    if (method == "cosine") return distance_method::cosine;
+    if (method == "mahalanobis") return distance_method::mahalanobis;
+    return distance_method::fractional;
+}
+
+// Same measures as distance_matrix() on dense frequencies, as a merge over the
+// sorted k-mers. Method and accumulator type are fixed at compile time.
+template <distance_method Method, typename Acc>
+static float profile_distance_kernel(const kmer_profile& a, const kmer_profile& b) {
+    size_t i = 0, j = 0;
+    Acc distance = 0;
+
+    if constexpr (Method == distance_method::cosine) {
+        Acc dot = 0, norm1 = 0, norm2 = 0;
+        for (float c : a.counts) norm1 += Acc(c) * c;
+        for (float c : b.counts) norm2 += Acc(c) * c;
+        if (norm1 == 0 || norm2 == 0) {
+            return 1.0;  // Maximum distance for sequences with no k-mers
+        }
+        while (i < a.kmers.size() && j < b.kmers.size()) {
+            if (a.kmers[i] < b.kmers[j]) i++;
+            else if (a.kmers[i] > b.kmers[j]) j++;
+            else dot += Acc(a.counts[i++]) * b.counts[j++];
+        }
+        return 1 - (dot / (std::sqrt(norm1) * std::sqrt(norm2)));
+    } else {
+        if (a.total == 0 || b.total == 0) {
+            return 1.0;  // Maximum distance for sequences with no k-mers
+        }
+        Acc scale_a = Acc(1) / a.total, scale_b = Acc(1) / b.total;
+        while (i < a.kmers.size() || j < b.kmers.size()) {
+            Acc p = 0, q = 0;
+            if (j == b.kmers.size() || (i < a.kmers.size() && a.kmers[i] < b.kmers[j])) {
+                p = a.counts[i++] * scale_a;
+            } else if (i == a.kmers.size() || b.kmers[j] < a.kmers[i]) {
+                q = b.counts[j++] * scale_b;
+            } else {
+                p = a.counts[i++] * scale_a;
+                q = b.counts[j++] * scale_b;
+            }
+            if constexpr (Method == distance_method::mahalanobis) {
+                distance += (p - q) * (p - q) / (p + q);
+            } else {
+                distance += std::abs(p - q);
+            }
+        }
+        if constexpr (Method == distance_method::mahalanobis) {
+            return std::sqrt(distance);
+        } else {
+            return distance / 2;  // Normalize to [0,1] range
+        }
+    }
+}
+
+profile_distance_fn profile_distance_function(distance_method method) {
+    switch (method) {
+        case distance_method::cosine: return profile_distance_kernel<distance_method::cosine, double>;
+        case distance_method::mahalanobis: return profile_distance_kernel<distance_method::mahalanobis, double>;
+        default: return profile_distance_kernel<distance_method::fractional, double>;
+    }
+}
+
+float profile_distance(const kmer_profile& a, const kmer_profile& b, const std::string& method) {
+    return profile_distance_function(parse_distance_method(method))(a, b);
+}
+
+template <typename T>
+packed_triangle<T> profile_distance_triangle(const std::vector<kmer_profile>& profiles, distance_method method, int threads) {
+    profile_distance_fn distance = profile_distance_function(method);
+    packed_triangle<T> D(profiles.size());
+    parallel_for(0, profiles.size(), threads, [&](int i) {
+        T* row = D.row(i);
+        for (int j = 0; j < i; j++) row[j] = T(distance(profiles[i], profiles[j]));
+    });
+    return D;
+}
+
+template packed_triangle<float> profile_distance_triangle<float>(const std::vector<kmer_profile>&, distance_method, int);
+template packed_triangle<double> profile_distance_triangle<double>(const std::vector<kmer_profile>&, distance_method, int);
+template packed_triangle<half> profile_distance_triangle<half>(const std::vector<kmer_profile>&, distance_method, int);
+
+static std::vector<std::vector<dmatrix_row>> fill_distance_matrices(const std::vector<const std::vector<kmer_profile>*>& profiles, const std::string& method, int threads) {
+    std::vector<std::vector<dmatrix_row>> matrices(profiles.size());
+    int n = profiles.empty() ? 0 : profiles[0]->size();
+    profile_distance_fn distance = profile_distance_function(parse_distance_method(method));
+
+    for (auto& D : matrices) {
+        D.resize(n);
+        for (int i = 0; i < n; i++) {
+            D[i].distances.assign(n, 0.0f);
+            D[i].id = i;
+            D[i].sum = 0;
+        }
+    }
+
+    // Each pair is visited once and scored at every k
+    parallel_for(0, n, threads, [&](int i) {
+        for (int j = 0; j < i; j++) {
+            for (size_t k = 0; k < profiles.size(); k++) {
+                float d = distance((*profiles[k])[i], (*profiles[k])[j]);
+                matrices[k][i].distances[j] = d;
+                matrices[k][j].distances[i] = d;
+            }
+        }
+    });
+
+    for (auto& D : matrices) {
+        for (auto& row : D) {
+            for (float d : row.distances) row.sum += d;
+        }
+    }
+    return matrices;
+}
+
+std::vector<std::vector<dmatrix_row>> distance_matrices(const std::vector<std::vector<kmer_profile>>& profiles, std::string method, int threads) {
+    std::vector<const std::vector<kmer_profile>*> sets;
+    for (const auto& set : profiles) sets.push_back(&set);
+    return fill_distance_matrices(sets, method, threads);
+}
+
+std::vector<dmatrix_row> distance_matrix(const std::vector<kmer_profile>& profiles, std::string method, int threads) {
+    return std::move(fill_distance_matrices({&profiles}, method, threads)[0]);
+}
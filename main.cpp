@@ -5,6 +5,10 @@
 #include <fstream>   // Required for ifstream (file handling)
 #include <vector>    // Required for vector
 #include <string>    // Required for string
+#include <sstream>
+#include <algorithm>
+#include <memory>
+#include <cstdio>
 
 using namespace std;
 
@@ -13,22 +17,96 @@ void help() {
               << "1st argument:\n"
               << "            filename of the sequences ['.fasta'] format.\n"
               << "            or\n"
-              << "            [-random INT] : generate a random distance matrix of size INT x INT and create a Newick format tree with INT leaf nodes\n\n"
+              << "            [-random INT] : generate a random distance matrix of size INT x INT and create a Newick format tree with INT leaf nodes\n"
+              << "            or\n"
+              << "            [-serve SOCKET] : answer tree requests on a Unix domain socket, keeping reference panels in memory\n\n"
               << "Additional arguments: \n"
               << "Algorithm selection:\n"
               << "            [-nj] : Neighbor-Joining algorithm (default)\n"
               << "            [-fm] : Fitch-Margoliash algorithm\n"
               << "            [-upgma] : UPGMA algorithm\n"
-              << "            [-me] : Minimum Evolution algorithm\n\n"
+              << "            [-me] : Minimum Evolution algorithm\n"
+              << "            [-algorithms LIST] : one tree per algorithm of LIST (e.g. nj,me,upgma), built\n"
+              << "                                 concurrently from one distance matrix and written to\n"
+              << "                                 <output>_<algorithm>.txt\n"
+              << "            [-all] : the same for nj, upgma, me and fm\n"
+              << "            [-time-limit SECONDS] : anytime -fm and -me: start from a neighbour-joining tree and\n"
+              << "                                    refine it until SECONDS after the start, writing the best\n"
+              << "                                    tree so far to the output file as it improves\n\n"
               << "Methods for calculating the distance matrix based on kmer profiles of sequences:  \n\n"
               << "            [-m] : mahalanobis; \n"
               << "            [-c] : cosine. \n"
               << "            (default: fractional k-mer count)\n\n"
-              << "kmer-length (default 8): \n"
-              << "            [-k INT]:\n\n"
+              << "Methods for aligned sequences (all sequences must have the same length):\n\n"
+              << "            [-p] : p-distance; \n"
+              << "            [-jc69] : Jukes-Cantor; \n"
+              << "            [-k2p] : Kimura two-parameter. \n\n"
+              << "Storage precision of the distance matrix (default: float32):\n"
+              << "            [-precision NAME] : float32, float64 or float16 (half the memory of float32);\n"
+              << "                                arithmetic is done in double either way\n\n"
+              << "Threads (default: all hardware threads): \n"
+              << "            [-threads INT]\n"
+              << "            [-staged] : read, count and compare concurrently through bounded queues,\n"
+              << "                        so counting and distances start before the file is read\n\n"
+              << "Alphabet for k-mer counting (default: dna):\n"
+              << "            [-alphabet NAME] : dna, protein, murphy10 or dayhoff6 (reduced amino-acid alphabets)\n"
+              << "                               letters of either case are counted, soft-masked bases included\n\n"
+              << "kmer-length (default 8; at most 32 for dna, 12 for protein, 16 for murphy10, 21 for dayhoff6): \n"
+              << "            [-k INT]:\n"
+              << "            [-multi-k LIST] : one tree per k-mer length from a single counting pass,\n"
+              << "                              LIST is a range (6-12) or comma separated (6,8,10);\n"
+              << "                              trees are written to <output>_k<INT>.txt\n"
+              << "            [-canonical] : count each k-mer together with its reverse complement\n\n"
               << "Number of replicates to parse in .paml files of synthetic sequences (default 1): \n"
               << "            [-replicates INT]\n"
               << "            Outputs INT Newick trees each based on a different set of replicate sequences.\n\n"
+              << "Sharded distance matrix (for very large inputs):\n"
+              << "            [-write-profiles FILE] : count k-mer profiles of the FASTA input and save them to FILE\n"
+              << "            [-shard I/N] : with a profile file as input, compute the I-th of N ranges of matrix tiles\n"
+              << "                           and write them to tiles_I.bin\n"
+              << "            [-tile-size INT] : rows per tile (default 512)\n"
+              << "            [-merge-tiles FILE...] : with a profile file as input, assemble the tile files and build the tree\n\n"
+              << "Bootstrap:  [-bootstrap INT] : build INT resampled replicate trees, written to bootstrap_tree_<j>.txt\n"
+              << "                               and together to the binary archive bootstrap_trees.bin;\n"
+              << "                               their majority-rule consensus goes to bootstrap_consensus.txt\n"
+              << "            [-archive-tree INT] : with a tree archive as input, write its INT-th tree as Newick\n\n"
+              << "Tree comparison (input is a tree archive or Newick file):\n"
+              << "            [-rf FILE...] : Robinson-Foulds distances between all trees of the input and FILEs\n"
+              << "            [-nrf FILE...] : the same, normalized by the number of splits of each pair\n"
+              << "            [-consensus majority|greedy] : consensus tree of all trees of the input with\n"
+              << "                                           support values in percent\n\n"
+              << "Duplicates:\n"
+              << "            [-dedup] : build the tree on one copy of each identical sequence and attach\n"
+              << "                       the copies to it with zero-length branches\n"
+              << "            [-collapse FLOAT] : also merge sequences within this k-mer distance of an earlier\n"
+              << "                                representative, attached at their distance to it\n\n"
+              << "Large inputs:\n"
+              << "            [-sparse K] : average linkage over each sequence's K nearest neighbours found by\n"
+              << "                          MinHash banding, without the all-pairs matrix (UPGMA only)\n"
+              << "            [-divide SIZE] : cut a guide tree into subsets of at most SIZE sequences, build\n"
+              << "                             their trees in parallel and join them through a backbone tree\n\n"
+              << "Checkpoints:\n"
+              << "            [-checkpoint PREFIX] : save the k-mer profiles to PREFIX.profiles and the matrix\n"
+              << "                                   and NJ, UPGMA or ME merge state to PREFIX.merge\n"
+              << "            [-checkpoint-interval SECONDS] : time between snapshots, also of the bootstrap\n"
+              << "                                             archive (default 600)\n"
+              << "            [-resume] : continue from the PREFIX files, or from bootstrap_trees.bin\n\n"
+              << "Distance matrices:\n"
+              << "            [-phylip] : the input is a relaxed PHYLIP distance matrix (square or lower-triangular)\n"
+              << "            [-write-matrix FILE] : also write the distance matrix to FILE in PHYLIP format\n"
+              << "            [-lower-triangle] : write it as a lower triangle instead of a square\n\n"
+              << "Memory:     [-max-mem SIZE] : estimate the footprint before starting (e.g. 8G) and switch to\n"
+              << "                              -staged, fewer threads, no -fit, lower precision, (UPGMA)\n"
+              << "                              -sparse or -divide to fit; stop early when nothing fits\n\n"
+              << "Reference sketch database:\n"
+              << "            [-build-db FILE] : add the FASTA input's MinHash sketches and k-mer profiles to the\n"
+              << "                               database FILE, creating it if needed\n"
+              << "            [-query FILE] : the FASTA input holds queries; write each one's nearest references\n"
+              << "                            in database FILE to the output file\n"
+              << "            [-neighbors INT] : references reported per query (default 10)\n"
+              << "            [-query-tree] : also build a tree of each query and its neighbours, written to\n"
+              << "                            <output>_trees.txt\n\n"
+              << "Tree fit:   [-fit] : report the least-squares fit of the tree to the distance matrix\n\n"
               << "Verbose:    [-v]\n";
 }
 
@@ -77,37 +155,97 @@ void random_newick_tree(int size, std::string algorithm, std::string output, boo
     }
 }
 
+static void print_tree_fit(const tree_fit& fit) {
+    cout << "Tree length: " << fit.tree_length << endl
+         << "Least squares: " << fit.sum_squares << " (weighted by 1/D^2: " << fit.weighted_sum_squares << ")" << endl
+         << "Residuals over " << fit.pairs << " pairs: mean " << fit.mean_residual
+         << ", largest " << fit.max_residual << endl
+         << "Average percent standard deviation: " << fit.percent_sd << endl;
+}
+
+void fasta_to_newick(std::string filename, const pipeline_options& options, std::string output) {
+    pipeline_result result = build_tree_from_fasta(filename, options);
+
+    cout << "Generated Tree: " << result.newick << endl;
+    if (options.fit) print_tree_fit(result.fit);
+
+    vector<string> to_write = {result.newick};
+    write_to_file(output, to_write);
+}
+
 void fasta_to_newick(std::string filename, int kmer_length, std::string method, std::string algorithm, std::string output, bool verbose) {
-    sequence sequences = read_fasta(filename);
-    vector<vector<float>> frequencies = count_kmer_frequencies(sequences, kmer_length);
-    vector<dmatrix_row> D = distance_matrix(frequencies, sequences, kmer_length, method);
+    pipeline_options options;
+    options.kmer_length = kmer_length;
+    options.method = method;
+    options.algorithm = algorithm;
+    options.keep_matrix = false;
+    options.verbose = verbose;
+    fasta_to_newick(filename, options, output);
+}
 
-    if (verbose) {
-        cout << "Number of sequences: " << sequences.seq.size() << endl;
-        cout << "Bootstrap Tree Generation for: " << filename << endl;
+
+// Parse a k-mer length list such as "6-12" or "6,8,10"
+std::vector<int> parse_kmer_lengths(const std::string& list) {
+    std::vector<int> lengths;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t dash = item.find('-');
+        if (dash != std::string::npos) {
+            int first = std::stoi(item.substr(0, dash));
+            int last = std::stoi(item.substr(dash + 1));
+            for (int k = first; k <= last; k++) lengths.push_back(k);
+        } else if (!item.empty()) {
+            lengths.push_back(std::stoi(item));
+        }
     }
+    return lengths;
+}
 
-    Tree tree(sequences);
+// output.txt -> output_nj.txt
+std::string algorithm_output_name(const std::string& output, const std::string& algorithm) {
+    size_t dot = output.find_last_of('.');
+    if (dot == std::string::npos) return output + "_" + algorithm;
+    return output.substr(0, dot) + "_" + algorithm + output.substr(dot);
+}
 
-    if (algorithm == "fm") {
-        fitch_margoliash(D, tree, verbose);
-    } else if (algorithm == "upgma") {
-        upgma(D, tree, verbose);
-    } else if (algorithm == "me") {
-        minimum_evolution(D, tree, verbose);
-    } else {
-        neighbor_joining(D, tree, verbose);
-    }
+// The tree of a matrix assembled from -shard tile files, at -precision
+template <typename T>
+static bool tree_from_tiles(const std::vector<std::string>& tile_files, const std::vector<std::string>& names,
+                            const pipeline_options& options, pipeline_result& result) {
+    packed_triangle<T> D;
+    if (!merge_distance_tiles(tile_files, names.size(), D)) return false;
+    result = tree_from_triangle(D, names, options);
+    return true;
+}
 
-    // **Debugging: Print the tree for each bootstrap**
-    cout << "Generated Bootstrap Tree: " << tree.newick << endl;
+void fasta_to_newick_multi_k(std::string filename, const std::vector<int>& kmer_lengths, const pipeline_options& options, std::string output) {
+    sequence sequences = read_fasta(filename);
+    std::vector<pipeline_result> results = build_trees(view_sequences(sequences), options, kmer_lengths);
 
-    vector<string> to_write = {tree.newick};
-    write_to_file(output, to_write);
+    for (size_t k = 0; k < kmer_lengths.size(); k++) {
+        std::string name = kmer_output_name(output, kmer_lengths[k]);
+        cout << "k = " << kmer_lengths[k] << ": " << results[k].newick << " -> " << name << endl;
+        write_to_file(name, {results[k].newick});
+    }
+}
+
+// The trees of build_trees_from_fasta or build_trees_from_phylip, in the
+// order of options.algorithms
+static bool write_algorithm_trees(const std::vector<pipeline_result>& results, const pipeline_options& options, std::string output) {
+    if (results.size() != options.algorithms.size()) return false;
+    for (size_t a = 0; a < results.size(); a++) {
+        std::string name = algorithm_output_name(output, options.algorithms[a]);
+        cout << options.algorithms[a] << ": " << results[a].newick << " -> " << name << endl;
+        if (options.fit) print_tree_fit(results[a].fit);
+        write_to_file(name, {results[a].newick});
+    }
+    return true;
 }
 
 
 int main(int argc, char** argv) {
+    auto started = std::chrono::steady_clock::now();
     if (argc < 2) {
         help();
         return 1;
@@ -118,52 +256,453 @@ int main(int argc, char** argv) {
     std::string algorithm = "nj";  // default to neighbor-joining
     std::string output = "output.txt";
     int kmer_length = 8;
+    std::vector<int> kmer_lengths;
+    std::vector<std::string> algorithms;
+    double time_limit = 0;
     int n_replicates = 1;
+    int threads = 0;
+    bool canonical = false;
+    std::string alphabet = "dna";
+    precision storage = precision::float32;
     bool verbose = false;
+    bool staged = false;
+    bool fit = false;
+    std::string checkpoint;
+    double checkpoint_interval = 600;
+    bool resume = false;
+    bool dedup = false;
+    double collapse_distance = 0;
+    int sparse_neighbors = 0;
+    int divide_size = 0;
+    size_t max_memory = 0;
+    bool phylip_input = false;
+    std::string matrix_output;
+    bool matrix_lower = false;
+    std::string profile_output;
+    std::string shard;
+    int tile_size = 512;
+    std::vector<std::string> tile_files;
+    int archive_tree = -1;
+    std::vector<std::string> rf_files;
+    bool rf = false, normalized_rf = false;
+    std::string consensus;
+    std::string database_output, database_query;
+    int query_neighbors = 10;
+    bool query_tree = false;
+    bool bootstrap = false;
+    bool algorithm_chosen = false;  // -nj, -upgma, -me or -fm given, not the default
 
     for (int i = 2; i < argc; i++) {
         std::string arg = argv[i];
+        if (arg == "-nj" || arg == "-upgma" || arg == "-me" || arg == "-fm") algorithm_chosen = true;
         if (arg == "-m") method = "mahalanobis";
         else if (arg == "-c") method = "cosine";
+        else if (arg == "-p") method = "p";
+        else if (arg == "-jc69") method = "jc69";
+        else if (arg == "-k2p") method = "k2p";
+        else if (arg == "-threads" && i + 1 < argc) threads = std::stoi(argv[++i]);
         else if (arg == "-nj") algorithm = "nj";
         else if (arg == "-fm") algorithm = "fm";
         else if (arg == "-upgma") algorithm = "upgma";
         else if (arg == "-me") algorithm = "me";
+        else if (arg == "-time-limit" && i + 1 < argc) time_limit = std::stod(argv[++i]);
+        else if (arg == "-all") algorithms = {"nj", "upgma", "me", "fm"};
+        else if (arg == "-algorithms" && i + 1 < argc) {
+            algorithms.clear();
+            std::stringstream list(argv[++i]);
+            std::string name;
+            while (std::getline(list, name, ',')) {
+                if (name.empty()) continue;
+                if (!is_algorithm(name)) {
+                    std::cerr << "Error: unknown algorithm '" << name << "' in -algorithms" << std::endl;
+                    return 1;
+                }
+                if (std::find(algorithms.begin(), algorithms.end(), name) == algorithms.end()) algorithms.push_back(name);
+            }
+        }
         else if (arg == "-k" && i + 1 < argc) kmer_length = std::stoi(argv[++i]);
+        else if (arg == "-multi-k" && i + 1 < argc) kmer_lengths = parse_kmer_lengths(argv[++i]);
+        else if (arg == "-canonical") canonical = true;
+        else if (arg == "-alphabet" && i + 1 < argc) alphabet = argv[++i];
+        else if (arg == "-precision" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (!parse_precision(name, storage)) {
+                std::cerr << "Error: unknown precision '" << name << "'" << std::endl;
+                return 1;
+            }
+        }
         else if (arg == "-replicates" && i + 1 < argc) n_replicates = std::stoi(argv[++i]);
         else if (arg == "-v") verbose = true;
+        else if (arg == "-staged") staged = true;
+        else if (arg == "-fit") fit = true;
+        else if (arg == "-checkpoint" && i + 1 < argc) checkpoint = argv[++i];
+        else if (arg == "-checkpoint-interval" && i + 1 < argc) checkpoint_interval = std::stod(argv[++i]);
+        else if (arg == "-resume") resume = true;
+        else if (arg == "-dedup") dedup = true;
+        else if (arg == "-collapse" && i + 1 < argc) collapse_distance = std::stod(argv[++i]);
+        else if (arg == "-sparse" && i + 1 < argc) sparse_neighbors = std::stoi(argv[++i]);
+        else if (arg == "-divide" && i + 1 < argc) divide_size = std::stoi(argv[++i]);
+        else if (arg == "-max-mem" && i + 1 < argc) {
+            if (!parse_memory_size(argv[++i], max_memory)) {
+                std::cerr << "Error: -max-mem expects a size such as 512M or 16G" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "-phylip") phylip_input = true;
+        else if (arg == "-write-matrix" && i + 1 < argc) matrix_output = argv[++i];
+        else if (arg == "-lower-triangle") matrix_lower = true;
+        else if (arg == "-write-profiles" && i + 1 < argc) profile_output = argv[++i];
+        else if (arg == "-shard" && i + 1 < argc) shard = argv[++i];
+        else if (arg == "-tile-size" && i + 1 < argc) tile_size = std::stoi(argv[++i]);
+        else if (arg == "-archive-tree" && i + 1 < argc) archive_tree = std::stoi(argv[++i]);
+        else if (arg == "-rf" || arg == "-nrf") {
+            rf = true;
+            normalized_rf = arg == "-nrf";
+            while (i + 1 < argc && argv[i + 1][0] != '-') rf_files.push_back(argv[++i]);
+        }
+        else if (arg == "-consensus" && i + 1 < argc) consensus = argv[++i];
+        else if (arg == "-build-db" && i + 1 < argc) database_output = argv[++i];
+        else if (arg == "-query" && i + 1 < argc) database_query = argv[++i];
+        else if (arg == "-neighbors" && i + 1 < argc) query_neighbors = std::stoi(argv[++i]);
+        else if (arg == "-query-tree") query_tree = true;
+        else if (arg == "-bootstrap") bootstrap = true;  // built further down
+        else if (arg == "-merge-tiles") {
+            while (i + 1 < argc && argv[i + 1][0] != '-') tile_files.push_back(argv[++i]);
+        }
     }
 
-    // Read sequences **inside** main before passing to functions
-    sequence sequences = read_fasta(input);
+    if (!is_alphabet(alphabet)) {
+        std::cerr << "Error: unknown alphabet '" << alphabet << "'" << std::endl;
+        return 1;
+    }
+    // Only DNA has a reverse complement; files must not record it otherwise
+    if (canonical && alphabet != "dna") {
+        std::cerr << "Warning: -canonical only applies to dna and is ignored for " << alphabet << std::endl;
+        canonical = false;
+    }
+    std::vector<int> all_lengths = kmer_lengths;
+    all_lengths.push_back(kmer_length);
+    for (int k : all_lengths) {
+        if (k < 1 || k > max_kmer_length(alphabet)) {
+            std::cerr << "Error: k-mer length for " << alphabet << " must be between 1 and "
+                      << max_kmer_length(alphabet) << " (got " << k << ")" << std::endl;
+            return 1;
+        }
+    }
+    // A single algorithm is an ordinary build
+    if (algorithms.size() == 1) {
+        algorithm = algorithms[0];
+        algorithms.clear();
+    }
+    if (!kmer_lengths.empty() && is_alignment_method(method)) {
+        std::cerr << "Error: -multi-k needs k-mer distances; -p, -jc69 and -k2p do not use k" << std::endl;
+        return 1;
+    }
+    if (!algorithms.empty()) {
+        if (!kmer_lengths.empty()) {
+            std::cerr << "Error: -algorithms and -multi-k cannot be combined" << std::endl;
+            return 1;
+        }
+        if (sparse_neighbors > 0 || divide_size > 0 || dedup || collapse_distance > 0 || !checkpoint.empty()) {
+            std::cerr << "Warning: -sparse, -divide, -dedup, -collapse and -checkpoint are not used with -algorithms" << std::endl;
+        }
+        sparse_neighbors = 0;
+        divide_size = 0;
+        dedup = false;
+        collapse_distance = 0;
+        checkpoint.clear();
+    }
+    // The trees of -multi-k would overwrite each other's snapshots
+    if (!kmer_lengths.empty() && !checkpoint.empty()) {
+        std::cerr << "Warning: -checkpoint is not used with -multi-k" << std::endl;
+        checkpoint.clear();
+    }
+    // One deadline and one progress file cannot be shared by many builds
+    if (time_limit > 0 && (bootstrap || !kmer_lengths.empty() || !database_query.empty())) {
+        std::cerr << "Warning: -time-limit is not used with -bootstrap, -multi-k or -query" << std::endl;
+        time_limit = 0;
+    }
+    // Every replicate has its own matrix, none of them the input's
+    if (bootstrap && !matrix_output.empty()) {
+        std::cerr << "Warning: -write-matrix is not used with -bootstrap" << std::endl;
+        matrix_output.clear();
+    }
+    if (time_limit > 0) {
+        bool iterative = algorithms.empty() ? algorithm == "fm" || algorithm == "me"
+                                            : std::count(algorithms.begin(), algorithms.end(), "fm") + std::count(algorithms.begin(), algorithms.end(), "me") > 0;
+        if (!iterative) {
+            std::cerr << "Warning: -time-limit applies to -fm and -me only" << std::endl;
+        } else if (!checkpoint.empty()) {
+            std::cerr << "Warning: -checkpoint is not used with -time-limit" << std::endl;
+            checkpoint.clear();
+        }
+    }
+    if (sparse_neighbors > 0 && is_alignment_method(method)) {
+        std::cerr << "Warning: -sparse needs k-mer distances; building the full matrix" << std::endl;
+        sparse_neighbors = 0;
+    }
+    if (sparse_neighbors > 0 && algorithm_chosen && algorithm != "upgma") {
+        std::cerr << "Warning: -sparse builds average-linkage (UPGMA) trees; -" << algorithm << " is ignored" << std::endl;
+    }
+    if (divide_size != 0) {
+        if (divide_size < 4) {
+            std::cerr << "Error: -divide needs subsets of at least 4 sequences" << std::endl;
+            return 1;
+        }
+        if (is_alignment_method(method) || sparse_neighbors > 0) {
+            std::cerr << "Warning: -divide needs k-mer distances and is not used with -sparse" << std::endl;
+            divide_size = 0;
+        } else if (fit || time_limit > 0 || !matrix_output.empty() || !checkpoint.empty()) {
+            // There is no full matrix to score against, refine against or write
+            std::cerr << "Warning: -fit, -time-limit, -write-matrix and -checkpoint are not used with -divide" << std::endl;
+            fit = false;
+            time_limit = 0;
+            matrix_output.clear();
+            checkpoint.clear();
+        }
+    }
+
+    pipeline_options options;
+    options.kmer_length = kmer_length;
+    options.canonical = canonical;
+    options.alphabet = alphabet;
+    options.method = method;
+    options.algorithm = algorithm;
+    options.storage = storage;
+    options.keep_matrix = false;
+    options.threads = threads;
+    options.staged = staged;
+    options.fit = fit;
+    options.checkpoint = checkpoint;
+    options.checkpoint_interval = checkpoint_interval;
+    options.resume = resume;
+    options.dedup = dedup;
+    options.collapse_distance = collapse_distance;
+    options.sparse_neighbors = sparse_neighbors;
+    options.divide_size = divide_size;
+    options.matrix_output = matrix_output;
+    options.matrix_lower = matrix_lower;
+    options.algorithms = algorithms;
+    if (time_limit > 0) {
+        options.deadline = started + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time_limit));
+        options.progress_output = output;
+    }
+    options.verbose = verbose;
+
+    if (input == "-serve" && argc > 2) {
+        return run_server(argv[2], options) ? 0 : 1;
+    }
+
+    // Sharded distances: -write-profiles, then one -shard I/N process per
+    // shard, then -merge-tiles with the profile file as input
+    if (!profile_output.empty()) {
+        sequence sequences = read_fasta(input, threads);
+        profile_set set;
+        set.kmer_length = kmer_length;
+        set.canonical = canonical;
+        set.alphabet = alphabet;
+        set.names = sequences.name;
+        set.profiles = count_kmer_profiles(view_sequences(sequences), kmer_length, canonical, alphabet, threads);
+        return write_profile_set(profile_output, set) ? 0 : 1;
+    }
+    // Reference sketches: -build-db once per batch of references, then
+    // -query with the database for each batch of queries
+    if (!database_output.empty()) {
+        sequence sequences = read_fasta(input, threads);
+        profile_set set;
+        set.kmer_length = kmer_length;
+        set.canonical = canonical;
+        set.alphabet = alphabet;
+        set.names = sequences.name;
+        set.profiles = count_kmer_profiles(view_sequences(sequences), kmer_length, canonical, alphabet, threads);
+        if (!append_sketch_database(database_output, set, threads)) return 1;
+        cout << "Added " << set.names.size() << " references to '" << database_output << "'" << endl;
+        return 0;
+    }
+    if (!database_query.empty()) {
+        if (query_neighbors < 1 || (query_tree && query_neighbors < 2)) {
+            std::cerr << "Error: -neighbors must be at least 1, and at least 2 with -query-tree" << std::endl;
+            return 1;
+        }
+        std::string tree_output = query_tree ? algorithm_output_name(output, "trees") : "";
+        return run_sketch_queries(database_query, input, query_neighbors, options, output, tree_output) ? 0 : 1;
+    }
+    if (!shard.empty()) {
+        size_t slash = shard.find('/');
+        if (slash == std::string::npos) {
+            std::cerr << "Error: -shard expects INDEX/COUNT, e.g. 0/8" << std::endl;
+            return 1;
+        }
+        int index = std::stoi(shard.substr(0, slash));
+        int count = std::stoi(shard.substr(slash + 1));
+        std::string tile_output = "tiles_" + std::to_string(index) + ".bin";
+        return compute_distance_tiles(input, index, count, tile_size, method, threads, tile_output) ? 0 : 1;
+    }
+    // Size the input first and fit the build to the budget, or stop before any work
+    if (max_memory > 0 && input != "-random") {
+        input_summary summary;
+        bool sized = phylip_input ? summarize_matrix(input, summary) : summarize_fasta(input, summary, threads);
+        if (!sized) return 1;
+        memory_plan plan = plan_memory(summary, options, max_memory);
+        for (const std::string& line : plan.report) (plan.fits ? cout : std::cerr) << line << endl;
+        if (!plan.fits) {
+            std::cerr << "Error: no plan for this input fits in -max-mem; see the estimate above" << std::endl;
+            return 1;
+        }
+        options = plan.options;
+    }
+
+    if (phylip_input && !algorithms.empty()) {
+        return write_algorithm_trees(build_trees_from_phylip(input, options), options, output) ? 0 : 1;
+    }
+    if (phylip_input) {
+        pipeline_result result = build_tree_from_phylip(input, options);
+        if (result.newick.empty()) return 1;
+        cout << "Generated Tree: " << result.newick << endl;
+        if (options.fit) print_tree_fit(result.fit);
+        write_to_file(output, {result.newick});
+        return 0;
+    }
+    if (!tile_files.empty()) {
+        profile_set set;
+        std::vector<bool> names_only;
+        pipeline_result result;
+        bool merged = read_profile_set(input, set, &names_only);
+        if (merged) {
+            switch (options.storage) {
+                case precision::float16: merged = tree_from_tiles<half>(tile_files, set.names, options, result); break;
+                case precision::float64: merged = tree_from_tiles<double>(tile_files, set.names, options, result); break;
+                default: merged = tree_from_tiles<float>(tile_files, set.names, options, result);
+            }
+        }
+        if (!merged) return 1;
+        cout << "Generated Tree: " << result.newick << endl;
+        write_to_file(output, {result.newick});
+        return 0;
+    }
+
+    if (archive_tree >= 0) {
+        tree_archive archive;
+        if (!archive.open(input)) return 1;
+        if (size_t(archive_tree) >= archive.size()) {
+            std::cerr << "Error: '" << input << "' holds " << archive.size() << " trees" << std::endl;
+            return 1;
+        }
+        std::string newick = to_newick(archive.view(archive_tree), archive.names);
+        cout << newick << endl;
+        write_to_file(output, {newick});
+        return 0;
+    }
+
+    // Tree-to-tree distances over every tree of the input and any further files
+    if (rf) {
+        std::vector<std::string> names;
+        std::vector<compact_tree> trees;
+        rf_files.insert(rf_files.begin(), input);
+        for (const std::string& file : rf_files) {
+            if (!read_tree_file(file, names, trees)) return 1;
+        }
+        std::vector<tree_view> views;
+        for (const compact_tree& tree : trees) views.push_back(view_tree(tree));
+        std::vector<dmatrix_row> D = robinson_foulds_matrix(views, normalized_rf, threads);
+
+        std::vector<std::string> lines = {std::to_string(D.size())};
+        for (size_t i = 0; i < D.size(); i++) {
+            std::ostringstream line;
+            line << "tree_" << i;
+            for (float d : D[i].distances) line << "\t" << d;
+            lines.push_back(line.str());
+        }
+        write_to_file(output, lines);
+        cout << (normalized_rf ? "Normalized RF" : "RF") << " distances between " << D.size()
+             << " trees written to " << output << endl;
+        return 0;
+    }
+
+    // Consensus of every tree in the input, read one tree at a time
+    if (!consensus.empty()) {
+        if (consensus != "majority" && consensus != "greedy") {
+            std::cerr << "Error: -consensus expects majority or greedy" << std::endl;
+            return 1;
+        }
+        std::vector<std::string> names;
+        std::unique_ptr<consensus_builder> builder;
+        bool read = for_each_tree(input, names, [&](const tree_view& tree) {
+            if (!builder) builder.reset(new consensus_builder(names.size()));
+            builder->add(tree);
+        });
+        if (!read || !builder) {
+            std::cerr << "Error: no trees in '" << input << "'" << std::endl;
+            return 1;
+        }
+        std::string newick = to_newick(builder->build(consensus == "greedy"), names);
+        cout << "Consensus of " << builder->trees() << " trees: " << newick << endl;
+        write_to_file(output, {newick});
+        return 0;
+    }
 
     for (int i = 2; i < argc; i++) {
         std::string arg = argv[i];
     
         if (arg == "-bootstrap" && i + 1 < argc) {
             int numBootstrap = std::stoi(argv[++i]);
-            
-            // Perform bootstrap analysis
-            performBootstrapAnalysis(sequences.seq, numBootstrap, "bootstrap_sequences.fasta");
-            
-            // Run tree generation on bootstrap samples and store results
+            sequence sequences = read_fasta(input, threads);
+
+            // With -resume, replicates already in the archive are kept and
+            // only the rest are built
             std::vector<std::string> bootstrapTrees;
+            std::vector<compact_tree> archive;
+            consensus_builder majority(sequences.name.size());
+            if (resume && std::ifstream("bootstrap_trees.bin")) {
+                std::vector<std::string> names;
+                if (read_tree_file("bootstrap_trees.bin", names, archive) && names == sequences.name) {
+                    if (archive.size() > size_t(numBootstrap)) archive.resize(numBootstrap);
+                    for (const compact_tree& tree : archive) {
+                        bootstrapTrees.push_back(to_newick(tree, names));
+                        majority.add(view_tree(tree));
+                    }
+                    cout << "Resuming after " << archive.size() << " of " << numBootstrap << " bootstrap replicates" << endl;
+                } else {
+                    std::cerr << "Warning: bootstrap_trees.bin does not match the input; starting over" << std::endl;
+                    archive.clear();
+                }
+            }
+
+            // Resample and build each replicate in memory; the archive is
+            // rewritten every checkpoint interval so an interrupted run can resume
+            int done = archive.size();
+            std::vector<std::vector<std::string>> replicates = bootstrapSequences(sequences.seq, numBootstrap - done);
+            pipeline_options replicate_options = options;
+            replicate_options.checkpoint.clear();
+            replicate_options.deadline = {};
+            replicate_options.progress_output.clear();
+            replicate_options.matrix_output.clear();
+            auto last_checkpoint = std::chrono::steady_clock::now();
 
-            for (int j = 0; j < numBootstrap; j++) {
-                std::string treeOutput = "bootstrap_tree_" + std::to_string(j) + ".txt";
-                fasta_to_newick("bootstrap_sequences.fasta", kmer_length, method, algorithm, treeOutput, verbose);
-                
-                std::ifstream treeFile(treeOutput);
-                if (!treeFile) {
-                    std::cerr << "Error: Could not open " << treeOutput << std::endl;
-                    continue;
+            for (int j = done; j < numBootstrap; j++) {
+                sequence replicate;
+                replicate.seq = std::move(replicates[j - done]);
+                replicate.name = sequences.name;
+
+                pipeline_result result = build_tree(replicate, replicate_options);
+                std::string tree = result.newick;
+                if (verbose) {
+                    cout << "Bootstrap tree " << j + 1 << ": " << tree << endl;
                 }
-            
-                std::string tree;
-                std::getline(treeFile, tree);
+                write_to_file("bootstrap_tree_" + std::to_string(j) + ".txt", {tree});
                 bootstrapTrees.push_back(tree);
-                treeFile.close();
+                majority.add(view_tree(result.tree));
+                archive.push_back(std::move(result.tree));
+
+                auto now = std::chrono::steady_clock::now();
+                if (std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_interval &&
+                    write_tree_archive("bootstrap_trees.bin.tmp", sequences.name, archive)) {
+                    std::rename("bootstrap_trees.bin.tmp", "bootstrap_trees.bin");
+                    last_checkpoint = now;
+                }
             }
+            write_tree_archive("bootstrap_trees.bin", sequences.name, archive);
+            write_to_file("bootstrap_consensus.txt", {to_newick(majority.build(false), sequences.name)});
             
             // Compute bootstrap support scores
             computeBootstrapSupport(bootstrapTrees, numBootstrap);
@@ -177,8 +716,14 @@ int main(int argc, char** argv) {
         int size = std::stoi(argv[2]);
         random_newick_tree(size, algorithm, output, verbose);
     }
+    else if (!algorithms.empty()) {
+        return write_algorithm_trees(build_trees_from_fasta(input, options), options, output) ? 0 : 1;
+    }
+    else if (!kmer_lengths.empty()) {
+        fasta_to_newick_multi_k(input, kmer_lengths, options, output);
+    }
     else {
-        fasta_to_newick(input, kmer_length, method, algorithm, output, verbose);
+        fasta_to_newick(input, options, output);
     }
 
     return 0;
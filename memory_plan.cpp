@@ -0,0 +1,309 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+
+// Rough per-object costs behind the estimates: a profile entry is a k-mer
+// code and a count, with room for vector growth; every string, vector and
+// tree node carries some bookkeeping
+static const double profile_entry_bytes = 12 * 1.5;
+static const size_t object_bytes = 64;
+static const size_t tree_node_bytes = 20;
+// Buffers a thread may hold: a batch of inflated BGZF blocks, and the
+// records and profiles queued for each staged worker
+static const size_t inflate_bytes = 2 << 20;
+// Bases per k-mer counting task, as in kmer_profiles.cpp
+static const size_t counting_chunk = 1 << 22;
+// Neighbours per sequence in the -divide guide graph, as in divide.cpp
+static const int guide_neighbors = 10;
+static const size_t staged_queue_depth = 16;
+// Neighbours per sequence when the planner switches to the sparse graph,
+// and the subset size when it divides the build (about 8 MB per matrix)
+static const int planned_neighbors = 10;
+static const int planned_subset = 2000;
+
+static int alphabet_size(const std::string& alphabet) {
+    if (alphabet == "protein") return 20;
+    if (alphabet == "murphy10") return 10;
+    if (alphabet == "dayhoff6") return 6;
+    return 4;
+}
+
+static const char* precision_name(precision storage) {
+    return storage == precision::float64 ? "float64" : storage == precision::float16 ? "float16" : "float32";
+}
+
+static std::string format_bytes(double bytes) {
+    const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), unit ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+    return buffer;
+}
+
+bool parse_memory_size(const std::string& text, size_t& bytes) {
+    char* end = nullptr;
+    double value = std::strtod(text.c_str(), &end);
+    if (end == text.c_str() || value <= 0) return false;
+    std::string unit(end);
+    std::transform(unit.begin(), unit.end(), unit.begin(), ::toupper);
+    if (!unit.empty() && unit.back() == 'B') unit.pop_back();
+    double scale = 1;
+    if (unit == "K") scale = 1024.0;
+    else if (unit == "M") scale = 1024.0 * 1024;
+    else if (unit == "G") scale = 1024.0 * 1024 * 1024;
+    else if (unit == "T") scale = 1024.0 * 1024 * 1024 * 1024;
+    else if (!unit.empty()) return false;
+    bytes = size_t(value * scale);
+    return true;
+}
+
+// A samtools faidx index holds name, length, offset, bases and bytes per line
+static bool read_fasta_index(const std::string& filename, input_summary& summary) {
+    std::ifstream index(filename + ".fai");
+    if (!index) return false;
+    std::string line;
+    while (std::getline(index, line)) {
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos) return false;
+        size_t length = std::strtoull(line.c_str() + tab + 1, nullptr, 10);
+        summary.sequences++;
+        summary.residues += length;
+        summary.longest = std::max(summary.longest, length);
+        summary.name_bytes += tab;
+    }
+    return summary.sequences > 0;
+}
+
+bool summarize_fasta(const std::string& filename, input_summary& summary, int threads) {
+    summary = input_summary();
+    std::ifstream probe(filename, std::ios::binary);
+    if (!probe) {
+        std::cerr << "Error: could not open '" << filename << "'" << std::endl;
+        return false;
+    }
+    bool compressed = probe.get() == 0x1f && probe.get() == 0x8b;
+    if (read_fasta_index(filename, summary)) {
+        summary.compressed = compressed;
+        summary.indexed = true;
+        return true;
+    }
+    summary = input_summary();
+    summary.compressed = compressed;
+    fasta_reader reader(filename, threads);
+    std::string name, content;
+    while (reader.next(name, content)) {
+        summary.sequences++;
+        summary.residues += content.size();
+        summary.longest = std::max(summary.longest, content.size());
+        summary.name_bytes += name.size();
+    }
+    return true;
+}
+
+bool summarize_matrix(const std::string& filename, input_summary& summary) {
+    summary = input_summary();
+    summary.matrix = true;
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    summary.file_bytes = in ? size_t(in.tellg()) : 0;
+    in.seekg(0);
+    if (!(in >> summary.sequences) || summary.sequences == 0) {
+        std::cerr << "Error: '" << filename << "' does not start with a PHYLIP taxon count" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// FM works on n x n double rows: the square matrix and neighbour-joining's
+// copy of it, whatever the storage precision
+static double fm_square_bytes(double n) {
+    return 2 * n * (n * 8 + object_bytes);
+}
+
+// Whether the build runs FM on square matrices rather than refining
+static bool fm_square(const pipeline_options& o) {
+    bool refining = o.deadline != std::chrono::steady_clock::time_point();
+    if (refining) return false;
+    return o.algorithms.empty() ? o.algorithm == "fm" : std::count(o.algorithms.begin(), o.algorithms.end(), "fm") > 0;
+}
+
+// Estimated peak of one configuration: named parts that are always held,
+// and buffers that grow with the thread count
+struct footprint {
+    std::vector<std::pair<std::string, double>> parts;
+    double per_thread = 0;
+    double fixed() const {
+        double total = 0;
+        for (const auto& part : parts) total += part.second;
+        return total;
+    }
+};
+
+static footprint estimate(const input_summary& input, const pipeline_options& options) {
+    footprint f;
+    double n = input.sequences;
+    double mean_length = n ? double(input.residues) / n : 0;
+    bool alignment = is_alignment_method(options.method);
+    bool staged = options.staged && !alignment && !input.matrix && options.divide_size <= 0;
+
+    if (!input.matrix && !staged) {
+        f.parts.emplace_back("sequences", input.residues + input.name_bytes + 2 * n * object_bytes);
+    }
+    double profile = 0;
+    if (input.matrix) {
+        // The text is mapped while it is parsed, and counts as resident
+        f.parts.emplace_back("mapped matrix file", input.file_bytes);
+    } else if (alignment) {
+        f.parts.emplace_back("packed alignment", n * std::ceil(input.longest / 64.0) * 3 * 8);
+    } else {
+        double space = std::pow(double(alphabet_size(options.alphabet)), options.kmer_length);
+        double distinct = std::min(std::max(mean_length - options.kmer_length + 1, 0.0), space);
+        profile = distinct * profile_entry_bytes + 2 * object_bytes;
+        f.parts.emplace_back("k-mer profiles", n * profile);
+        // Every k-mer of the longest sequence, before it is collapsed
+        f.parts.emplace_back("k-mer counting", input.longest * 8.0);
+    }
+
+    double pairs = n * (n - 1) / 2;
+    size_t value = options.storage == precision::float64 ? 8 : options.storage == precision::float16 ? 2 : 4;
+    bool divided = options.divide_size > 0 && n > options.divide_size && !input.matrix && !alignment;
+    if (options.sparse_neighbors > 0 || divided) {
+        double edges = n * (divided ? guide_neighbors : options.sparse_neighbors) * 2;
+        f.parts.emplace_back("neighbour graph", n * (64 * 8 + 32 * 16) + edges * (12 + 64));
+    }
+    if (divided) {
+        // Each thread builds one subset tree on its own matrix; the guide
+        // and backbone trees are small
+        double size = options.divide_size + 1;
+        f.parts.emplace_back("guide and backbone trees", 4 * n * tree_node_bytes);
+        f.per_thread += size * (size - 1) / 2 * value;
+        if (options.algorithm == "fm") f.per_thread += fm_square_bytes(size);
+    } else if (options.sparse_neighbors <= 0) {
+        std::string name = std::string("distance matrix (") + precision_name(options.storage) + ")";
+        // Staged rows are gathered into the triangle, so both exist at the end
+        f.parts.emplace_back(name, pairs * value * (staged ? 2 : 1));
+        // Several builders each work on their own copy, and -fit scores
+        // against the shared matrix
+        bool several = !options.algorithms.empty();
+        bool refining = options.deadline != std::chrono::steady_clock::time_point();
+        std::vector<std::string> algorithms = several ? options.algorithms : std::vector<std::string>{options.algorithm};
+        if (several) {
+            int copies = std::count_if(algorithms.begin(), algorithms.end(), [](const std::string& a) { return a != "fm"; });
+            if (copies) f.parts.emplace_back("working copies for " + std::to_string(copies) + " builders", pairs * value * copies);
+        } else if (options.fit || (refining && algorithms[0] != "upgma" && algorithms[0] != "nj")) {
+            f.parts.emplace_back(options.fit ? "matrix copy for -fit" : "matrix copy for -time-limit", pairs * value);
+        }
+        if (fm_square(options)) f.parts.emplace_back("square double matrices for FM", fm_square_bytes(n));
+    }
+    f.parts.emplace_back("tree", 2 * n * tree_node_bytes + input.name_bytes);
+
+    // Each counting thread holds the k-mers of one sequence or chunk, and a
+    // buffer of the same size to sort them
+    if (!input.matrix && !alignment) f.per_thread += std::min<size_t>(input.longest, counting_chunk) * 16.0;
+    if (input.compressed) f.per_thread += inflate_bytes;
+    if (staged) f.per_thread += staged_queue_depth * (mean_length + profile);
+    return f;
+}
+
+// Changes are tried in order of what they cost the result: none for
+// streaming and fewer threads, then the -fit report, then precision, then
+// the exact matrix itself, approximated by the sparse graph or by subsets
+memory_plan plan_memory(const input_summary& input, const pipeline_options& requested, size_t budget) {
+    memory_plan plan;
+    plan.options = requested;
+    int threads = resolve_threads(requested.threads);
+    bool alignment = is_alignment_method(requested.method);
+    bool streamable = !alignment && !input.matrix && !requested.dedup && requested.collapse_distance <= 0;
+
+    std::vector<std::pair<std::string, std::function<bool(pipeline_options&)>>> steps = {
+        {"as requested", [](pipeline_options&) { return true; }},
+        {"-staged (the sequences are not held)", [&](pipeline_options& o) {
+            if (o.staged || !streamable || o.sparse_neighbors > 0 || o.divide_size > 0) return false;
+            o.staged = true;
+            return true;
+        }},
+        {"no -fit (its matrix copy does not fit)", [](pipeline_options& o) {
+            if (!o.fit) return false;
+            o.fit = false;
+            return true;
+        }},
+        {"-precision float32", [](pipeline_options& o) {
+            if (o.storage != precision::float64 || fm_square(o)) return false;
+            o.storage = precision::float32;
+            return true;
+        }},
+        {"-precision float16", [](pipeline_options& o) {
+            if (o.storage == precision::float16 || fm_square(o)) return false;
+            o.storage = precision::float16;
+            return true;
+        }},
+        {"-sparse " + std::to_string(planned_neighbors) + " (no full matrix)", [&](pipeline_options& o) {
+            if (o.sparse_neighbors > 0 || o.algorithm != "upgma" || !o.algorithms.empty() || alignment || input.matrix) return false;
+            o.sparse_neighbors = planned_neighbors;
+            o.staged = false;
+            return true;
+        }},
+        {"-divide " + std::to_string(planned_subset) + " (subset matrices only)", [&](pipeline_options& o) {
+            if (o.divide_size > 0 || o.sparse_neighbors > 0 || !o.algorithms.empty() || alignment || input.matrix) return false;
+            if (!o.matrix_output.empty() || !o.checkpoint.empty() || o.deadline != std::chrono::steady_clock::time_point()) return false;
+            o.divide_size = planned_subset;
+            o.staged = false;
+            return true;
+        }},
+    };
+
+    // A step is kept only where it lowers the smallest peak, on one thread:
+    // staged rows briefly double the matrix, and -divide does nothing for
+    // inputs no larger than a subset
+    pipeline_options candidate = requested;
+    std::vector<std::string> changes;
+    footprint best;
+    auto smallest = [](const footprint& f) { return f.fixed() + f.per_thread; };
+    for (auto& step : steps) {
+        pipeline_options next = candidate;
+        if (!step.second(next)) continue;
+        footprint f = estimate(input, next);
+        if (&step != &steps[0] && smallest(f) >= smallest(estimate(input, candidate))) continue;
+        candidate = next;
+        best = f;
+        if (&step != &steps[0]) changes.push_back(step.first);
+
+        double room = double(budget) - f.fixed();
+        int fitting = f.per_thread > 0 ? int(std::min<double>(threads, room / f.per_thread)) : threads;
+        if (room > 0 && fitting >= 1) {
+            plan.fits = true;
+            if (fitting < threads) {
+                changes.push_back("-threads " + std::to_string(fitting));
+                candidate.threads = fitting;
+            }
+            threads = fitting;
+            break;
+        }
+    }
+
+    plan.options = candidate;
+    plan.bytes = size_t(best.fixed() + best.per_thread * threads);
+    plan.report.push_back("Memory plan for " + std::to_string(input.sequences) + (input.matrix ? " taxa" : " sequences") +
+                          (input.matrix ? "" : ", " + std::to_string(input.residues) + " residues") +
+                          " within " + format_bytes(budget) + ":");
+    for (const auto& part : best.parts) {
+        if (part.second > 0) plan.report.push_back("  " + part.first + ": " + format_bytes(part.second));
+    }
+    if (best.per_thread > 0) {
+        plan.report.push_back("  per-thread buffers: " + format_bytes(best.per_thread) + " x " + std::to_string(threads));
+    }
+    plan.report.push_back("  estimated peak: " + format_bytes(plan.bytes));
+    for (const std::string& change : changes) plan.report.push_back("  using " + change);
+    if (!plan.fits) {
+        plan.report.push_back("  nothing fits: the smallest plan needs " + format_bytes(best.fixed() + best.per_thread) +
+                              (requested.algorithm != "upgma" && requested.algorithms.empty() && !alignment && !input.matrix && candidate.divide_size <= 0
+                                   ? "; -upgma could use the sparse neighbour graph instead of the full matrix"
+                                   : ""));
+    }
+    return plan;
+}
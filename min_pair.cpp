@@ -0,0 +1,87 @@
+#include "tree.hpp"
+#include <limits>
+
+// Below this many matrix cells a search stays on the calling thread
+static const size_t parallel_cells = 1 << 16;
+
+typedef double double2 __attribute__((vector_size(16)));
+typedef long long index2 __attribute__((vector_size(16)));
+
+// First j in [0, count) whose score is below `best`, or -1, updating best.
+// Scores are computed four at a time in two independent pairs of lanes; each
+// lane keeps its first minimum and equal lane minima resolve to the lower
+// index, so the answer matches a plain left-to-right scan.
+template <bool Biased, typename T>
+static int row_min(const T* row, int count, double scale, double bias_i, const double* bias, double& best) {
+    const double limit = best;
+    const double2 scales = {scale, scale}, bias_is = {bias_i, bias_i};
+    const index2 step = {4, 4};
+    double2 best_a = {limit, limit}, best_b = best_a;
+    index2 at_a = {-1, -1}, at_b = at_a;
+    index2 next_a = {0, 1}, next_b = {2, 3};
+    int j = 0;
+    for (; j + 4 <= count; j += 4) {
+        double2 a = {double(row[j]), double(row[j + 1])};
+        double2 b = {double(row[j + 2]), double(row[j + 3])};
+        if constexpr (Biased) {
+            double2 bias_a = {bias[j], bias[j + 1]}, bias_b = {bias[j + 2], bias[j + 3]};
+            a = scales * a - bias_is - bias_a;
+            b = scales * b - bias_is - bias_b;
+        }
+        index2 less_a = a < best_a, less_b = b < best_b;
+        best_a = less_a ? a : best_a;
+        best_b = less_b ? b : best_b;
+        at_a = less_a ? next_a : at_a;
+        at_b = less_b ? next_b : at_b;
+        next_a += step;
+        next_b += step;
+    }
+
+    int found = -1;
+    double lane_best[4] = {best_a[0], best_a[1], best_b[0], best_b[1]};
+    long long lane_at[4] = {at_a[0], at_a[1], at_b[0], at_b[1]};
+    for (int lane = 0; lane < 4; lane++) {
+        if (lane_at[lane] < 0) continue;
+        if (lane_best[lane] < best || (lane_best[lane] == best && lane_at[lane] < found)) {
+            best = lane_best[lane];
+            found = lane_at[lane];
+        }
+    }
+    for (; j < count; j++) {
+        double v = double(row[j]);
+        if constexpr (Biased) v = scale * v - bias_i - bias[j];
+        if (v < best) {
+            best = v;
+            found = j;
+        }
+    }
+    return found;
+}
+
+template <typename T>
+min_pair find_min_pair(const packed_triangle<T>& D, int m, double scale, const double* bias, int threads) {
+    std::vector<double> row_best(m, std::numeric_limits<double>::max());
+    std::vector<int> row_at(m, -1);
+    if (size_t(m) * (m - 1) / 2 < parallel_cells) threads = 1;
+
+    parallel_for(1, m, threads, [&](int i) {
+        double best = std::numeric_limits<double>::max();
+        row_at[i] = bias ? row_min<true>(D.row(i), i, scale, bias[i], bias, best)
+                         : row_min<false>(D.row(i), i, scale, 0.0, bias, best);
+        row_best[i] = best;
+    });
+
+    // Rows are reduced in order with a strict comparison, so the first pair
+    // in row-major order wins ties however the rows were split among threads
+    min_pair result = {std::numeric_limits<double>::max(), -1, -1};
+    for (int i = 1; i < m; i++) {
+        if (row_at[i] >= 0 && row_best[i] < result.value) {
+            result = {row_best[i], i, row_at[i]};
+        }
+    }
+    return result;
+}
+
+template min_pair find_min_pair<float>(const packed_triangle<float>&, int, double, const double*, int);
+template min_pair find_min_pair<double>(const packed_triangle<double>&, int, double, const double*, int);
+template min_pair find_min_pair<half>(const packed_triangle<half>&, int, double, const double*, int);
@@ -2,130 +2,104 @@
 #include <algorithm>
 #include <limits>
 #include <iostream>
-#include <map>
 
-void neighbor_joining(std::vector<dmatrix_row>& D, Tree& tree, bool verbose) {
-    int n = D.size();
-    std::map<int, int> current_to_original;  // Maps current indices to original node IDs
-    std::vector<int> active_indices(n);
-    
-    // Initialize the mapping and active indices
-    for (int i = 0; i < n; i++) {
-        current_to_original[i] = i;
-        active_indices[i] = i;
-    }
-    
-    // Initialize the distance matrix to ensure symmetry
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < i; j++) {
-            D[j].distances[i] = D[i].distances[j];
-        }
-    }
-    
-    while (D.size() > 1) {
-        // Calculate row sums
-        std::vector<float> row_sums(D.size(), 0.0f);
-        for (int i = 0; i < D.size(); i++) {
-            for (int j = 0; j < D.size(); j++) {
-                if (i != j) {
-                    row_sums[i] += D[i].distances[j];
-                }
-            }
-        }
-        
-        // Find minimum Q-value pair
-        double min_q = std::numeric_limits<double>::max();
-        int min_i = -1, min_j = -1;
-        
-        for (int i = 0; i < D.size(); i++) {
+// Rows at least this long are updated in parallel, in blocks of update_block
+static const int parallel_update = 8192;
+static const int update_block = 2048;
+
+template <typename T>
+void neighbor_joining(packed_triangle<T>& D, Tree& tree, bool verbose, int threads, merge_checkpoint* checkpoint) {
+    int m = D.n;
+    std::vector<int> nodes(m);  // Tree node index held by each matrix slot
+    std::vector<double> row_sums(m, 0.0), merged(m, 0.0);
+
+    if (checkpoint && checkpoint->restored.m) {
+        m = checkpoint->restored.m;
+        nodes = checkpoint->restored.nodes;
+        row_sums = checkpoint->restored.values;
+        merged.assign(m, 0.0);
+    } else {
+        for (int i = 0; i < m; i++) {
+            nodes[i] = i;
             for (int j = 0; j < i; j++) {
-                double q = (D.size() - 2) * D[i].distances[j] - row_sums[i] - row_sums[j];
-                if (q < min_q) {
-                    min_q = q;
-                    min_i = i;
-                    min_j = j;
-                }
+                row_sums[i] += D.get(i, j);
+                row_sums[j] += D.get(i, j);
             }
         }
-        
+    }
+
+    while (m > 1) {
+        // Find minimum Q-value pair: Q(i, j) = (m - 2) D(i, j) - r_i - r_j
+        min_pair best = find_min_pair(D, m, m - 2, row_sums.data(), threads);
+        double min_q = best.value;
+        int min_i = best.i, min_j = best.j;
+
         if (verbose) {
-            std::cout << "Merging nodes " << tree.tree[current_to_original[min_i] + 1].name 
-                     << " and " << tree.tree[current_to_original[min_j] + 1].name 
+            std::cout << "Merging nodes " << tree.label(nodes[min_i])
+                     << " and " << tree.label(nodes[min_j])
                      << " (Q-value = " << min_q << ")\n";
-            std::cout << "Current matrix size: " << D.size() << std::endl;
+            std::cout << "Current matrix size: " << m << std::endl;
         }
-        
-        // Calculate branch lengths
-        float dist_i = (D[min_i].distances[min_j] + (row_sums[min_i] - row_sums[min_j]) / (D.size() - 2)) / 2.0f;
-        float dist_j = D[min_i].distances[min_j] - dist_i;
-        
-        // Join the nodes in the tree
-        int orig_i = current_to_original[min_i];
-        int orig_j = current_to_original[min_j];
-        tree.joinNodes(orig_i, orig_j, dist_i, dist_j);
-        int new_node_id = tree.tree.size() - 1;
-        
-        // Create new distance matrix
-        std::vector<dmatrix_row> new_D;
-        new_D.reserve(D.size() - 1);
-        
-        // Copy unmerged rows and update their distances
-        for (int i = 0; i < D.size(); i++) {
-            if (i != min_i && i != min_j) {
-                dmatrix_row new_row;
-                new_row.id = D[i].id;
-                
-                // Copy distances for unmerged nodes
-                for (int j = 0; j < D.size(); j++) {
-                    if (j != min_i && j != min_j) {
-                        new_row.distances.push_back(D[i].distances[j]);
-                    }
-                }
-                
-                // Add distance to new merged node
-                float new_dist = (D[i].distances[min_i] + D[i].distances[min_j] - D[min_i].distances[min_j]) / 2.0f;
-                new_row.distances.push_back(new_dist);
-                new_D.push_back(new_row);
-            }
-        }
-        
-        // Add the new merged node
-        dmatrix_row new_row;
-        new_row.id = new_node_id;
-        for (const auto& row : new_D) {
-            new_row.distances.push_back(row.distances.back());
+
+        // Calculate branch lengths (the last two nodes split their distance evenly)
+        double d_ij = D.get(min_i, min_j);
+        double dist_i = d_ij / 2.0;
+        if (m > 2) {
+            dist_i = (d_ij + (row_sums[min_i] - row_sums[min_j]) / (m - 2)) / 2.0;
         }
-        new_row.distances.push_back(0.0f);  // Distance to itself
-        new_D.push_back(new_row);
-        
-        // Update active indices
-        std::vector<int> new_active_indices;
-        for (int i = 0; i < active_indices.size(); i++) {
-            if (i != min_i && i != min_j) {
-                new_active_indices.push_back(active_indices[i]);
+        double dist_j = d_ij - dist_i;
+        int joined = tree.joinNodes(nodes[min_i], nodes[min_j], dist_i, dist_j);
+
+        // The merged node takes slot min_j; row sums are updated in place and
+        // its own sum is added up in slot order afterwards
+        parallel_for_blocks(0, m, update_block, m >= parallel_update ? threads : 1, [&](int lo, int hi) {
+            for (int k = lo; k < hi; k++) {
+                if (k == min_i || k == min_j) continue;
+                double d_ki = D.get(k, min_i), d_kj = D.get(k, min_j);
+                D.set(k, min_j, (d_ki + d_kj - d_ij) / 2.0);
+                merged[k] = D.get(k, min_j);
+                row_sums[k] += merged[k] - d_ki - d_kj;
             }
+        });
+        double new_sum = 0;
+        for (int k = 0; k < m; k++) {
+            if (k != min_i && k != min_j) new_sum += merged[k];
         }
-        new_active_indices.push_back(new_node_id);
-        active_indices = new_active_indices;
-        
-        // Update the mapping
-        current_to_original.clear();
-        for (int i = 0; i < active_indices.size(); i++) {
-            current_to_original[i] = active_indices[i];
+        row_sums[min_j] = new_sum;
+        nodes[min_j] = joined;
+
+        // The last slot fills the gap left by min_i
+        int last = m - 1;
+        if (min_i != last) {
+            D.move_slot(last, min_i);
+            row_sums[min_i] = row_sums[last];
+            nodes[min_i] = nodes[last];
+        }
+        m--;
+
+        if (checkpoint && m > 1 && checkpoint->due()) {
+            merge_state state = {m, {nodes.begin(), nodes.begin() + m}, {row_sums.begin(), row_sums.begin() + m}};
+            checkpoint->save(D, tree, state);
         }
-        
-        // Replace old distance matrix
-        D = new_D;
     }
 }
 
+template void neighbor_joining<float>(packed_triangle<float>&, Tree&, bool, int, merge_checkpoint*);
+template void neighbor_joining<double>(packed_triangle<double>&, Tree&, bool, int, merge_checkpoint*);
+template void neighbor_joining<half>(packed_triangle<half>&, Tree&, bool, int, merge_checkpoint*);
+
+void neighbor_joining(std::vector<dmatrix_row>& D, Tree& tree, bool verbose) {
+    packed_triangle<float> working(D);
+    neighbor_joining(working, tree, verbose);
+}
+
 void neighbor_joining_tree(std::vector<dmatrix_row>& D, std::string output, bool verbose) {
     std::vector<std::string> names;
     for (int i = 0; i < D.size(); i++) {
         names.push_back(std::to_string(i));
     }
-    Tree tree(D, names);
+    Tree tree(names);
     neighbor_joining(D, tree, verbose);
-    std::vector<std::string> to_write = {tree.newick};
+    std::vector<std::string> to_write = {tree.newick()};
     write_to_file(output, to_write);
 }
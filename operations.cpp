@@ -11,23 +11,32 @@
 
 std::vector<std::vector<float>> count_kmer_frequencies(sequence& sequences, int& kmer_length) {
     std::cout << "Reading sequences, counting K-mers of length: " << kmer_length << "..." << std::endl;
-    std::map<std::string, int> unique_kmers;
+    return count_kmer_frequencies(view_sequences(sequences), kmer_length);
+}
+
+std::vector<std::vector<float>> count_kmer_frequencies(const sequence_view& sequences, int kmer_length) {
+    std::map<std::string_view, int> unique_kmers;
     std::vector<std::vector<float>> kmer_frequencies(sequences.seq.size());
-    int index, flag;
+    int flag;
     int unique_counter = 0;
 
     for (int i = 0; i < sequences.seq.size(); i++) {
-        for (int j = 0; j <= sequences.seq[i].length() - kmer_length; j++) {
+        std::string_view seq = sequences.seq[i];
+        for (size_t j = 0; j + kmer_length <= seq.length(); j++) {
             flag = 0;
-            std::string kmer = sequences.seq[i].substr(j, kmer_length);
+            std::string_view kmer = seq.substr(j, kmer_length);
             for (int s = 0; s < kmer_length; s++) {
                 if (kmer[s] != 'A' && kmer[s] != 'C' && kmer[s] != 'G' && kmer[s] != 'T') {
                     flag = 1;
                     break;
                 }
             }
+            if (flag == 1) {
+                continue;
+            }
 
-            if (!unique_kmers[kmer] && flag != 1) {
+            auto found = unique_kmers.find(kmer);
+            if (found == unique_kmers.end()) {
                 unique_kmers[kmer] = unique_counter;
                 for (int k = 0; k < kmer_frequencies.size(); k++) {
                     kmer_frequencies[k].push_back(0);
@@ -35,9 +44,8 @@ std::vector<std::vector<float>> count_kmer_frequencies(sequence& sequences, int&
                 kmer_frequencies[i][unique_counter] += 1;
                 unique_counter += 1;
             }
-            else if (flag != 1) {
-                index = unique_kmers[kmer];
-                kmer_frequencies[i][index] += 1;
+            else {
+                kmer_frequencies[i][found->second] += 1;
             }
         }
     }
@@ -45,74 +53,73 @@ std::vector<std::vector<float>> count_kmer_frequencies(sequence& sequences, int&
 }
 
 std::vector<dmatrix_row> distance_matrix(std::vector<std::vector<float>>& frequencies, sequence& sequences, int kmer_length, std::string method) {
-    std::vector<dmatrix_row> D(frequencies.size());
-    float distance;
-
-    for (int i = 0; i < frequencies.size(); i++) {
-        D[i].distances.resize(frequencies.size());
-        D[i].id = i;
-        D[i].sum = 0;
-
-        for (int j = 0; j < frequencies.size(); j++) {
-            if (i == j) {
-                D[i].distances[j] = 0;
-                continue;
-            }
+    return distance_matrix(frequencies, method);
+}
 
-            if (method == "cosine") {
-                float dot = 0, norm1 = 0, norm2 = 0;
-                for (int k = 0; k < frequencies[i].size(); k++) {
-                    dot += frequencies[i][k] * frequencies[j][k];
-                    norm1 += frequencies[i][k] * frequencies[i][k];
-                    norm2 += frequencies[j][k] * frequencies[j][k];
-                }
-                if (norm1 == 0 || norm2 == 0) {
-                    distance = 1.0;  // Maximum distance for sequences with no k-mers
-                } else {
-                    distance = 1 - (dot / (std::sqrt(norm1) * std::sqrt(norm2)));
-                }
+// Distance between two dense frequency rows; the method is a template
+// parameter so the pair loop carries no per-pair dispatch
+template <distance_method Method, typename Acc>
+static float dense_distance(const std::vector<float>& f1, const std::vector<float>& f2, Acc total1, Acc total2) {
+    if constexpr (Method == distance_method::cosine) {
+        Acc dot = 0, norm1 = 0, norm2 = 0;
+        for (size_t k = 0; k < f1.size(); k++) {
+            dot += Acc(f1[k]) * f2[k];
+            norm1 += Acc(f1[k]) * f1[k];
+            norm2 += Acc(f2[k]) * f2[k];
+        }
+        if (norm1 == 0 || norm2 == 0) {
+            return 1.0;  // Maximum distance for sequences with no k-mers
+        }
+        return 1 - (dot / (std::sqrt(norm1) * std::sqrt(norm2)));
+    } else {
+        if (total1 == 0 || total2 == 0) {
+            return 1.0;  // Maximum distance for sequences with no k-mers
+        }
+        Acc distance = 0;
+        for (size_t k = 0; k < f1.size(); k++) {
+            Acc p = f1[k] / total1, q = f2[k] / total2;
+            if constexpr (Method == distance_method::mahalanobis) {
+                if (p + q > 0) distance += (p - q) * (p - q) / (p + q);
+            } else {
+                distance += std::abs(p - q);
             }
-            else {
-                float total1 = 0, total2 = 0;
-                for (float f : frequencies[i]) total1 += f;
-                for (float f : frequencies[j]) total2 += f;
+        }
+        if constexpr (Method == distance_method::mahalanobis) {
+            return std::sqrt(distance);
+        } else {
+            return distance / 2;  // Normalize to [0,1] range
+        }
+    }
+}
 
-                if (total1 == 0 || total2 == 0) {
-                    distance = 1.0;  // Maximum distance for sequences with no k-mers
-                    D[i].distances[j] = distance;
-                    D[i].sum += distance;
-                    continue;
-                }
+template <distance_method Method>
+static std::vector<dmatrix_row> dense_distance_matrix(const std::vector<std::vector<float>>& frequencies) {
+    int n = frequencies.size();
+    std::vector<dmatrix_row> D(n);
+    std::vector<double> totals(n, 0.0);
 
-                std::vector<float> freq1 = frequencies[i];
-                std::vector<float> freq2 = frequencies[j];
-                
-                for (int k = 0; k < freq1.size(); k++) {
-                    freq1[k] = total1 > 0 ? freq1[k] / total1 : 0;
-                    freq2[k] = total2 > 0 ? freq2[k] / total2 : 0;
-                }
+    for (int i = 0; i < n; i++) {
+        D[i].distances.assign(n, 0.0f);
+        D[i].id = i;
+        D[i].sum = 0;
+        for (float f : frequencies[i]) totals[i] += f;
+    }
 
-                if (method == "mahalanobis") {
-                    distance = 0;
-                    for (int k = 0; k < freq1.size(); k++) {
-                        float sum = freq1[k] + freq2[k];
-                        if (sum > 0) {
-                            distance += std::pow(freq1[k] - freq2[k], 2) / sum;
-                        }
-                    }
-                    distance = std::sqrt(distance);
-                }
-                else {  // fractional
-                    distance = 0;
-                    for (int k = 0; k < freq1.size(); k++) {
-                        distance += std::abs(freq1[k] - freq2[k]);
-                    }
-                    distance /= 2.0;  // Normalize to [0,1] range
-                }
-            }
-            D[i].distances[j] = distance;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < i; j++) {
+            float distance = dense_distance<Method, double>(frequencies[i], frequencies[j], totals[i], totals[j]);
+            D[i].distances[j] = D[j].distances[i] = distance;
             D[i].sum += distance;
+            D[j].sum += distance;
         }
     }
     return D;
-}
\ No newline at end of file
+}
+
+std::vector<dmatrix_row> distance_matrix(const std::vector<std::vector<float>>& frequencies, std::string method) {
+    switch (parse_distance_method(method)) {
+        case distance_method::cosine: return dense_distance_matrix<distance_method::cosine>(frequencies);
+        case distance_method::mahalanobis: return dense_distance_matrix<distance_method::mahalanobis>(frequencies);
+        default: return dense_distance_matrix<distance_method::fractional>(frequencies);
+    }
+}
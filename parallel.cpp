@@ -0,0 +1,113 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+int resolve_threads(int threads) {
+    if (threads > 0) return threads;
+    int hardware = std::thread::hardware_concurrency();
+    return hardware > 0 ? hardware : 1;
+}
+
+// Set while a thread runs pool work. A loop nested inside a pool task runs
+// by itself rather than asking the pool for more threads.
+static thread_local bool in_pool_task = false;
+
+// Workers are started once and reused, so loops that run once per merge
+// (thousands of times per tree) do not pay for thread creation each time.
+// Several callers may run loops at once (one per builder with -all). Each
+// loop is helped by at most its thread count less one of the idle workers,
+// and the pool only grows to the largest thread count asked for, so callers
+// that find every worker busy run their loops by themselves.
+class thread_pool {
+public:
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    void run(int begin, int end, int threads, const std::function<void(int)>& body) {
+        job current(body, begin, end);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current.helpers = threads - 1;
+            jobs.push_back(&current);
+            while (int(workers.size()) < threads - 1) {
+                workers.emplace_back([this]() { work(); });
+            }
+        }
+        wake.notify_all();
+
+        work_on(current);
+        std::unique_lock<std::mutex> lock(mutex);
+        current.helpers = 0;
+        done.wait(lock, [&]() { return current.running == 0; });
+        jobs.erase(std::find(jobs.begin(), jobs.end(), &current));
+    }
+
+private:
+    struct job {
+        const std::function<void(int)>& body;
+        std::atomic<int> next;
+        int last, helpers = 0, running = 0;
+        job(const std::function<void(int)>& body, int begin, int end) : body(body), next(begin), last(end) {}
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<job*> jobs;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    bool stopping = false;
+
+    static void work_on(job& current) {
+        in_pool_task = true;
+        for (int i = current.next++; i < current.last; i = current.next++) current.body(i);
+        in_pool_task = false;
+    }
+
+    job* find_job() {
+        for (job* j : jobs) {
+            if (j->helpers > 0) return j;
+        }
+        return nullptr;
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&]() { return stopping || find_job(); });
+            if (stopping) return;
+            job* current = find_job();
+            current->helpers--;
+            current->running++;
+            lock.unlock();
+            work_on(*current);
+            lock.lock();
+            if (--current->running == 0) done.notify_all();
+        }
+    }
+};
+
+static thread_pool pool;
+
+// Hands out indices one at a time from a shared counter, so uneven
+// iterations (rows of a triangle) still balance across threads
+void parallel_for(int begin, int end, int threads, const std::function<void(int)>& body) {
+    threads = std::min(resolve_threads(threads), end - begin);
+    if (threads <= 1 || in_pool_task) {
+        for (int i = begin; i < end; i++) body(i);
+        return;
+    }
+    pool.run(begin, end, threads, body);
+}
+
+void parallel_for_blocks(int begin, int end, int block, int threads, const std::function<void(int, int)>& body) {
+    int blocks = (end - begin + block - 1) / block;
+    parallel_for(0, blocks, threads, [&](int b) {
+        body(begin + b * block, std::min(end, begin + (b + 1) * block));
+    });
+}
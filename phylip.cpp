@@ -0,0 +1,320 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bytes of the file scanned for line ends per task, and rows formatted per
+// task when writing
+static const size_t scan_chunk = 16 << 20;
+static const int write_rows = 64;
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static const char* skip_space(const char* p, const char* end) {
+    while (p < end && is_space(*p)) p++;
+    return p;
+}
+
+static const char* skip_token(const char* p, const char* end) {
+    while (p < end && !is_space(*p)) p++;
+    return p;
+}
+
+// Values are parsed as float unless stored as double; half goes through float
+template <typename T>
+static const char* parse_value(const char* p, const char* end, T& out) {
+    float value = 0;
+    auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc()) return nullptr;
+    out = T(value);
+    return result.ptr;
+}
+
+template <>
+const char* parse_value<double>(const char* p, const char* end, double& out) {
+    auto result = std::from_chars(p, end, out);
+    return result.ec == std::errc() ? result.ptr : nullptr;
+}
+
+// Read-only view of a whole file
+struct mapped_file {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    bool open(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        size = info.st_size;
+        void* mapped = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapped);
+        return true;
+    }
+    ~mapped_file() {
+        if (data) munmap(const_cast<char*>(data), size);
+    }
+};
+
+// Rows one per line, the common layout: lines are found in parallel chunks
+// and every row is parsed by itself. Returns false when the lines do not
+// hold one row each, so the caller falls back to reading tokens in order.
+template <typename T>
+static bool parse_rows(const char* begin, const char* end, int n, std::vector<std::string>& names,
+                       packed_triangle<T>& D, int threads, std::string& error) {
+    size_t length = end - begin;
+    int chunks = (length + scan_chunk - 1) / scan_chunk;
+    std::vector<std::vector<size_t>> found(chunks);
+    parallel_for(0, chunks, threads, [&](int c) {
+        const char* p = begin + size_t(c) * scan_chunk;
+        const char* stop = begin + std::min(length, size_t(c + 1) * scan_chunk);
+        while ((p = static_cast<const char*>(std::memchr(p, '\n', stop - p)))) {
+            found[c].push_back(p - begin);
+            if (++p >= stop) break;
+        }
+    });
+    // Non-blank lines start after the header line's end
+    std::vector<const char*> lines;
+    size_t start = 0;
+    auto add_line = [&](size_t from, size_t to) {
+        if (skip_space(begin + from, begin + to) < begin + to) lines.push_back(begin + from);
+    };
+    for (const auto& chunk : found) {
+        for (size_t newline : chunk) {
+            add_line(start, newline);
+            start = newline + 1;
+        }
+    }
+    if (start < length) add_line(start, length);
+    if (int(lines.size()) != n) return false;
+    lines.push_back(end);
+
+    // The first row tells the layout: n values for a square matrix, none
+    // for a lower triangle and one when the triangle includes the diagonal
+    int first_row = 0;
+    for (const char* p = skip_token(skip_space(lines[0], lines[1]), lines[1]);; first_row++) {
+        p = skip_space(p, lines[1]);
+        if (p == lines[1]) break;
+        p = skip_token(p, lines[1]);
+    }
+    bool square = first_row == n && n > 1;
+    int diagonal = square ? 0 : first_row;
+    if (!square && diagonal > 1) return false;
+
+    names.assign(n, "");
+    D = packed_triangle<T>(n);
+    std::vector<int> bad(n, 0);
+    parallel_for_blocks(0, n, 64, threads, [&](int lo, int hi) {
+        for (int i = lo; i < hi; i++) {
+            const char* p = skip_space(lines[i], lines[i + 1]);
+            const char* name_end = skip_token(p, lines[i + 1]);
+            names[i].assign(p, name_end);
+            p = name_end;
+            T* row = D.row(i);
+            for (int j = 0; j < i && p; j++) {
+                p = parse_value(skip_space(p, lines[i + 1]), lines[i + 1], row[j]);
+            }
+            if (!p) {
+                bad[i] = 1;
+                continue;
+            }
+            // Count what is left: the diagonal and, when square, the upper part
+            int rest = 0;
+            for (p = skip_space(p, lines[i + 1]); p < lines[i + 1]; p = skip_space(skip_token(p, lines[i + 1]), lines[i + 1])) rest++;
+            if (rest != (square ? n - i : diagonal)) bad[i] = 1;
+        }
+    });
+    for (int i = 0; i < n; i++) {
+        if (bad[i]) {
+            error = "row " + std::to_string(i + 1) + " (" + names[i] + ") has the wrong number of values";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Rows wrapped over several lines: a name, then i values (lower triangle),
+// i + 1 (with diagonal) or n (square), read in order
+template <typename T>
+static bool parse_tokens(const char* begin, const char* end, int n, std::vector<std::string>& names,
+                         packed_triangle<T>& D, std::string& error) {
+    names.assign(n, "");
+    D = packed_triangle<T>(n);
+    const char* p = skip_space(begin, end);
+    size_t count = 0;
+    for (const char* q = p; q < end; q = skip_space(skip_token(q, end), end)) count++;
+    // count = n names + values; solve for the layout
+    size_t values = count - std::min(count, size_t(n));
+    size_t lower = size_t(n) * (n - 1) / 2;
+    int width;
+    if (values == lower) width = 0;
+    else if (values == lower + n) width = 1;
+    else if (values == size_t(n) * n) width = n;
+    else {
+        error = "expected " + std::to_string(n) + " rows of a square or lower-triangular matrix";
+        return false;
+    }
+
+    for (int i = 0; i < n; i++) {
+        const char* name_end = skip_token(p, end);
+        names[i].assign(p, name_end);
+        p = name_end;
+        T* row = D.row(i);
+        int row_values = width == n ? n : i + width;
+        for (int j = 0; j < row_values; j++) {
+            p = skip_space(p, end);
+            T value;
+            const char* next = parse_value(p, end, value);
+            if (!next) {
+                error = "bad value in row " + std::to_string(i + 1) + " (" + names[i] + ")";
+                return false;
+            }
+            if (j < i) row[j] = value;
+            p = next;
+        }
+        p = skip_space(p, end);
+    }
+    return true;
+}
+
+template <typename T>
+bool read_phylip_matrix(const std::string& filename, std::vector<std::string>& names, packed_triangle<T>& D, int threads) {
+    mapped_file file;
+    if (!file.open(filename)) {
+        std::cerr << "Error: could not open '" << filename << "'" << std::endl;
+        return false;
+    }
+    const char* end = file.data + file.size;
+    const char* p = skip_space(file.data, end);
+    int n = 0;
+    auto header = std::from_chars(p, end, n);
+    if (header.ec != std::errc() || n < 1) {
+        std::cerr << "Error: '" << filename << "' does not start with a PHYLIP taxon count" << std::endl;
+        return false;
+    }
+    // Rows start on the line after the count
+    p = header.ptr;
+    while (p < end && *p != '\n') p++;
+
+    std::string error;
+    bool read = parse_rows(p, end, n, names, D, threads, error);
+    if (!read && error.empty()) read = parse_tokens(p, end, n, names, D, error);
+    if (!read) {
+        std::cerr << "Error: '" << filename << "': " << error << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template bool read_phylip_matrix<float>(const std::string&, std::vector<std::string>&, packed_triangle<float>&, int);
+template bool read_phylip_matrix<double>(const std::string&, std::vector<std::string>&, packed_triangle<double>&, int);
+template bool read_phylip_matrix<half>(const std::string&, std::vector<std::string>&, packed_triangle<half>&, int);
+
+// Rows are formatted with to_chars in parallel batches and written in order;
+// the shortest round-trip form reads back to the same stored value
+template <typename T>
+bool write_phylip_matrix(const std::string& filename, const std::vector<std::string>& names,
+                         const packed_triangle<T>& D, bool lower, int threads) {
+    FILE* out = std::fopen(filename.c_str(), "wb");
+    if (!out) {
+        std::cerr << "Error: could not write '" << filename << "'" << std::endl;
+        return false;
+    }
+    int n = D.n;
+    std::string header = std::to_string(n) + "\n";
+    bool ok = std::fwrite(header.data(), 1, header.size(), out) == header.size();
+
+    int batch = write_rows * resolve_threads(threads);
+    std::vector<std::string> text(batch);
+    std::vector<T> upper;
+    for (int lo = 0; ok && lo < n; lo += batch) {
+        int hi = std::min(n, lo + batch);
+        // A square row's upper part D(i, j > i) is column i of the later rows;
+        // it is gathered for the whole batch while those rows are read in order
+        if (!lower) {
+            upper.resize(size_t(hi - lo) * n);
+            parallel_for_blocks(lo + 1, n, 256, threads, [&](int first, int last) {
+                for (int j = first; j < last; j++) {
+                    const T* source = D.row(j);
+                    for (int i = lo; i < std::min(hi, j); i++) upper[size_t(i - lo) * n + j] = source[i];
+                }
+            });
+        }
+        parallel_for(lo, hi, threads, [&](int i) {
+            std::string& line = text[i - lo];
+            line.clear();
+            // Names are read back as whitespace-delimited tokens
+            for (char c : names[i]) line += std::isspace((unsigned char)c) ? '_' : c;
+            char buffer[32];
+            const T* row = D.row(i);
+            int width = lower ? i : n;
+            for (int j = 0; j < width; j++) {
+                T value = j < i ? row[j] : j == i ? T(0) : upper[size_t(i - lo) * n + j];
+                auto result = std::is_same<T, double>::value ? std::to_chars(buffer, buffer + sizeof(buffer), double(value))
+                                                             : std::to_chars(buffer, buffer + sizeof(buffer), float(value));
+                line += ' ';
+                line.append(buffer, result.ptr);
+            }
+            line += '\n';
+        });
+        for (int i = lo; ok && i < hi; i++) ok = std::fwrite(text[i - lo].data(), 1, text[i - lo].size(), out) == text[i - lo].size();
+    }
+    ok = std::fclose(out) == 0 && ok;
+    if (!ok) std::cerr << "Error: could not write '" << filename << "'" << std::endl;
+    return ok;
+}
+
+template bool write_phylip_matrix<float>(const std::string&, const std::vector<std::string>&, const packed_triangle<float>&, bool, int);
+template bool write_phylip_matrix<double>(const std::string&, const std::vector<std::string>&, const packed_triangle<double>&, bool, int);
+template bool write_phylip_matrix<half>(const std::string&, const std::vector<std::string>&, const packed_triangle<half>&, bool, int);
+
+template <typename T>
+static pipeline_result phylip_tree(const std::string& filename, const pipeline_options& options) {
+    std::vector<std::string> names;
+    packed_triangle<T> D;
+    if (!read_phylip_matrix(filename, names, D, options.threads)) return pipeline_result();
+    if (options.verbose) {
+        std::cout << "Read a " << D.n << " x " << D.n << " distance matrix from '" << filename << "'" << std::endl;
+    }
+    return tree_from_triangle(D, names, options);
+}
+
+pipeline_result build_tree_from_phylip(const std::string& filename, const pipeline_options& options) {
+    switch (options.storage) {
+        case precision::float16: return phylip_tree<half>(filename, options);
+        case precision::float64: return phylip_tree<double>(filename, options);
+        default: return phylip_tree<float>(filename, options);
+    }
+}
+
+template <typename T>
+static std::vector<pipeline_result> phylip_trees(const std::string& filename, const pipeline_options& options) {
+    std::vector<std::string> names;
+    packed_triangle<T> D;
+    if (!read_phylip_matrix(filename, names, D, options.threads)) return {};
+    if (options.verbose) {
+        std::cout << "Read a " << D.n << " x " << D.n << " distance matrix from '" << filename << "'" << std::endl;
+    }
+    return trees_from_triangle(D, names, options);
+}
+
+std::vector<pipeline_result> build_trees_from_phylip(const std::string& filename, const pipeline_options& options) {
+    switch (options.storage) {
+        case precision::float16: return phylip_trees<half>(filename, options);
+        case precision::float64: return phylip_trees<double>(filename, options);
+        default: return phylip_trees<float>(filename, options);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef PHYLO_H
+#define PHYLO_H
+
+/*
+ * C interface to the tree construction pipeline.
+ *
+ * Sequences are passed as borrowed pointers and are only read during the
+ * call. Results are owned by the library; the Newick string and the distance
+ * matrix are returned as pointers into the result and stay valid until
+ * phylo_result_free() is called.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PHYLO_ABI_VERSION 1
+
+/* The library is built with -fvisibility=hidden; only these functions are exported */
+#if defined(__GNUC__)
+#define PHYLO_API __attribute__((visibility("default")))
+#else
+#define PHYLO_API
+#endif
+
+/* Status codes */
+#define PHYLO_OK 0
+#define PHYLO_INVALID_ARGUMENT 1
+#define PHYLO_OUT_OF_MEMORY 2
+#define PHYLO_INTERNAL_ERROR 3
+
+typedef struct phylo_options {
+    size_t struct_size;     /* set by phylo_options_init() */
+    int kmer_length;
+    const char* method;     /* "fractional", "mahalanobis", "cosine", or "p", "jc69", "k2p" for alignments */
+    const char* algorithm;  /* "nj", "fm", "upgma" or "me" */
+    int verbose;
+    int canonical;          /* count k-mers together with their reverse complement (dna only) */
+    int threads;            /* 0 uses every hardware thread */
+    const char* alphabet;   /* "dna", "protein", "murphy10" or "dayhoff6" */
+    const char* precision;  /* matrix storage: "float32", "float64" or "float16" */
+} phylo_options;
+
+typedef struct phylo_result phylo_result;
+
+PHYLO_API int phylo_abi_version(void);
+PHYLO_API void phylo_options_init(phylo_options* options);
+
+/*
+ * Build a tree from `count` sequences. `lengths` may be NULL for
+ * NUL-terminated sequences, `names` may be NULL to label leaves by index.
+ * An unknown method, algorithm, alphabet or precision, or alignment
+ * sequences of different lengths, return PHYLO_INVALID_ARGUMENT.
+ */
+PHYLO_API int phylo_build_tree(const char* const* names, const char* const* sequences, const size_t* lengths,
+                               size_t count, const phylo_options* options, phylo_result** result);
+
+PHYLO_API const char* phylo_result_newick(const phylo_result* result, size_t* length);
+/* Row-major count x count matrix */
+PHYLO_API const float* phylo_result_matrix(const phylo_result* result, size_t* count);
+PHYLO_API void phylo_result_free(phylo_result* result);
+
+PHYLO_API const char* phylo_status_string(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,140 @@
+#include "phylo.h"
+#include "tree.hpp"
+#include <cstring>
+#include <cstddef>
+#include <new>
+
+// Fields appended after ABI version 1 are only read when the caller's struct has them
+#define PHYLO_HAS_FIELD(options, field) \
+    ((options)->struct_size >= offsetof(phylo_options, field) + sizeof((options)->field))
+
+struct phylo_result {
+    std::string newick;
+    std::vector<float> matrix;
+    size_t count;
+};
+
+int phylo_abi_version(void) {
+    return PHYLO_ABI_VERSION;
+}
+
+void phylo_options_init(phylo_options* options) {
+    if (!options) return;
+    options->struct_size = sizeof(phylo_options);
+    options->kmer_length = 8;
+    options->method = "fractional";
+    options->algorithm = "nj";
+    options->verbose = 0;
+    options->canonical = 0;
+    options->threads = 0;
+    options->alphabet = "dna";
+    options->precision = "float32";
+}
+
+int phylo_build_tree(const char* const* names, const char* const* sequences, const size_t* lengths,
+                     size_t count, const phylo_options* options, phylo_result** result) {
+    if (!result || (!sequences && count > 0)) {
+        return PHYLO_INVALID_ARGUMENT;
+    }
+    *result = nullptr;
+
+    pipeline_options opts;
+    if (options) {
+        if (!PHYLO_HAS_FIELD(options, verbose) || options->kmer_length <= 0) {
+            return PHYLO_INVALID_ARGUMENT;
+        }
+        opts.kmer_length = options->kmer_length;
+        if (options->method) opts.method = options->method;
+        if (options->algorithm) opts.algorithm = options->algorithm;
+        opts.verbose = options->verbose != 0;
+        if (PHYLO_HAS_FIELD(options, canonical)) opts.canonical = options->canonical != 0;
+        if (PHYLO_HAS_FIELD(options, threads)) opts.threads = options->threads;
+        if (PHYLO_HAS_FIELD(options, alphabet) && options->alphabet) opts.alphabet = options->alphabet;
+        if (PHYLO_HAS_FIELD(options, precision) && options->precision &&
+            !parse_precision(options->precision, opts.storage)) {
+            return PHYLO_INVALID_ARGUMENT;
+        }
+        if (!is_alphabet(opts.alphabet) || opts.kmer_length > max_kmer_length(opts.alphabet)) {
+            return PHYLO_INVALID_ARGUMENT;
+        }
+        if (!is_distance_method(opts.method) || !is_algorithm(opts.algorithm)) {
+            return PHYLO_INVALID_ARGUMENT;
+        }
+        if (opts.alphabet != "dna") opts.canonical = false;
+    }
+
+    try {
+        // Leaves without a name are labelled by their index
+        std::vector<std::string> index_names(count);
+        sequence_view view;
+        for (size_t i = 0; i < count; i++) {
+            if (!sequences[i]) {
+                return PHYLO_INVALID_ARGUMENT;
+            }
+            size_t length = lengths ? lengths[i] : std::strlen(sequences[i]);
+            view.seq.emplace_back(sequences[i], length);
+            if (names && names[i]) {
+                view.name.emplace_back(names[i]);
+            } else {
+                index_names[i] = std::to_string(i);
+                view.name.emplace_back(index_names[i]);
+            }
+        }
+
+        // Alignment distances need sequences of one length. Checked here
+        // so the build never reports it on stderr.
+        if (is_alignment_method(opts.method)) {
+            for (size_t i = 1; i < count; i++) {
+                if (view.seq[i].size() != view.seq[0].size()) {
+                    return PHYLO_INVALID_ARGUMENT;
+                }
+            }
+        }
+
+        pipeline_result built = build_tree(view, opts);
+        if (built.matrix.size() != count || (count > 0 && built.newick.empty())) {
+            return PHYLO_INTERNAL_ERROR;
+        }
+
+        phylo_result* out = new phylo_result;
+        out->newick = std::move(built.newick);
+        out->count = count;
+        out->matrix.resize(count * count);
+        for (size_t i = 0; i < count; i++) {
+            std::copy(built.matrix[i].distances.begin(), built.matrix[i].distances.end(), out->matrix.begin() + i * count);
+        }
+        *result = out;
+        return PHYLO_OK;
+    }
+    catch (const std::bad_alloc&) {
+        return PHYLO_OUT_OF_MEMORY;
+    }
+    catch (...) {
+        return PHYLO_INTERNAL_ERROR;
+    }
+}
+
+const char* phylo_result_newick(const phylo_result* result, size_t* length) {
+    if (!result) return nullptr;
+    if (length) *length = result->newick.size();
+    return result->newick.c_str();
+}
+
+const float* phylo_result_matrix(const phylo_result* result, size_t* count) {
+    if (!result) return nullptr;
+    if (count) *count = result->count;
+    return result->matrix.data();
+}
+
+void phylo_result_free(phylo_result* result) {
+    delete result;
+}
+
+const char* phylo_status_string(int status) {
+    switch (status) {
+        case PHYLO_OK: return "ok";
+        case PHYLO_INVALID_ARGUMENT: return "invalid argument";
+        case PHYLO_OUT_OF_MEMORY: return "out of memory";
+        default: return "internal error";
+    }
+}
@@ -0,0 +1,440 @@
+#include "tree.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+sequence_view view_sequences(const sequence& sequences) {
+    sequence_view view;
+    view.seq.assign(sequences.seq.begin(), sequences.seq.end());
+    view.name.assign(sequences.name.begin(), sequences.name.end());
+    return view;
+}
+
+bool parse_precision(const std::string& name, precision& out) {
+    if (name == "float32" || name == "float") out = precision::float32;
+    else if (name == "float64" || name == "double") out = precision::float64;
+    else if (name == "float16" || name == "half") out = precision::float16;
+    else return false;
+    return true;
+}
+
+bool is_algorithm(const std::string& algorithm) {
+    return algorithm == "nj" || algorithm == "upgma" || algorithm == "me" || algorithm == "fm";
+}
+
+template <typename T>
+void build_tree_from_matrix(packed_triangle<T>& D, Tree& tree, std::string algorithm, bool verbose, int threads, merge_checkpoint* checkpoint) {
+    if (algorithm == "fm") {
+        fitch_margoliash(D, tree, verbose);
+    } else if (algorithm == "upgma") {
+        upgma(D, tree, verbose, threads, checkpoint);
+    } else if (algorithm == "me") {
+        minimum_evolution(D, tree, verbose, threads, checkpoint);
+    } else {
+        neighbor_joining(D, tree, verbose, threads, checkpoint);
+    }
+}
+
+template void build_tree_from_matrix<float>(packed_triangle<float>&, Tree&, std::string, bool, int, merge_checkpoint*);
+template void build_tree_from_matrix<double>(packed_triangle<double>&, Tree&, std::string, bool, int, merge_checkpoint*);
+template void build_tree_from_matrix<half>(packed_triangle<half>&, Tree&, std::string, bool, int, merge_checkpoint*);
+
+void build_tree_from_matrix(std::vector<dmatrix_row>& D, Tree& tree, std::string algorithm, bool verbose) {
+    if (algorithm == "fm") {
+        fitch_margoliash(D, tree, verbose);
+    } else if (algorithm == "upgma") {
+        upgma(D, tree, verbose);
+    } else if (algorithm == "me") {
+        minimum_evolution(D, tree, verbose);
+    } else {
+        neighbor_joining(D, tree, verbose);
+    }
+}
+
+// -time-limit applies to the iterative algorithms
+static bool refines(const pipeline_options& options, const std::string& algorithm) {
+    return options.deadline != std::chrono::steady_clock::time_point() && (algorithm == "fm" || algorithm == "me");
+}
+
+// Runs the builder on D, which it consumes. With a checkpoint, the tree
+// continues from its restored joins and snapshots are taken along the way.
+template <typename T>
+static pipeline_result run_builder(packed_triangle<T>& D, const std::vector<std::string>& names,
+                                   const pipeline_options& options, merge_checkpoint* checkpoint) {
+    pipeline_result result;
+    bool partial = checkpoint && checkpoint->restored.m;
+    if (partial && (options.keep_matrix || options.fit)) {
+        std::cerr << "Warning: the full matrix is gone after resuming a partial build; "
+                  << "it is not kept or used for -fit" << std::endl;
+    }
+    if (options.keep_matrix && !partial) {
+        result.matrix = D.to_rows();
+    }
+    // The builders consume D, so scoring or refining the tree needs its own copy
+    packed_triangle<T> original;
+    bool fit = options.fit && !partial;
+    bool anytime = refines(options, options.algorithm) && !partial;
+    if (fit || anytime) original = D;
+    Tree tree(names);
+    if (checkpoint) checkpoint->replay(tree);
+    build_tree_from_matrix(D, tree, anytime ? "nj" : options.algorithm, options.verbose, options.threads, checkpoint);
+    if (anytime) {
+        D = packed_triangle<T>();
+        refine_tree(original, tree, names, options);
+    }
+
+    result.newick = tree.newick();
+    result.tree = to_compact_tree(tree);
+    if (result.newick.empty() && names.size() == 1) {
+        result.newick = names[0] + ";";
+    }
+    if (fit) {
+        result.fit = evaluate_tree_fit(view_tree(result.tree), original, 2.0, options.threads);
+    }
+    return result;
+}
+
+static std::string profile_checkpoint(const pipeline_options& options) {
+    return options.checkpoint + ".profiles";
+}
+
+static std::string merge_checkpoint_file(const pipeline_options& options) {
+    return options.checkpoint + ".merge";
+}
+
+// Build the tree from a working triangle, snapshotting the matrix first
+// when checkpoints are on; a finished build removes its checkpoint files.
+// The matrix is exported before the builder consumes it.
+template <typename T>
+pipeline_result tree_from_triangle(packed_triangle<T>& D, const std::vector<std::string>& names, const pipeline_options& options) {
+    if (!options.matrix_output.empty()) {
+        write_phylip_matrix(options.matrix_output, names, D, options.matrix_lower, options.threads);
+    }
+    if (options.checkpoint.empty()) {
+        return run_builder(D, names, options, nullptr);
+    }
+    merge_checkpoint checkpoint(merge_checkpoint_file(options), options.algorithm, options.checkpoint_interval);
+    merge_state start = {D.n, std::vector<int>(D.n), {}};
+    for (int i = 0; i < D.n; i++) start.nodes[i] = i;
+    checkpoint.save(D, Tree(names), start);
+    pipeline_result result = run_builder(D, names, options, &checkpoint);
+    checkpoint.remove();
+    std::remove(profile_checkpoint(options).c_str());
+    return result;
+}
+
+template pipeline_result tree_from_triangle<float>(packed_triangle<float>&, const std::vector<std::string>&, const pipeline_options&);
+template pipeline_result tree_from_triangle<double>(packed_triangle<double>&, const std::vector<std::string>&, const pipeline_options&);
+template pipeline_result tree_from_triangle<half>(packed_triangle<half>&, const std::vector<std::string>&, const pipeline_options&);
+
+// One tree per algorithm from a matrix that is only read. Each builder runs
+// in its own thread on a working copy it makes there (FM on square rows
+// expanded straight from D), so the copies are filled concurrently and freed
+// as each build ends. Builders are quiet: their per-merge lines would
+// interleave. With a deadline, FM and ME refine against D itself.
+template <typename T>
+std::vector<pipeline_result> trees_from_triangle(const packed_triangle<T>& D, const std::vector<std::string>& names,
+                                                 const pipeline_options& options) {
+    if (!options.matrix_output.empty()) {
+        write_phylip_matrix(options.matrix_output, names, D, options.matrix_lower, options.threads);
+    }
+    const std::vector<std::string>& algorithms = options.algorithms;
+    std::vector<pipeline_result> results(algorithms.size());
+    std::mutex print_mutex;
+    std::vector<std::thread> builders;
+    // The threads are split between the builders, which share the pool
+    int total = resolve_threads(options.threads), count = int(algorithms.size());
+    for (int a = 0; a < count; a++) {
+        builders.emplace_back([&, a]() {
+            auto start = std::chrono::steady_clock::now();
+            Tree tree(names);
+            pipeline_options own = options;
+            own.algorithm = algorithms[a];
+            own.progress_output.clear();
+            own.threads = std::max(1, (total + a) / count);
+            if (refines(own, own.algorithm)) {
+                packed_triangle<T> working = D;
+                build_tree_from_matrix(working, tree, "nj", false, own.threads);
+                working = packed_triangle<T>();
+                refine_tree(D, tree, names, own);
+            } else if (algorithms[a] == "fm") {
+                fitch_margoliash(D, tree, false);
+            } else {
+                packed_triangle<T> working = D;
+                build_tree_from_matrix(working, tree, algorithms[a], false, own.threads);
+            }
+            pipeline_result& result = results[a];
+            result.newick = tree.newick();
+            result.tree = to_compact_tree(tree);
+            if (result.newick.empty() && names.size() == 1) {
+                result.newick = names[0] + ";";
+            }
+            if (options.fit) {
+                result.fit = evaluate_tree_fit(view_tree(result.tree), D, 2.0, own.threads);
+            }
+            if (options.verbose) {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cout << "Built the " << algorithms[a] << " tree in "
+                          << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+            }
+        });
+    }
+    for (auto& builder : builders) builder.join();
+    return results;
+}
+
+template std::vector<pipeline_result> trees_from_triangle<float>(const packed_triangle<float>&, const std::vector<std::string>&, const pipeline_options&);
+template std::vector<pipeline_result> trees_from_triangle<double>(const packed_triangle<double>&, const std::vector<std::string>&, const pipeline_options&);
+template std::vector<pipeline_result> trees_from_triangle<half>(const packed_triangle<half>&, const std::vector<std::string>&, const pipeline_options&);
+
+template <typename T>
+bool distance_triangle(const sequence_view& sequences, const pipeline_options& options, packed_triangle<T>& D) {
+    if (is_alignment_method(options.method)) {
+        std::vector<dmatrix_row> rows = alignment_distance_matrix(sequences, options.method, options.threads);
+        if (rows.size() != sequences.seq.size()) return false;
+        D = packed_triangle<T>(rows);
+        return true;
+    }
+    if (options.verbose) {
+        std::cout << "Counting K-mers of length " << options.kmer_length
+                  << " for " << sequences.seq.size() << " sequences" << std::endl;
+    }
+    std::vector<kmer_profile> profiles = count_kmer_profiles(sequences, options.kmer_length, options.canonical, options.alphabet, options.threads);
+    D = profile_distance_triangle<T>(profiles, parse_distance_method(options.method), options.threads);
+    return true;
+}
+
+template bool distance_triangle<float>(const sequence_view&, const pipeline_options&, packed_triangle<float>&);
+template bool distance_triangle<double>(const sequence_view&, const pipeline_options&, packed_triangle<double>&);
+template bool distance_triangle<half>(const sequence_view&, const pipeline_options&, packed_triangle<half>&);
+
+// Build the tree for an already computed matrix, keeping the matrix in the result
+pipeline_result build_tree(std::vector<dmatrix_row> matrix, const std::vector<std::string>& names, const pipeline_options& options) {
+    packed_triangle<float> D(matrix);
+    pipeline_options no_copy = options;
+    no_copy.keep_matrix = false;
+    pipeline_result result = tree_from_triangle(D, names, no_copy);
+    if (options.keep_matrix) {
+        result.matrix = std::move(matrix);
+    }
+    return result;
+}
+
+static std::vector<std::string> names_of(const sequence_view& sequences) {
+    return std::vector<std::string>(sequences.name.begin(), sequences.name.end());
+}
+
+// Average linkage over a k-nearest-neighbour graph instead of the full matrix
+static pipeline_result sparse_tree(const std::vector<kmer_profile>& profiles, const std::vector<std::string>& names, const pipeline_options& options) {
+    profile_distance_fn distance = profile_distance_function(parse_distance_method(options.method));
+    std::vector<sparse_edge> edges = knn_graph(profiles, options.sparse_neighbors, distance, options.threads);
+    if (options.verbose) {
+        std::cout << "Nearest-neighbour graph: " << edges.size() << " edges between "
+                  << profiles.size() << " sequences" << std::endl;
+    }
+    Tree tree(names);
+    sparse_upgma(edges, tree, [&](int a, int b) { return distance(profiles[a], profiles[b]); }, options.verbose, options.threads);
+
+    pipeline_result result;
+    result.newick = tree.newick();
+    result.tree = to_compact_tree(tree);
+    if (result.newick.empty() && names.size() == 1) {
+        result.newick = names[0] + ";";
+    }
+    return result;
+}
+
+// Distances are stored at the requested precision from the start. Sparse
+// and divided builds have no merge snapshot, so they remove the saved
+// profiles themselves when done.
+template <typename T>
+static pipeline_result tree_from_profiles(const std::vector<kmer_profile>& profiles, const std::vector<std::string>& names, const pipeline_options& options) {
+    bool divided = options.divide_size > 0 && int(profiles.size()) > options.divide_size;
+    if (options.sparse_neighbors > 0 || divided) {
+        pipeline_result result = options.sparse_neighbors > 0 ? sparse_tree(profiles, names, options) : divide_tree<T>(profiles, names, options);
+        if (!options.checkpoint.empty()) std::remove(profile_checkpoint(options).c_str());
+        return result;
+    }
+    packed_triangle<T> D = profile_distance_triangle<T>(profiles, parse_distance_method(options.method), options.threads);
+    return tree_from_triangle(D, names, options);
+}
+
+static pipeline_result build_collapsed_tree(const sequence_view& sequences, const pipeline_options& options);
+
+pipeline_result build_tree(const sequence_view& sequences, const pipeline_options& options) {
+    if (options.dedup || options.collapse_distance > 0) {
+        return build_collapsed_tree(sequences, options);
+    }
+    if (is_alignment_method(options.method)) {
+        std::vector<dmatrix_row> D = alignment_distance_matrix(sequences, options.method, options.threads);
+        if (D.size() != sequences.seq.size()) return pipeline_result();
+        return build_tree(std::move(D), names_of(sequences), options);
+    }
+
+    if (options.verbose) {
+        std::cout << "Counting K-mers of length " << options.kmer_length
+                  << " for " << sequences.seq.size() << " sequences" << std::endl;
+    }
+    std::vector<kmer_profile> profiles = count_kmer_profiles(sequences, options.kmer_length, options.canonical, options.alphabet, options.threads);
+    if (!options.checkpoint.empty()) {
+        profile_set set;
+        set.kmer_length = options.kmer_length;
+        set.canonical = options.canonical;
+        set.alphabet = options.alphabet;
+        set.names = names_of(sequences);
+        set.profiles = std::move(profiles);
+        write_profile_set(profile_checkpoint(options), set);
+        profiles = std::move(set.profiles);
+    }
+    switch (options.storage) {
+        case precision::float16: return tree_from_profiles<half>(profiles, names_of(sequences), options);
+        case precision::float64: return tree_from_profiles<double>(profiles, names_of(sequences), options);
+        default: return tree_from_profiles<float>(profiles, names_of(sequences), options);
+    }
+}
+
+// Continues an interrupted build from options.checkpoint: from the merge
+// snapshot when there is one, otherwise from the saved k-mer profiles.
+// Returns false when neither can be used, so the caller starts over.
+template <typename T>
+static bool resume_tree(const pipeline_options& options, const std::vector<std::string>& expected, pipeline_result& result) {
+    merge_checkpoint checkpoint(merge_checkpoint_file(options), options.algorithm, options.checkpoint_interval);
+    std::vector<std::string> names;
+    packed_triangle<T> D;
+    bool loaded = checkpoint.load(names, D);
+    if (loaded && names != expected) {
+        std::cerr << "Error: " << merge_checkpoint_file(options) << " was written for other sequences; starting over" << std::endl;
+        return false;
+    }
+    if (loaded) {
+        if (options.verbose) {
+            std::cout << "Resuming from " << merge_checkpoint_file(options) << " with "
+                      << (checkpoint.restored.m ? checkpoint.restored.m : D.n) << " of "
+                      << names.size() << " nodes left to join" << std::endl;
+        }
+        result = run_builder(D, names, options, &checkpoint);
+        checkpoint.remove();
+        std::remove(profile_checkpoint(options).c_str());
+        return true;
+    }
+
+    if (is_alignment_method(options.method) || !std::ifstream(profile_checkpoint(options))) return false;
+    profile_set set;
+    if (!read_profile_set(profile_checkpoint(options), set)) return false;
+    if (set.names != expected) {
+        std::cerr << "Error: " << profile_checkpoint(options) << " was written for other sequences; starting over" << std::endl;
+        return false;
+    }
+    if (set.kmer_length != options.kmer_length || set.canonical != options.canonical || set.alphabet != options.alphabet) {
+        std::cerr << "Error: " << profile_checkpoint(options) << " was counted with other k-mer settings; starting over" << std::endl;
+        return false;
+    }
+    if (options.verbose) {
+        std::cout << "Resuming from " << profile_checkpoint(options) << " with "
+                  << set.profiles.size() << " counted profiles" << std::endl;
+    }
+    result = tree_from_profiles<T>(set.profiles, set.names, options);
+    return true;
+}
+
+bool resume_from_checkpoint(const pipeline_options& options, const std::vector<std::string>& names, pipeline_result& result) {
+    if (options.checkpoint.empty()) return false;
+    switch (options.storage) {
+        case precision::float16: return resume_tree<half>(options, names, result);
+        case precision::float64: return resume_tree<double>(options, names, result);
+        default: return resume_tree<float>(options, names, result);
+    }
+}
+
+// Builds the tree on one representative per cluster and grafts the other
+// sequences back. Clustering is deterministic, so a resumed run finds the
+// same representatives and continues their build from the checkpoint.
+static pipeline_result build_collapsed_tree(const sequence_view& sequences, const pipeline_options& options) {
+    pipeline_options reduced_options = options;
+    reduced_options.dedup = false;
+    reduced_options.collapse_distance = 0;
+
+    sequence_clusters clusters = exact_duplicates(sequences);
+    auto representatives = [&]() {
+        sequence_view view;
+        for (int r : clusters.representatives) {
+            view.seq.push_back(sequences.seq[r]);
+            view.name.push_back(sequences.name[r]);
+        }
+        return view;
+    };
+
+    pipeline_result reduced;
+    if (options.collapse_distance > 0 && !is_alignment_method(options.method)) {
+        sequence_view unique = representatives();
+        std::vector<kmer_profile> profiles = count_kmer_profiles(unique, options.kmer_length, options.canonical, options.alphabet, options.threads);
+        collapse_near_duplicates(clusters, profiles, profile_distance_function(parse_distance_method(options.method)),
+                                 options.collapse_distance, options.threads);
+        sequence_view leaders = representatives();
+        if (!options.resume || !resume_from_checkpoint(reduced_options, names_of(leaders), reduced)) {
+            switch (options.storage) {
+                case precision::float16: reduced = tree_from_profiles<half>(profiles, names_of(leaders), reduced_options); break;
+                case precision::float64: reduced = tree_from_profiles<double>(profiles, names_of(leaders), reduced_options); break;
+                default: reduced = tree_from_profiles<float>(profiles, names_of(leaders), reduced_options);
+            }
+        }
+    } else if (!options.resume || !resume_from_checkpoint(reduced_options, names_of(representatives()), reduced)) {
+        reduced = build_tree(representatives(), reduced_options);
+    }
+
+    if (options.verbose) {
+        std::cout << "Built the tree on " << clusters.representatives.size() << " representatives of "
+                  << sequences.seq.size() << " sequences" << std::endl;
+    }
+    if (clusters.representatives.size() == sequences.seq.size()) return reduced;
+    return graft_clusters(reduced, clusters, names_of(sequences));
+}
+
+// output.txt -> output_k8.txt
+std::string kmer_output_name(const std::string& output, int kmer_length) {
+    size_t dot = output.find_last_of('.');
+    std::string suffix = "_k" + std::to_string(kmer_length);
+    if (dot == std::string::npos) return output + suffix;
+    return output.substr(0, dot) + suffix + output.substr(dot);
+}
+
+// Each length's tree goes through the same builders as a single build, at
+// -precision and with -sparse or -divide; its profiles are freed once it is
+// built. Collapsed builds cluster and count per length inside build_tree.
+std::vector<pipeline_result> build_trees(const sequence_view& sequences, const pipeline_options& options, const std::vector<int>& kmer_lengths) {
+    bool separate = options.dedup || options.collapse_distance > 0 || is_alignment_method(options.method);
+    std::vector<std::vector<kmer_profile>> profiles;
+    if (!separate) {
+        if (options.verbose) {
+            std::cout << "Counting K-mers of " << kmer_lengths.size() << " lengths"
+                      << " for " << sequences.seq.size() << " sequences" << std::endl;
+        }
+        profiles = count_kmer_profiles(sequences, kmer_lengths, options.canonical, options.alphabet, options.threads);
+    }
+
+    std::vector<pipeline_result> results;
+    for (size_t k = 0; k < kmer_lengths.size(); k++) {
+        pipeline_options per_k = options;
+        per_k.kmer_length = kmer_lengths[k];
+        per_k.deadline = {};
+        per_k.progress_output.clear();
+        per_k.checkpoint.clear();
+        if (!options.matrix_output.empty()) per_k.matrix_output = kmer_output_name(options.matrix_output, kmer_lengths[k]);
+        if (separate) {
+            results.push_back(build_tree(sequences, per_k));
+            continue;
+        }
+        switch (options.storage) {
+            case precision::float16: results.push_back(tree_from_profiles<half>(profiles[k], names_of(sequences), per_k)); break;
+            case precision::float64: results.push_back(tree_from_profiles<double>(profiles[k], names_of(sequences), per_k)); break;
+            default: results.push_back(tree_from_profiles<float>(profiles[k], names_of(sequences), per_k));
+        }
+        std::vector<kmer_profile>().swap(profiles[k]);
+    }
+    return results;
+}
+
+pipeline_result build_tree(const sequence& sequences, const pipeline_options& options) {
+    return build_tree(view_sequences(sequences), options);
+}
@@ -0,0 +1,506 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+
+// The best tree so far is written at most once per this many seconds
+static const double write_interval = 1.0;
+// Passes over all leaf pairs cut the rows into this many chunks, each
+// summed by itself and reduced in order
+static const int pair_chunks = 64;
+// Branch lengths are final once the residual norm is this fraction of the first
+static const double tolerance = 1e-6;
+
+using clock_type = std::chrono::steady_clock;
+
+// Rooted binary tree with the leaves of every subtree in one range of
+// `order`: start[v] to start[v] + count[v]. Parents must follow children.
+struct layout {
+    int leaves = 0, nodes = 0, root = -1;
+    std::vector<int32_t> parent, child1, child2, level, start, count, order;
+
+    explicit layout(const compact_tree& tree) : leaves(tree.leaves), nodes(tree.parent.size()), parent(tree.parent) {
+        child1.assign(nodes, -1);
+        child2.assign(nodes, -1);
+        for (int v = 0; v < nodes; v++) {
+            int p = parent[v];
+            if (p < 0) root = v;
+            else if (child1[p] < 0) child1[p] = v;
+            else child2[p] = v;
+        }
+        level.assign(nodes, 0);
+        for (int v = nodes - 1; v >= 0; v--) {
+            if (parent[v] >= 0) level[v] = level[parent[v]] + 1;
+        }
+        count.assign(nodes, 0);
+        for (int v = 0; v < nodes; v++) {
+            if (v < leaves) count[v] = 1;
+            if (parent[v] >= 0) count[parent[v]] += count[v];
+        }
+        start.assign(nodes, 0);
+        for (int v = nodes - 1; v >= 0; v--) {
+            if (child1[v] < 0) continue;
+            start[child1[v]] = start[v];
+            start[child2[v]] = start[v] + count[child1[v]];
+        }
+        order.assign(leaves, 0);
+        for (int i = 0; i < leaves; i++) order[start[i]] = i;
+    }
+
+    int sibling(int v) const {
+        int p = parent[v];
+        return child1[p] == v ? child2[p] : child1[p];
+    }
+    bool is_leaf(int v) const { return v < leaves; }
+};
+
+// After NNIs have moved subtrees, internal nodes are renumbered in
+// post-order so parents follow their children again
+static compact_tree renumber(const compact_tree& tree) {
+    int nodes = tree.parent.size();
+    std::vector<int32_t> child1(nodes, -1), child2(nodes, -1);
+    int root = -1;
+    for (int v = 0; v < nodes; v++) {
+        int p = tree.parent[v];
+        if (p < 0) root = v;
+        else if (child1[p] < 0) child1[p] = v;
+        else child2[p] = v;
+    }
+    std::vector<int32_t> id(nodes);
+    for (int i = 0; i < tree.leaves; i++) id[i] = i;
+    int next = tree.leaves;
+    std::vector<std::pair<int, bool>> stack = {{root, false}};
+    while (!stack.empty()) {
+        auto [v, expanded] = stack.back();
+        stack.pop_back();
+        if (v < tree.leaves) continue;
+        if (expanded) {
+            id[v] = next++;
+            continue;
+        }
+        stack.emplace_back(v, true);
+        stack.emplace_back(child2[v], false);
+        stack.emplace_back(child1[v], false);
+    }
+    compact_tree out;
+    out.leaves = tree.leaves;
+    out.parent.assign(nodes, -1);
+    out.length.assign(nodes, 0.0f);
+    for (int v = 0; v < nodes; v++) {
+        if (tree.parent[v] >= 0) out.parent[id[v]] = id[tree.parent[v]];
+        out.length[id[v]] = tree.length[v];
+    }
+    return out;
+}
+
+// visit(chunk, i, j, meet) for every leaf pair j < i, meet being the node
+// where their paths join. Chunks hold about equal numbers of pairs and each
+// is visited in order by one thread.
+template <typename F>
+static void for_leaf_pairs(const layout& t, int threads, F visit) {
+    int n = t.leaves;
+    std::vector<int> bounds(pair_chunks + 1, n);
+    for (int c = 0; c < pair_chunks; c++) bounds[c] = int(n * std::sqrt(double(c) / pair_chunks));
+    parallel_for(0, pair_chunks, threads, [&](int c) {
+        std::vector<int32_t> meet(n);
+        for (int i = bounds[c]; i < bounds[c + 1]; i++) {
+            for (int u = i, p = t.parent[i]; p >= 0; u = p, p = t.parent[p]) {
+                std::fill(meet.begin() + t.start[p], meet.begin() + t.start[u], p);
+                std::fill(meet.begin() + t.start[u] + t.count[u], meet.begin() + t.start[p] + t.count[p], p);
+            }
+            for (int j = 0; j < i; j++) visit(c, i, j, meet[t.start[j]]);
+        }
+    });
+}
+
+// For every edge (by its lower node), the sum of value(d, D(i, j)) over the
+// leaf pairs it separates, d being their path length under `lengths`. A
+// pair's value is added to both leaves and to the node where they meet; an
+// edge's total is its leaves' sums less twice the pairs meeting below it.
+template <typename T, typename F>
+static std::vector<double> edge_sums(const layout& t, const std::vector<double>& lengths, const packed_triangle<T>& D,
+                                     int threads, F value) {
+    std::vector<double> depth(t.nodes, 0.0);
+    for (int v = t.nodes - 1; v >= 0; v--) {
+        if (t.parent[v] >= 0) depth[v] = depth[t.parent[v]] + lengths[v];
+    }
+    std::vector<std::vector<double>> leaf_sums(pair_chunks, std::vector<double>(t.leaves, 0.0));
+    std::vector<std::vector<double>> meeting(pair_chunks, std::vector<double>(t.nodes, 0.0));
+    for_leaf_pairs(t, threads, [&](int c, int i, int j, int meet) {
+        double q = value(depth[i] + depth[j] - 2 * depth[meet], double(D.row(i)[j]));
+        leaf_sums[c][i] += q;
+        leaf_sums[c][j] += q;
+        meeting[c][meet] += q;
+    });
+
+    std::vector<double> below(t.nodes, 0.0), inside(t.nodes, 0.0);
+    for (int c = 0; c < pair_chunks; c++) {
+        for (int i = 0; i < t.leaves; i++) below[i] += leaf_sums[c][i];
+        for (int v = 0; v < t.nodes; v++) inside[v] += meeting[c][v];
+    }
+    std::vector<double> sums(t.nodes, 0.0);
+    for (int v = 0; v < t.nodes; v++) {
+        sums[v] = below[v] - 2 * inside[v];
+        if (t.parent[v] >= 0) {
+            below[t.parent[v]] += below[v];
+            inside[t.parent[v]] += inside[v];
+        }
+    }
+    return sums;
+}
+
+// Writes the best tree so far to options.progress_output, replacing the file
+// whole, and reports its fit
+template <typename T>
+class progress_writer {
+public:
+    progress_writer(const packed_triangle<T>& D, const std::vector<std::string>& names, const pipeline_options& options)
+        : D(D), names(names), options(options), began(clock_type::now()) {}
+
+    void offer(const compact_tree& tree, const std::string& score, bool force) {
+        auto now = clock_type::now();
+        if (!force && std::chrono::duration<double>(now - last).count() < write_interval) return;
+        last = now;
+        if (!options.verbose && options.progress_output.empty()) return;
+        tree_fit fit = evaluate_tree_fit(view_tree(tree), D, 2.0, options.threads);
+        std::cout << options.algorithm << " after " << elapsed() << " s: " << score
+                  << "weighted least squares " << fit.weighted_sum_squares << std::endl;
+        if (options.progress_output.empty()) return;
+        std::string partial = options.progress_output + ".tmp";
+        write_to_file(partial, {to_newick(tree, names)});
+        std::rename(partial.c_str(), options.progress_output.c_str());
+    }
+
+    double elapsed() const { return std::chrono::duration<double>(clock_type::now() - began).count(); }
+
+private:
+    const packed_triangle<T>& D;
+    const std::vector<std::string>& names;
+    const pipeline_options& options;
+    clock_type::time_point began, last;
+};
+
+// Whether the deadline has passed, or will within `margin` seconds
+static bool past(clock_type::time_point deadline, double margin = 0) {
+    return clock_type::now() + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(margin)) >= deadline;
+}
+
+// Fitch-Margoliash branch lengths: least squares with weights 1/D^2, by
+// conjugate gradients with the diagonal as preconditioner. Each step is one
+// pass over the leaf pairs and lowers the error, so the lengths can be
+// taken at any step. The root's two edges are one edge of the unrooted tree;
+// only the first is fitted.
+template <typename T>
+static void fit_lengths(const packed_triangle<T>& D, compact_tree& tree, progress_writer<T>& log, const pipeline_options& options) {
+    layout t(tree);
+    auto weight = [](double d) { return d > 0 ? 1 / (d * d) : 0.0; };
+    std::vector<char> fitted(t.nodes, 1);
+    fitted[t.root] = 0;
+    fitted[t.child2[t.root]] = 0;
+
+    std::vector<double> x(tree.length.begin(), tree.length.end());
+    std::vector<double> diagonal = edge_sums(t, x, D, options.threads, [&](double, double d) { return weight(d); });
+    std::vector<double> r = edge_sums(t, x, D, options.threads, [&](double path, double d) { return weight(d) * (d - path); });
+    std::vector<double> z(t.nodes, 0.0), p(t.nodes, 0.0);
+    double rz = 0, first = 0;
+    for (int v = 0; v < t.nodes; v++) {
+        if (!fitted[v] || diagonal[v] <= 0) {
+            fitted[v] = 0;
+            r[v] = 0;
+        }
+        z[v] = fitted[v] ? r[v] / diagonal[v] : 0;
+        p[v] = z[v];
+        rz += r[v] * z[v];
+        first += r[v] * r[v];
+    }
+
+    int steps = 0;
+    for (double norm = first; norm > tolerance * tolerance * first && !past(options.deadline); steps++) {
+        std::vector<double> Hp = edge_sums(t, p, D, options.threads, [&](double path, double d) { return weight(d) * path; });
+        double pHp = 0;
+        for (int v = 0; v < t.nodes; v++) pHp += fitted[v] ? p[v] * Hp[v] : 0;
+        if (pHp <= 0) break;
+        double alpha = rz / pHp, next = 0;
+        norm = 0;
+        for (int v = 0; v < t.nodes; v++) {
+            if (!fitted[v]) continue;
+            x[v] += alpha * p[v];
+            r[v] -= alpha * Hp[v];
+            z[v] = r[v] / diagonal[v];
+            next += r[v] * z[v];
+            norm += r[v] * r[v];
+        }
+        for (int v = 0; v < t.nodes; v++) p[v] = z[v] + (next / rz) * p[v];
+        rz = next;
+        for (int v = 0; v < t.nodes; v++) tree.length[v] = float(x[v]);
+        log.offer(tree, "step " + std::to_string(steps + 1) + ", ", false);
+    }
+    if (options.verbose) {
+        std::cout << "Fitted branch lengths in " << steps << " steps"
+                  << (past(options.deadline) ? " before the time limit" : "") << std::endl;
+    }
+}
+
+// Tree length under balanced minimum evolution (Pauplin): the sum over leaf
+// pairs of D(i, j) 2^(1 - edges between them)
+template <typename T>
+static double balanced_length(const layout& t, const packed_triangle<T>& D, int threads) {
+    std::vector<double> sums(pair_chunks, 0.0);
+    for_leaf_pairs(t, threads, [&](int c, int i, int j, int meet) {
+        int edges = t.level[i] + t.level[j] - 2 * t.level[meet] - (meet == t.root);
+        sums[c] += std::ldexp(double(D.row(i)[j]), 1 - edges);
+    });
+    double total = 0;
+    for (double s : sums) total += s;
+    return total;
+}
+
+// An internal edge splits the tree into subtrees A, B | C, D. Swapping B
+// with C gives AC|BD and swapping A with C gives AD|BC; gain is how much
+// the move shortens the balanced tree.
+struct nni_move {
+    double gain;
+    int v, partner;  // the edge's ends (across the root: both root children)
+    int x, y;        // the subtrees that trade places
+};
+
+// Balanced averages (Desper and Gascuel) between the subtrees around each
+// edge, for every node x but the root. "Down" x is x's subtree; "up" x is
+// everything outside it, rooted at x's parent. The root is not a node of the
+// unrooted tree, so for a child of the root, up is the other child's subtree.
+struct subtree_averages {
+    std::vector<double> sibling;  // down x with down sibling(x)
+    std::vector<double> up;       // down x with up parent(x), below the root's children
+    std::vector<double> uncle;    // down x with down sibling(parent(x)), below the root's grandchildren
+    std::vector<double> far;      // down x with up grandparent(x), there too
+    // Next to the root: down x with each child of the other side's subtree,
+    // for the root's children and grandchildren
+    std::vector<double> across1, across2;
+
+    explicit subtree_averages(int nodes)
+        : sibling(nodes, 0.0), up(nodes, 0.0), uncle(nodes, 0.0), far(nodes, 0.0), across1(nodes, 0.0), across2(nodes, 0.0) {}
+
+    void add(const subtree_averages& other) {
+        for (size_t v = 0; v < sibling.size(); v++) {
+            sibling[v] += other.sibling[v];
+            up[v] += other.up[v];
+            uncle[v] += other.uncle[v];
+            far[v] += other.far[v];
+            across1[v] += other.across1[v];
+            across2[v] += other.across2[v];
+        }
+    }
+};
+
+// One pass per leaf i: its averages with every down subtree (children before
+// parents), then with the up subtrees of its ancestors (from the root down),
+// each added to the averages of i's ancestors with weight 2^-(edges to i).
+// O(n) per leaf, so O(n^2) for all of them. False when the deadline passes.
+template <typename T>
+static bool average_subtrees(const layout& t, const packed_triangle<T>& D, const pipeline_options& options,
+                             subtree_averages& averages) {
+    std::vector<int> bounds(pair_chunks + 1, t.leaves);
+    for (int c = 0; c < pair_chunks; c++) bounds[c] = int(int64_t(t.leaves) * c / pair_chunks);
+    std::vector<subtree_averages> chunks(pair_chunks, subtree_averages(t.nodes));
+    std::vector<char> stopped(pair_chunks, 0);
+    parallel_for(0, pair_chunks, options.threads, [&](int c) {
+        subtree_averages& sums = chunks[c];
+        std::vector<double> down(t.nodes), outside;
+        std::vector<int> path;
+        for (int i = bounds[c]; i < bounds[c + 1]; i++) {
+            if (past(options.deadline)) {
+                stopped[c] = 1;
+                return;
+            }
+            for (int x = 0; x < t.nodes; x++) {
+                down[x] = t.is_leaf(x) ? D.get(i, x) : (down[t.child1[x]] + down[t.child2[x]]) / 2;
+            }
+            path.clear();
+            for (int x = i; x != t.root; x = t.parent[x]) path.push_back(x);
+            outside.assign(path.size(), 0.0);
+            for (size_t k = path.size(); k-- > 0;) {
+                int x = path[k];
+                outside[k] = down[t.sibling(x)] + (t.parent[x] != t.root ? outside[k + 1] : 0.0);
+                if (t.parent[x] != t.root) outside[k] /= 2;
+            }
+            for (size_t k = 0; k < path.size(); k++) {
+                int x = path[k], p = t.parent[x];
+                double weight = std::ldexp(1.0, -int(k));
+                sums.sibling[x] += weight * down[t.sibling(x)];
+                int other = p == t.root ? t.sibling(x) : t.parent[p] == t.root ? t.sibling(p) : -1;
+                if (other >= 0 && !t.is_leaf(other)) {
+                    sums.across1[x] += weight * down[t.child1[other]];
+                    sums.across2[x] += weight * down[t.child2[other]];
+                }
+                if (p == t.root) continue;
+                sums.up[x] += weight * outside[k + 1];
+                if (t.parent[p] == t.root) continue;
+                sums.uncle[x] += weight * down[t.sibling(p)];
+                sums.far[x] += weight * outside[k + 2];
+            }
+        }
+    });
+    if (std::count(stopped.begin(), stopped.end(), 1)) return false;
+    for (const subtree_averages& sums : chunks) averages.add(sums);
+    return true;
+}
+
+// Scores both NNIs of every internal edge and sets the balanced branch
+// lengths of the current tree (Desper and Gascuel's formulas over the
+// balanced averages of the subtrees around each edge). False when the
+// deadline passes first.
+template <typename T>
+static bool score_edges(const layout& t, const packed_triangle<T>& D, const pipeline_options& options,
+                        std::vector<nni_move>& moves, std::vector<double>& lengths) {
+    subtree_averages s(t.nodes);
+    if (!average_subtrees(t, D, options, s)) return false;
+    lengths.assign(t.nodes, 0.0);
+    std::vector<nni_move> found(t.nodes, nni_move{0, -1, -1, -1, -1});
+    int root = t.root, left = t.child1[root], right = t.child2[root];
+    for (int v = 0; v < t.nodes; v++) {
+        if (v == root) continue;
+        int u = t.parent[v];
+        if (t.is_leaf(v)) {
+            // External edge: the other two subtrees at its inner end
+            if (u != root) {
+                lengths[v] = (s.sibling[v] + s.up[v] - s.up[t.sibling(v)]) / 2;
+            } else if (t.is_leaf(t.sibling(v))) {
+                lengths[v] = v == left ? D.get(left, right) : 0;
+            } else {
+                lengths[v] = (s.across1[v] + s.across2[v] - s.sibling[t.child1[t.sibling(v)]]) / 2;
+            }
+            continue;
+        }
+        // Across the root, the edge is counted once at the left child;
+        // next to a leaf it is that leaf's external edge
+        int partner = u, c;
+        int a = t.child1[v], b = t.child2[v];
+        double ab = s.sibling[a], cd, ac, bd, ad, bc;
+        if (u == root) {
+            if (v == right || t.is_leaf(right) || t.is_leaf(left)) continue;
+            partner = right;
+            c = t.child1[right];
+            cd = s.sibling[c];
+            ac = s.across1[a], ad = s.across2[a];
+            bc = s.across1[b], bd = s.across2[b];
+        } else {
+            c = t.sibling(v);
+            cd = s.up[c];
+            ac = s.uncle[a], ad = s.far[a];
+            bc = s.uncle[b], bd = s.far[b];
+        }
+        double length = (ac + bd + ad + bc) / 4 - (ab + cd) / 2;
+        if (u == root) {
+            lengths[v] = lengths[partner] = length / 2;
+        } else {
+            lengths[v] = length;
+        }
+        double swap_b = (ab + cd - ac - bd) / 4, swap_a = (ab + cd - ad - bc) / 4;
+        if (std::max(swap_a, swap_b) > 0) {
+            found[v] = swap_b >= swap_a ? nni_move{swap_b, v, partner, b, c} : nni_move{swap_a, v, partner, a, c};
+        }
+    }
+
+    moves.clear();
+    for (const nni_move& move : found) {
+        if (move.v >= 0) moves.push_back(move);
+    }
+    std::sort(moves.begin(), moves.end(), [](const nni_move& x, const nni_move& y) {
+        return x.gain != y.gain ? x.gain > y.gain : x.v < y.v;
+    });
+    return true;
+}
+
+// Moves on edges that share no node, best first
+static compact_tree apply_moves(const compact_tree& tree, const std::vector<nni_move>& moves, size_t limit) {
+    compact_tree out = tree;
+    std::vector<char> used(tree.parent.size(), 0);
+    size_t applied = 0;
+    for (const nni_move& move : moves) {
+        if (applied == limit) break;
+        if (used[move.v] || used[move.partner]) continue;
+        used[move.v] = used[move.partner] = 1;
+        std::swap(out.parent[move.x], out.parent[move.y]);
+        applied++;
+    }
+    return renumber(out);
+}
+
+// Balanced minimum evolution by rounds of NNIs. Each round scores every
+// edge of the best topology, which also gives that topology its branch
+// lengths, then makes the independent improving moves together (or the
+// single best one when together they do not shorten the tree). The result
+// is the last tree whose lengths were computed.
+template <typename T>
+static compact_tree refine_topology(const packed_triangle<T>& D, const compact_tree& start, progress_writer<T>& log,
+                                    const pipeline_options& options) {
+    compact_tree best = start, result = start;
+    double best_length = balanced_length(layout(best), D, options.threads);
+    double round_time = 0;
+    int rounds = 0;
+    bool converged = false;
+    // A round is started only when one as long as the last would finish
+    while (!past(options.deadline, round_time)) {
+        auto round_start = clock_type::now();
+        layout t(best);
+        std::vector<nni_move> moves;
+        std::vector<double> lengths;
+        if (!score_edges(t, D, options, moves, lengths)) break;
+        result = best;
+        for (int v = 0; v < t.nodes; v++) result.length[v] = float(lengths[v]);
+        log.offer(result, "balanced length " + std::to_string(best_length) + ", ", false);
+
+        converged = true;
+        for (size_t limit : {moves.size(), size_t(1)}) {
+            if (moves.empty()) break;
+            compact_tree trial = apply_moves(best, moves, limit);
+            double length = balanced_length(layout(trial), D, options.threads);
+            if (length < best_length - 1e-12 * std::abs(best_length)) {
+                best = trial;
+                best_length = length;
+                converged = false;
+                break;
+            }
+        }
+        rounds++;
+        round_time = std::chrono::duration<double>(clock_type::now() - round_start).count();
+        if (converged) break;
+    }
+    if (options.verbose) {
+        std::cout << "Balanced minimum evolution: " << rounds << " rounds of NNIs"
+                  << (converged ? ", no improving move left" : " before the time limit") << std::endl;
+    }
+    return result;
+}
+
+template <typename T>
+void refine_tree(const packed_triangle<T>& D, Tree& tree, const std::vector<std::string>& names, const pipeline_options& options) {
+    if (tree.leaves() < 3) return;
+    compact_tree refined = renumber(to_compact_tree(tree));
+    progress_writer<T> log(D, names, options);
+    log.offer(refined, "neighbour-joining start, ", true);
+    if (options.algorithm == "fm") {
+        fit_lengths(D, refined, log, options);
+    } else {
+        refined = refine_topology(D, refined, log, options);
+    }
+    log.offer(refined, "final, ", true);
+
+    // Rebuilt by joins in post-order, so node ids match the compact tree
+    std::vector<int32_t> child1(refined.parent.size(), -1), child2(refined.parent.size(), -1);
+    for (size_t v = 0; v < refined.parent.size(); v++) {
+        int p = refined.parent[v];
+        if (p < 0) continue;
+        if (child1[p] < 0) child1[p] = v;
+        else child2[p] = v;
+    }
+    tree = Tree(names);
+    for (size_t v = refined.leaves; v < refined.parent.size(); v++) {
+        tree.joinNodes(child1[v], child2[v], refined.length[child1[v]], refined.length[child2[v]]);
+    }
+}
+
+template void refine_tree<float>(const packed_triangle<float>&, Tree&, const std::vector<std::string>&, const pipeline_options&);
+template void refine_tree<double>(const packed_triangle<double>&, Tree&, const std::vector<std::string>&, const pipeline_options&);
+template void refine_tree<half>(const packed_triangle<half>&, Tree&, const std::vector<std::string>&, const pipeline_options&);
@@ -0,0 +1,95 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <iostream>
+
+// Fixed-seed splitmix64, so leaf keys and therefore results are reproducible
+std::vector<uint64_t> leaf_keys(int leaves) {
+    std::vector<uint64_t> keys(leaves);
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < leaves; i++) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        keys[i] = z ^ (z >> 31);
+    }
+    return keys;
+}
+
+// A clade's hash is the XOR of its leaf keys; since children precede their
+// parents, one forward pass pushes each hash up to the parent. The split
+// hash is the smaller of the clade and its complement so rooting is ignored.
+std::vector<uint64_t> tree_bipartitions(const tree_view& tree, const std::vector<uint64_t>& keys) {
+    std::vector<uint64_t> hash(tree.nodes, 0);
+    std::vector<int> size(tree.nodes, 0);
+    uint64_t all = 0;
+    for (int i = 0; i < tree.leaves; i++) {
+        hash[i] = keys[i];
+        size[i] = 1;
+        all ^= keys[i];
+    }
+
+    std::vector<uint64_t> splits;
+    for (int i = 0; i < tree.nodes; i++) {
+        int p = tree.parent[i];
+        if (p < 0) continue;
+        hash[p] ^= hash[i];
+        size[p] += size[i];
+        // Leaves and their complements are in every tree
+        if (size[i] > 1 && size[i] < tree.leaves - 1) {
+            splits.push_back(std::min(hash[i], hash[i] ^ all));
+        }
+    }
+    // The two edges at a bifurcating root give the same split
+    std::sort(splits.begin(), splits.end());
+    splits.erase(std::unique(splits.begin(), splits.end()), splits.end());
+    return splits;
+}
+
+static size_t shared_splits(const std::vector<uint64_t>& a, const std::vector<uint64_t>& b) {
+    size_t shared = 0;
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+        if (a[i] < b[j]) i++;
+        else if (b[j] < a[i]) j++;
+        else {
+            shared++;
+            i++;
+            j++;
+        }
+    }
+    return shared;
+}
+
+std::vector<dmatrix_row> robinson_foulds_matrix(const std::vector<std::vector<uint64_t>>& splits, bool normalized, int threads) {
+    int n = splits.size();
+    std::vector<dmatrix_row> D(n);
+    for (int i = 0; i < n; i++) {
+        D[i].distances.assign(n, 0.0f);
+        D[i].id = i;
+        D[i].sum = 0;
+    }
+
+    parallel_for(0, n, threads, [&](int i) {
+        for (int j = 0; j < i; j++) {
+            size_t total = splits[i].size() + splits[j].size();
+            float distance = total - 2 * shared_splits(splits[i], splits[j]);
+            if (normalized) distance = total ? distance / total : 0.0f;
+            D[i].distances[j] = distance;
+            D[j].distances[i] = distance;
+        }
+    });
+
+    for (int i = 0; i < n; i++) {
+        for (float d : D[i].distances) D[i].sum += d;
+    }
+    return D;
+}
+
+std::vector<dmatrix_row> robinson_foulds_matrix(const std::vector<tree_view>& trees, bool normalized, int threads) {
+    int leaves = trees.empty() ? 0 : trees[0].leaves;
+    std::vector<uint64_t> keys = leaf_keys(leaves);
+    std::vector<std::vector<uint64_t>> splits(trees.size());
+    parallel_for(0, trees.size(), threads, [&](int t) {
+        splits[t] = tree_bipartitions(trees[t], keys);
+    });
+    return robinson_foulds_matrix(splits, normalized, threads);
+}
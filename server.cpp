@@ -0,0 +1,239 @@
+#include "tree.hpp"
+#include <cerrno>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Connections waiting for a worker
+static const size_t backlog = 64;
+// A client that sends nothing for this long, or more than this much, is
+// answered with an error so it cannot hold a worker
+static const int receive_timeout_seconds = 30;
+static const size_t max_request_bytes = size_t(256) << 20;
+
+// A reference panel's profiles and the distances among them. Never changed
+// once built, so jobs share it without locking.
+struct panel_data {
+    std::vector<std::string> names;
+    std::vector<kmer_profile> profiles;
+    packed_triangle<float> D;
+    time_t modified = 0;
+};
+
+// Panels are keyed by file, k-mer length and method, and rebuilt when the
+// file changes
+class panel_cache {
+public:
+    explicit panel_cache(const pipeline_options& options) : options(options) {}
+
+    std::shared_ptr<const panel_data> get(const std::string& path, int kmer_length, const std::string& method, std::string& error) {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) {
+            error = "cannot open panel '" + path + "'";
+            return nullptr;
+        }
+        std::shared_ptr<entry> slot;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::shared_ptr<entry>& found = panels[path + '\n' + std::to_string(kmer_length) + '\n' + method];
+            if (!found) found = std::make_shared<entry>();
+            slot = found;
+        }
+        // Jobs for the same panel wait for one load instead of each loading it
+        std::lock_guard<std::mutex> lock(slot->mutex);
+        if (slot->data && slot->data->modified == info.st_mtime) return slot->data;
+
+        fasta_reader reader(path, options.threads);
+        if (!reader.good()) {
+            error = "cannot open panel '" + path + "'";
+            return nullptr;
+        }
+        auto data = std::make_shared<panel_data>();
+        data->modified = info.st_mtime;
+        std::vector<std::string> seqs;
+        std::string name, content;
+        while (reader.next(name, content)) {
+            data->names.push_back(name);
+            seqs.push_back(content);
+        }
+        sequence_view view;
+        view.seq.assign(seqs.begin(), seqs.end());
+        view.name.assign(data->names.begin(), data->names.end());
+        data->profiles = count_kmer_profiles(view, kmer_length, options.canonical, options.alphabet, options.threads);
+        data->D = profile_distance_triangle<float>(data->profiles, parse_distance_method(method), options.threads);
+        if (options.verbose) {
+            std::cout << "Loaded panel '" << path << "': " << data->names.size() << " sequences, k = " << kmer_length << std::endl;
+        }
+        slot->data = data;
+        return data;
+    }
+
+private:
+    struct entry {
+        std::mutex mutex;
+        std::shared_ptr<const panel_data> data;
+    };
+    pipeline_options options;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<entry>> panels;
+};
+
+// Request: "key value" lines (panel, algorithm, k, method), then FASTA
+// records up to the end of the stream. Reply: the Newick tree, or a line
+// starting with "error:".
+static std::string run_job(const std::string& request, panel_cache& cache, const pipeline_options& defaults) {
+    pipeline_options options = defaults;
+    options.checkpoint.clear();
+    options.resume = false;
+    options.deadline = {};
+    options.progress_output.clear();
+    options.verbose = false;
+    // Only the tree is sent back, and concurrent jobs must not share files
+    options.keep_matrix = false;
+    options.fit = false;
+    options.matrix_output.clear();
+    std::string panel;
+
+    size_t body = 0;
+    while (body < request.size() && request[body] != '>') {
+        size_t end = std::min(request.find('\n', body), request.size());
+        std::string line = request.substr(body, end - body);
+        body = end + 1;
+        if (line.empty()) continue;
+        std::istringstream fields(line);
+        std::string key, value;
+        fields >> key >> value;
+        if (key == "panel") panel = value;
+        else if (key == "algorithm" && (value == "nj" || value == "upgma" || value == "me" || value == "fm")) options.algorithm = value;
+        else if (key == "k") options.kmer_length = std::atoi(value.c_str());
+        else if (key == "method") options.method = value;
+        else return "error: unknown request line '" + line + "'";
+    }
+    if (is_alignment_method(options.method)) return "error: the server computes k-mer distances only";
+    if (options.kmer_length < 1 || options.kmer_length > max_kmer_length(options.alphabet)) return "error: bad k-mer length";
+
+    std::shared_ptr<const panel_data> reference;
+    if (!panel.empty()) {
+        std::string error;
+        reference = cache.get(panel, options.kmer_length, options.method, error);
+        if (!reference) return "error: " + error;
+    }
+
+    std::istringstream records(request.substr(std::min(body, request.size())));
+    fasta_reader reader(records.rdbuf());
+    std::vector<std::string> names, seqs;
+    if (reference) names = reference->names;
+    std::string name, content;
+    while (reader.next(name, content)) {
+        names.push_back(name);
+        seqs.push_back(content);
+    }
+    sequence_view view;
+    view.seq.assign(seqs.begin(), seqs.end());
+    view.name.assign(names.end() - seqs.size(), names.end());
+    std::vector<kmer_profile> queries = count_kmer_profiles(view, options.kmer_length, options.canonical, options.alphabet, options.threads);
+
+    // The panel's rows are the front of the triangle; only the rows of the
+    // new sequences are computed
+    int r = reference ? reference->names.size() : 0;
+    int n = names.size();
+    if (n == 0) return "error: no sequences";
+    packed_triangle<float> D(n);
+    if (reference) std::copy(reference->D.values.begin(), reference->D.values.end(), D.values.begin());
+    profile_distance_fn distance = profile_distance_function(parse_distance_method(options.method));
+    parallel_for(r, n, options.threads, [&](int i) {
+        float* row = D.row(i);
+        const kmer_profile& query = queries[i - r];
+        for (int j = 0; j < i; j++) row[j] = distance(query, j < r ? reference->profiles[j] : queries[j - r]);
+    });
+    return tree_from_triangle(D, names, options).newick;
+}
+
+static void serve_connection(int client, panel_cache& cache, const pipeline_options& options) {
+    timeval timeout{receive_timeout_seconds, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string request;
+    char buffer[1 << 16];
+    ssize_t got = 0;
+    while (request.size() <= max_request_bytes && (got = recv(client, buffer, sizeof(buffer), 0)) > 0) request.append(buffer, got);
+
+    auto start = std::chrono::steady_clock::now();
+    std::string reply;
+    if (request.size() > max_request_bytes) reply = "error: requests are limited to " + std::to_string(max_request_bytes >> 20) + " MB";
+    else if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) reply = "error: no data for " + std::to_string(receive_timeout_seconds) + " s";
+    else if (got < 0) reply = "error: could not read the request";
+    else reply = run_job(request, cache, options);
+    if (options.verbose) {
+        std::cout << "Request of " << request.size() << " bytes answered in "
+                  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+    }
+    reply += '\n';
+    for (size_t sent = 0; sent < reply.size();) {
+        ssize_t wrote = send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+        if (wrote <= 0) break;
+        sent += wrote;
+    }
+    close(client);
+}
+
+bool run_server(const std::string& socket_path, const pipeline_options& options) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: socket path '" << socket_path << "' is too long" << std::endl;
+        return false;
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+
+    // A socket left by an earlier server is replaced; any other file is kept
+    struct stat existing;
+    if (lstat(socket_path.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            std::cerr << "Error: '" << socket_path << "' exists and is not a socket" << std::endl;
+            return false;
+        }
+        unlink(socket_path.c_str());
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, backlog) != 0) {
+        std::cerr << "Error: could not listen on '" << socket_path << "'" << std::endl;
+        if (listener >= 0) close(listener);
+        return false;
+    }
+
+    // Each worker serves one connection at a time; the jobs' distance rows
+    // share the thread pool's idle workers
+    int workers = resolve_threads(options.threads);
+    panel_cache cache(options);
+    bounded_queue<int> connections(backlog);
+    std::vector<std::thread> pool;
+    for (int w = 0; w < workers; w++) {
+        pool.emplace_back([&]() {
+            int client;
+            while (connections.pop(client)) serve_connection(client, cache, options);
+        });
+    }
+    std::cout << "Listening on '" << socket_path << "' with " << workers << " workers" << std::endl;
+
+    while (true) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Error: accept failed on '" << socket_path << "'" << std::endl;
+            break;
+        }
+        connections.push(client);
+    }
+    connections.close();
+    for (auto& worker : pool) worker.join();
+    close(listener);
+    unlink(socket_path.c_str());
+    return false;
+}
@@ -0,0 +1,242 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+// Profile file:  "PHYKMER1", k, canonical, alphabet, count, then per sequence
+//                name, number of k-mers, total, k-mer codes, counts
+// Tile file:     "PHYTILE1", n, tile size, method, tile count, then per tile
+//                block row, block column and the rows x columns distances
+static const char profile_magic[8] = {'P', 'H', 'Y', 'K', 'M', 'E', 'R', '1'};
+static const char tile_magic[8] = {'P', 'H', 'Y', 'T', 'I', 'L', 'E', '1'};
+
+template <typename T>
+static void write_value(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+static bool read_value(std::ifstream& in, T& value) {
+    return bool(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+static void write_string(std::ofstream& out, const std::string& s) {
+    write_value<uint32_t>(out, s.size());
+    out.write(s.data(), s.size());
+}
+
+static bool read_string(std::ifstream& in, std::string& s) {
+    uint32_t length;
+    if (!read_value(in, length)) return false;
+    s.resize(length);
+    return bool(in.read(&s[0], length));
+}
+
+bool write_profile_set(const std::string& filename, const profile_set& set) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cerr << "Error: could not write '" << filename << "'" << std::endl;
+        return false;
+    }
+    out.write(profile_magic, sizeof(profile_magic));
+    write_value<int32_t>(out, set.kmer_length);
+    write_value<uint8_t>(out, set.canonical);
+    write_string(out, set.alphabet);
+    write_value<uint64_t>(out, set.profiles.size());
+
+    for (size_t i = 0; i < set.profiles.size(); i++) {
+        const kmer_profile& profile = set.profiles[i];
+        write_string(out, set.names[i]);
+        write_value<uint64_t>(out, profile.kmers.size());
+        write_value<float>(out, profile.total);
+        out.write(reinterpret_cast<const char*>(profile.kmers.data()), profile.kmers.size() * sizeof(uint64_t));
+        out.write(reinterpret_cast<const char*>(profile.counts.data()), profile.counts.size() * sizeof(float));
+    }
+    return bool(out);
+}
+
+bool read_profile_set(const std::string& filename, profile_set& set, const std::vector<bool>* wanted) {
+    std::ifstream in(filename, std::ios::binary);
+    char magic[8];
+    if (!in || !in.read(magic, sizeof(magic)) || std::memcmp(magic, profile_magic, sizeof(magic)) != 0) {
+        std::cerr << "Error: '" << filename << "' is not a k-mer profile file" << std::endl;
+        return false;
+    }
+
+    int32_t kmer_length;
+    uint8_t canonical;
+    uint64_t count;
+    if (!read_value(in, kmer_length) || !read_value(in, canonical) || !read_string(in, set.alphabet) || !read_value(in, count)) {
+        std::cerr << "Error: truncated header in '" << filename << "'" << std::endl;
+        return false;
+    }
+    set.kmer_length = kmer_length;
+    // Older files could record canonical for alphabets it does not apply to
+    set.canonical = canonical && set.alphabet == "dna";
+    set.names.resize(count);
+    set.profiles.assign(count, kmer_profile());
+
+    // Profiles that are not wanted are skipped over; only their names are kept
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t size;
+        float total;
+        if (!read_string(in, set.names[i]) || !read_value(in, size) || !read_value(in, total)) {
+            std::cerr << "Error: truncated profile " << i << " in '" << filename << "'" << std::endl;
+            return false;
+        }
+        if (wanted && (i >= wanted->size() || !(*wanted)[i])) {
+            in.seekg(size * (sizeof(uint64_t) + sizeof(float)), std::ios::cur);
+            continue;
+        }
+        kmer_profile& profile = set.profiles[i];
+        profile.total = total;
+        profile.kmers.resize(size);
+        profile.counts.resize(size);
+        in.read(reinterpret_cast<char*>(profile.kmers.data()), size * sizeof(uint64_t));
+        in.read(reinterpret_cast<char*>(profile.counts.data()), size * sizeof(float));
+        if (!in) {
+            std::cerr << "Error: truncated profile " << i << " in '" << filename << "'" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lower-triangle tiles (block_row >= block_column) are numbered row by row
+static std::vector<std::pair<int, int>> triangle_tiles(int n, int tile_size) {
+    int blocks = (n + tile_size - 1) / tile_size;
+    std::vector<std::pair<int, int>> tiles;
+    for (int bi = 0; bi < blocks; bi++) {
+        for (int bj = 0; bj <= bi; bj++) tiles.emplace_back(bi, bj);
+    }
+    return tiles;
+}
+
+bool compute_distance_tiles(const std::string& profile_file, int shard, int shards, int tile_size,
+                            const std::string& method, int threads, const std::string& output) {
+    if (shards < 1 || shard < 0 || shard >= shards || tile_size < 1) {
+        std::cerr << "Error: invalid shard " << shard << "/" << shards << std::endl;
+        return false;
+    }
+
+    // Read only the names first to learn n, then the profiles this shard touches
+    profile_set set;
+    std::vector<bool> names_only;
+    if (!read_profile_set(profile_file, set, &names_only)) {
+        return false;
+    }
+    int n = set.names.size();
+    std::vector<std::pair<int, int>> all_tiles = triangle_tiles(n, tile_size);
+    size_t first = all_tiles.size() * shard / shards;
+    size_t last = all_tiles.size() * (shard + 1) / shards;
+    std::vector<std::pair<int, int>> tiles(all_tiles.begin() + first, all_tiles.begin() + last);
+
+    std::vector<bool> wanted(n, false);
+    for (const auto& tile : tiles) {
+        for (int b : {tile.first, tile.second}) {
+            for (int i = b * tile_size; i < std::min(n, (b + 1) * tile_size); i++) wanted[i] = true;
+        }
+    }
+    if (!read_profile_set(profile_file, set, &wanted)) {
+        return false;
+    }
+
+    profile_distance_fn distance = profile_distance_function(parse_distance_method(method));
+    std::vector<std::vector<float>> values(tiles.size());
+    parallel_for(0, tiles.size(), threads, [&](int t) {
+        int i0 = tiles[t].first * tile_size, i1 = std::min(n, i0 + tile_size);
+        int j0 = tiles[t].second * tile_size, j1 = std::min(n, j0 + tile_size);
+        std::vector<float>& block = values[t];
+        block.assign((i1 - i0) * (j1 - j0), 0.0f);
+        for (int i = i0; i < i1; i++) {
+            for (int j = j0; j < j1 && j < i; j++) {
+                block[(i - i0) * (j1 - j0) + (j - j0)] = distance(set.profiles[i], set.profiles[j]);
+            }
+        }
+    });
+
+    std::ofstream out(output, std::ios::binary);
+    if (!out) {
+        std::cerr << "Error: could not write '" << output << "'" << std::endl;
+        return false;
+    }
+    out.write(tile_magic, sizeof(tile_magic));
+    write_value<uint64_t>(out, n);
+    write_value<uint32_t>(out, tile_size);
+    write_string(out, method);
+    write_value<uint64_t>(out, tiles.size());
+    for (size_t t = 0; t < tiles.size(); t++) {
+        write_value<uint32_t>(out, tiles[t].first);
+        write_value<uint32_t>(out, tiles[t].second);
+        out.write(reinterpret_cast<const char*>(values[t].data()), values[t].size() * sizeof(float));
+    }
+    std::cout << "Shard " << shard << "/" << shards << ": " << tiles.size() << " tiles of " << all_tiles.size()
+              << " written to " << output << std::endl;
+    return bool(out);
+}
+
+// Tiles go straight into the triangle at its precision, so the merge holds
+// one copy of the matrix
+template <typename T>
+bool merge_distance_tiles(const std::vector<std::string>& tile_files, int n, packed_triangle<T>& D) {
+    D = packed_triangle<T>(n);
+
+    uint32_t tile_size = 0;
+    std::string method;
+    std::vector<bool> seen;
+
+    for (const std::string& filename : tile_files) {
+        std::ifstream in(filename, std::ios::binary);
+        char magic[8];
+        uint64_t file_n, count;
+        uint32_t file_tile_size;
+        std::string file_method;
+        if (!in || !in.read(magic, sizeof(magic)) || std::memcmp(magic, tile_magic, sizeof(magic)) != 0 ||
+            !read_value(in, file_n) || !read_value(in, file_tile_size) || !read_string(in, file_method) || !read_value(in, count)) {
+            std::cerr << "Error: '" << filename << "' is not a distance tile file" << std::endl;
+            return false;
+        }
+        if (file_n != uint64_t(n) || (tile_size && (file_tile_size != tile_size || file_method != method))) {
+            std::cerr << "Error: '" << filename << "' was computed with different settings" << std::endl;
+            return false;
+        }
+        if (!tile_size) {
+            tile_size = file_tile_size;
+            method = file_method;
+            seen.assign(triangle_tiles(n, tile_size).size(), false);
+        }
+
+        std::vector<float> block;
+        for (uint64_t t = 0; t < count; t++) {
+            uint32_t bi, bj;
+            if (!read_value(in, bi) || !read_value(in, bj) || bj > bi || uint64_t(bi) * tile_size >= uint64_t(n)) {
+                std::cerr << "Error: corrupt tile in '" << filename << "'" << std::endl;
+                return false;
+            }
+            int i0 = bi * tile_size, i1 = std::min<int>(n, i0 + tile_size);
+            int j0 = bj * tile_size, j1 = std::min<int>(n, j0 + tile_size);
+            block.resize((i1 - i0) * (j1 - j0));
+            if (!in.read(reinterpret_cast<char*>(block.data()), block.size() * sizeof(float))) {
+                std::cerr << "Error: truncated tile in '" << filename << "'" << std::endl;
+                return false;
+            }
+            for (int i = i0; i < i1; i++) {
+                T* row = D.row(i);
+                for (int j = j0; j < j1 && j < i; j++) row[j] = T(block[(i - i0) * (j1 - j0) + (j - j0)]);
+            }
+            seen[size_t(bi) * (bi + 1) / 2 + bj] = true;
+        }
+    }
+
+    size_t missing = std::count(seen.begin(), seen.end(), false);
+    if (n > 0 && (seen.empty() || missing > 0)) {
+        std::cerr << "Error: " << (seen.empty() ? 1 : missing) << " tiles are missing from the merge" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template bool merge_distance_tiles<float>(const std::vector<std::string>&, int, packed_triangle<float>&);
+template bool merge_distance_tiles<double>(const std::vector<std::string>&, int, packed_triangle<double>&);
+template bool merge_distance_tiles<half>(const std::vector<std::string>&, int, packed_triangle<half>&);
@@ -0,0 +1,376 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Database file (native byte order, every section 8-byte aligned):
+//   "PHYSKDB1", k, canonical, alphabet (16 bytes, zero padded)
+//   then segments, one per build or append, each:
+//     reference count, segment bytes, k-mer count
+//     signatures[count * minhash_size], the low 16 bits of each value
+//     profile offsets[count + 1] into the k-mer arrays, totals[count]
+//     name offsets[count + 1] into the name bytes
+//     k-mers[k-mer count], counts[k-mer count], name bytes
+// A segment cut short by a failed append, and everything after it, is
+// ignored with a warning; the next append cuts it off first.
+static const char database_magic[8] = {'P', 'H', 'Y', 'S', 'K', 'D', 'B', '1'};
+static const size_t header_bytes = 32;
+static const size_t alphabet_bytes = 16;
+
+// Sketch matches kept for exact distances: candidate_factor per neighbour
+// asked for, and at least min_candidates
+static const int candidate_factor = 8;
+static const int min_candidates = 64;
+static const int scan_block = 4096;
+
+// Sketch values are compared for equality only, so 16 bits of each are kept;
+// unequal values agree by chance once in 65536
+using sketch_value = uint16_t;
+
+static size_t padded(size_t size) {
+    return (size + 7) & ~size_t(7);
+}
+
+// Bytes of a segment of `count` references holding `kmers` k-mers and
+// `name_bytes` bytes of names, header included
+static size_t segment_bytes(uint64_t count, uint64_t kmers, uint64_t name_bytes) {
+    return 24 + count * minhash_size * sizeof(sketch_value) + (count + 1) * 8 + padded(count * 4) + (count + 1) * 8 + kmers * 8 +
+           padded(kmers * 4) + padded(name_bytes);
+}
+
+sketch_database::~sketch_database() {
+    close();
+}
+
+void sketch_database::close() {
+    if (data) munmap(const_cast<char*>(data), size_bytes);
+    data = nullptr;
+    size_bytes = 0;
+    segments.clear();
+    count = 0;
+    complete_bytes = 0;
+}
+
+bool sketch_database::open(const std::string& filename) {
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) ::close(fd);
+        std::cerr << "Error: could not open '" << filename << "'" << std::endl;
+        return false;
+    }
+    size_bytes = info.st_size;
+    void* mapped = size_bytes ? mmap(nullptr, size_bytes, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        size_bytes = 0;
+        std::cerr << "Error: could not map '" << filename << "'" << std::endl;
+        return false;
+    }
+    data = static_cast<const char*>(mapped);
+    if (size_bytes < header_bytes || std::memcmp(data, database_magic, sizeof(database_magic)) != 0) {
+        std::cerr << "Error: '" << filename << "' is not a sketch database" << std::endl;
+        close();
+        return false;
+    }
+    uint32_t k, canonical_flag;
+    std::memcpy(&k, data + 8, sizeof(k));
+    std::memcpy(&canonical_flag, data + 12, sizeof(canonical_flag));
+    kmer_length = k;
+    alphabet.assign(data + 16, strnlen(data + 16, alphabet_bytes));
+    // Older databases could record canonical for alphabets it does not apply to
+    canonical = canonical_flag != 0 && alphabet == "dna";
+
+    // Segments are checked once here, so lookups need no further checks
+    auto damaged = [&](size_t pos) {
+        std::cerr << "Warning: ignoring a damaged or incomplete segment at byte " << pos << " of '" << filename
+                  << "' and the " << size_bytes - pos << " bytes from there" << std::endl;
+    };
+    size_t pos = header_bytes;
+    while (pos < size_bytes) {
+        uint64_t header[3];
+        if (pos + sizeof(header) > size_bytes) {
+            damaged(pos);
+            break;
+        }
+        std::memcpy(header, data + pos, sizeof(header));
+        uint64_t references = header[0], bytes = header[1], kmers = header[2];
+        const char* p = data + pos + 24;
+        segment s;
+        s.first = count;
+        s.count = references;
+        s.signatures = reinterpret_cast<const uint16_t*>(p);
+        p += references * minhash_size * sizeof(sketch_value);
+        s.offsets = reinterpret_cast<const uint64_t*>(p);
+        p += (references + 1) * 8;
+        s.totals = reinterpret_cast<const float*>(p);
+        p += padded(references * 4);
+        s.name_offsets = reinterpret_cast<const uint64_t*>(p);
+        p += (references + 1) * 8;
+        bool fits = references <= size_bytes / (minhash_size * sizeof(sketch_value)) && bytes <= size_bytes - pos &&
+                    bytes >= segment_bytes(references, 0, 0) && s.offsets[references] == kmers &&
+                    segment_bytes(references, kmers, s.name_offsets[references]) == bytes;
+        // Profiles and names are sliced by their offsets, which must rise
+        for (uint64_t i = 0; fits && i < references; i++) {
+            fits = s.offsets[i] <= s.offsets[i + 1] && s.name_offsets[i] <= s.name_offsets[i + 1];
+        }
+        if (!fits || s.offsets[0] != 0 || s.name_offsets[0] != 0) {
+            damaged(pos);
+            break;
+        }
+        s.kmers = reinterpret_cast<const uint64_t*>(p);
+        p += kmers * 8;
+        s.counts = reinterpret_cast<const float*>(p);
+        p += padded(kmers * 4);
+        s.names = p;
+        segments.push_back(s);
+        count += references;
+        pos += bytes;
+    }
+    complete_bytes = pos;
+    return true;
+}
+
+const sketch_database::segment& sketch_database::locate(size_t index, size_t& local) const {
+    auto found = std::upper_bound(segments.begin(), segments.end(), index,
+                                  [](size_t i, const segment& s) { return i < s.first; });
+    const segment& s = *(found - 1);
+    local = index - s.first;
+    return s;
+}
+
+std::string sketch_database::name(size_t index) const {
+    size_t i;
+    const segment& s = locate(index, i);
+    return std::string(s.names + s.name_offsets[i], s.name_offsets[i + 1] - s.name_offsets[i]);
+}
+
+kmer_profile sketch_database::profile(size_t index) const {
+    size_t i;
+    const segment& s = locate(index, i);
+    kmer_profile profile;
+    profile.kmers.assign(s.kmers + s.offsets[i], s.kmers + s.offsets[i + 1]);
+    profile.counts.assign(s.counts + s.offsets[i], s.counts + s.offsets[i + 1]);
+    profile.total = s.totals[i];
+    return profile;
+}
+
+// Every reference is scored by the sketch values it shares with the query;
+// the best candidates get the exact distance, and the nearest are returned
+std::vector<sketch_neighbor> sketch_database::nearest(const kmer_profile& query, int neighbors, profile_distance_fn distance,
+                                                      int threads) const {
+    uint64_t full[minhash_size];
+    minhash_signature(query, full);
+    sketch_value signature[minhash_size];
+    std::copy(full, full + minhash_size, signature);
+    std::vector<uint8_t> shared(count);
+    for (const segment& s : segments) {
+        parallel_for_blocks(0, s.count, scan_block, threads, [&](int lo, int hi) {
+            for (int i = lo; i < hi; i++) {
+                const sketch_value* reference = s.signatures + size_t(i) * minhash_size;
+                int same = 0;
+                for (int b = 0; b < minhash_size; b++) same += reference[b] == signature[b];
+                shared[s.first + i] = same;
+            }
+        });
+    }
+
+    size_t wanted = std::min<size_t>(count, std::max(min_candidates, candidate_factor * neighbors));
+    std::vector<uint32_t> candidates(count);
+    for (size_t i = 0; i < count; i++) candidates[i] = i;
+    auto more_shared = [&](uint32_t a, uint32_t b) { return shared[a] != shared[b] ? shared[a] > shared[b] : a < b; };
+    std::nth_element(candidates.begin(), candidates.begin() + wanted, candidates.end(), more_shared);
+    candidates.resize(wanted);
+
+    std::vector<sketch_neighbor> found(wanted);
+    parallel_for(0, wanted, threads, [&](int c) {
+        found[c] = {candidates[c], distance(query, profile(candidates[c]))};
+    });
+    auto closer = [](const sketch_neighbor& a, const sketch_neighbor& b) {
+        return a.distance != b.distance ? a.distance < b.distance : a.reference < b.reference;
+    };
+    size_t kept = std::min<size_t>(wanted, std::max(neighbors, 0));
+    std::partial_sort(found.begin(), found.begin() + kept, found.end(), closer);
+    found.resize(kept);
+    return found;
+}
+
+template <typename T>
+static void write_array(std::ofstream& out, const T* values, size_t size) {
+    out.write(reinterpret_cast<const char*>(values), size * sizeof(T));
+}
+
+static void write_padding(std::ofstream& out, size_t written) {
+    static const char zeros[8] = {};
+    out.write(zeros, padded(written) - written);
+}
+
+bool append_sketch_database(const std::string& filename, const profile_set& set, int threads) {
+    // An existing database must use the same k-mers
+    bool exists = false;
+    {
+        std::ifstream in(filename, std::ios::binary | std::ios::ate);
+        if (in && in.tellg() > 0) {
+            sketch_database database;
+            if (!database.open(filename)) return false;
+            if (database.kmer_length != set.kmer_length || database.canonical != set.canonical || database.alphabet != set.alphabet) {
+                std::cerr << "Error: '" << filename << "' holds " << database.alphabet << " k = " << database.kmer_length
+                          << (database.canonical ? " canonical" : "") << " sketches; build with the same -k, -alphabet and -canonical"
+                          << std::endl;
+                return false;
+            }
+            exists = true;
+            // A damaged tail would hide the new segment, so it is cut off
+            size_t end = database.complete_size();
+            size_t dropped = size_t(in.tellg()) - end;
+            database.close();
+            if (dropped) {
+                if (::truncate(filename.c_str(), end) != 0) {
+                    std::cerr << "Error: could not remove the damaged end of '" << filename << "'" << std::endl;
+                    return false;
+                }
+                std::cerr << "Warning: removed " << dropped << " damaged bytes from the end of '" << filename << "'" << std::endl;
+            }
+        }
+    }
+    if (set.alphabet.size() >= alphabet_bytes) return false;
+
+    uint64_t references = set.profiles.size();
+    std::vector<sketch_value> signatures(references * minhash_size);
+    parallel_for_blocks(0, references, 256, threads, [&](int lo, int hi) {
+        uint64_t full[minhash_size];
+        for (int i = lo; i < hi; i++) {
+            minhash_signature(set.profiles[i], full);
+            std::copy(full, full + minhash_size, &signatures[size_t(i) * minhash_size]);
+        }
+    });
+    std::vector<uint64_t> offsets(references + 1, 0), name_offsets(references + 1, 0);
+    std::vector<float> totals(references);
+    for (uint64_t i = 0; i < references; i++) {
+        offsets[i + 1] = offsets[i] + set.profiles[i].kmers.size();
+        name_offsets[i + 1] = name_offsets[i] + set.names[i].size();
+        totals[i] = set.profiles[i].total;
+    }
+    uint64_t kmers = offsets[references];
+
+    std::ofstream out(filename, std::ios::binary | (exists ? std::ios::app : std::ios::trunc));
+    if (!out) {
+        std::cerr << "Error: could not write '" << filename << "'" << std::endl;
+        return false;
+    }
+    if (!exists) {
+        char header[header_bytes] = {};
+        std::memcpy(header, database_magic, sizeof(database_magic));
+        uint32_t k = set.kmer_length, canonical_flag = set.canonical;
+        std::memcpy(header + 8, &k, sizeof(k));
+        std::memcpy(header + 12, &canonical_flag, sizeof(canonical_flag));
+        std::memcpy(header + 16, set.alphabet.data(), set.alphabet.size());
+        out.write(header, sizeof(header));
+    }
+    uint64_t header[3] = {references, segment_bytes(references, kmers, name_offsets[references]), kmers};
+    write_array(out, header, 3);
+    write_array(out, signatures.data(), signatures.size());
+    write_array(out, offsets.data(), offsets.size());
+    write_array(out, totals.data(), totals.size());
+    write_padding(out, references * 4);
+    write_array(out, name_offsets.data(), name_offsets.size());
+    for (const kmer_profile& profile : set.profiles) write_array(out, profile.kmers.data(), profile.kmers.size());
+    for (const kmer_profile& profile : set.profiles) write_array(out, profile.counts.data(), profile.counts.size());
+    write_padding(out, kmers * 4);
+    for (const std::string& name : set.names) out.write(name.data(), name.size());
+    write_padding(out, name_offsets[references]);
+    out.close();
+    if (!out) {
+        std::cerr << "Error: could not write '" << filename << "'" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Queries are read and answered one at a time: their neighbours go to
+// `output` as query, reference and distance, and with a tree_output each
+// query's tree over itself and its neighbours goes there, one per line
+bool run_sketch_queries(const std::string& database_file, const std::string& query_file, int neighbors, const pipeline_options& options,
+                        const std::string& output, const std::string& tree_output) {
+    sketch_database database;
+    if (!database.open(database_file)) return false;
+    if (is_alignment_method(options.method)) {
+        std::cerr << "Error: sketch queries use k-mer distances" << std::endl;
+        return false;
+    }
+    fasta_reader reader(query_file, options.threads);
+    if (!reader.good()) {
+        std::cerr << "Error opening '" << query_file << "'" << std::endl;
+        return false;
+    }
+    std::ofstream table(output);
+    std::ofstream trees;
+    if (!tree_output.empty()) trees.open(tree_output);
+    if (!table || (!tree_output.empty() && !trees)) {
+        std::cerr << "Error: could not write '" << (table ? tree_output : output) << "'" << std::endl;
+        return false;
+    }
+    if (options.verbose) {
+        std::cout << "Sketch database '" << database_file << "': " << database.size() << " references, " << database.alphabet
+                  << " k = " << database.kmer_length << (database.canonical ? " canonical" : "") << std::endl;
+    }
+
+    // Trees are built quietly, from the query and its neighbours only
+    pipeline_options tree_options = options;
+    tree_options.verbose = false;
+    tree_options.fit = false;
+    tree_options.checkpoint.clear();
+    tree_options.matrix_output.clear();
+    tree_options.deadline = {};
+    tree_options.progress_output.clear();
+    distance_method method = parse_distance_method(options.method);
+    profile_distance_fn distance = profile_distance_function(method);
+    std::string name, content;
+    size_t queries = 0;
+    while (reader.next(name, content)) {
+        auto start = std::chrono::steady_clock::now();
+        sequence_view view;
+        view.seq.push_back(content);
+        view.name.push_back(name);
+        kmer_profile query = std::move(count_kmer_profiles(view, database.kmer_length, database.canonical, database.alphabet,
+                                                           options.threads)[0]);
+        std::vector<sketch_neighbor> found = database.nearest(query, neighbors, distance, options.threads);
+        for (const sketch_neighbor& neighbor : found) {
+            table << name << '\t' << database.name(neighbor.reference) << '\t' << neighbor.distance << '\n';
+        }
+        if (options.verbose) {
+            std::cout << name << ": " << found.size() << " neighbours in "
+                      << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms";
+            if (!found.empty()) std::cout << ", nearest " << database.name(found[0].reference) << " at " << found[0].distance;
+            std::cout << std::endl;
+        }
+        if (!tree_output.empty()) {
+            std::vector<std::string> names = {name};
+            std::vector<kmer_profile> profiles;
+            profiles.push_back(std::move(query));
+            for (const sketch_neighbor& neighbor : found) {
+                names.push_back(database.name(neighbor.reference));
+                profiles.push_back(database.profile(neighbor.reference));
+            }
+            packed_triangle<float> D = profile_distance_triangle<float>(profiles, method, options.threads);
+            trees << tree_from_triangle(D, names, tree_options).newick << '\n';
+        }
+        queries++;
+    }
+    table.close();
+    if (trees.is_open()) trees.close();
+    if (!table || (!tree_output.empty() && !trees)) {
+        std::cerr << "Error: could not write the query results" << std::endl;
+        return false;
+    }
+    std::cout << "Answered " << queries << " queries against " << database.size() << " references; neighbours written to " << output;
+    if (!tree_output.empty()) std::cout << ", trees to " << tree_output;
+    std::cout << std::endl;
+    return true;
+}
@@ -0,0 +1,233 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <iostream>
+#include <queue>
+
+// Signatures have bands * rows one-permutation MinHash values; two profiles
+// become candidates when all rows of any band agree
+static const int bands = 32;
+static const int rows = 2;
+static const int signature_size = bands * rows;
+static_assert(signature_size == minhash_size, "a signature is one band row per bin");
+
+// Within a band, a profile is compared with at most this many profiles on
+// either side of it in its bucket, so huge buckets stay linear
+static const int bucket_window = 8;
+
+static uint64_t mix(uint64_t z) {
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// One-permutation MinHash: each k-mer is hashed once, its top bits pick a bin
+// and the bin keeps its smallest hash. Empty bins borrow from the next filled
+// bin, salted by the distance, so short sequences still fill the signature.
+void minhash_signature(const kmer_profile& profile, uint64_t* signature) {
+    const uint64_t empty = ~0ULL;
+    std::fill(signature, signature + signature_size, empty);
+    for (uint64_t kmer : profile.kmers) {
+        uint64_t h = mix(kmer);
+        int bin = h >> 58;
+        signature[bin] = std::min(signature[bin], h);
+    }
+    for (int b = 0; b < signature_size; b++) {
+        if (signature[b] != empty) continue;
+        for (int step = 1; step < signature_size; step++) {
+            uint64_t borrowed = signature[(b + step) % signature_size];
+            if (borrowed != empty) {
+                signature[b] = mix(borrowed + step) | 1;
+                break;
+            }
+        }
+    }
+}
+
+std::vector<sparse_edge> knn_graph(const std::vector<kmer_profile>& profiles, int neighbors,
+                                   profile_distance_fn distance, int threads) {
+    int n = profiles.size();
+    std::vector<uint64_t> signatures(size_t(n) * signature_size);
+    parallel_for_blocks(0, n, 256, threads, [&](int lo, int hi) {
+        for (int i = lo; i < hi; i++) minhash_signature(profiles[i], &signatures[size_t(i) * signature_size]);
+    });
+
+    // Per band, profiles sorted by band key; `at` gives each profile's place
+    std::vector<uint64_t> keys(size_t(n) * bands);
+    std::vector<int32_t> order(size_t(n) * bands), at(size_t(n) * bands);
+    parallel_for(0, bands, threads, [&](int b) {
+        uint64_t* key = &keys[size_t(b) * n];
+        int32_t* sorted = &order[size_t(b) * n];
+        for (int i = 0; i < n; i++) {
+            const uint64_t* row = &signatures[size_t(i) * signature_size + b * rows];
+            uint64_t h = b;
+            for (int r = 0; r < rows; r++) h = mix(h ^ row[r]);
+            key[i] = h;
+            sorted[i] = i;
+        }
+        std::sort(sorted, sorted + n, [&](int x, int y) { return key[x] != key[y] ? key[x] < key[y] : x < y; });
+        for (int p = 0; p < n; p++) at[size_t(b) * n + sorted[p]] = p;
+    });
+    std::vector<uint64_t>().swap(signatures);
+
+    // Exact distances to the candidates of each profile, keeping the nearest
+    std::vector<std::vector<sparse_edge>> nearest(n);
+    parallel_for_blocks(0, n, 64, threads, [&](int lo, int hi) {
+        std::vector<int> candidates;
+        std::vector<sparse_edge> scored;
+        for (int i = lo; i < hi; i++) {
+            candidates.clear();
+            for (int b = 0; b < bands; b++) {
+                const uint64_t* key = &keys[size_t(b) * n];
+                const int32_t* sorted = &order[size_t(b) * n];
+                int p = at[size_t(b) * n + i];
+                for (int q = std::max(0, p - bucket_window); q <= std::min(n - 1, p + bucket_window); q++) {
+                    if (q != p && key[sorted[q]] == key[i]) candidates.push_back(sorted[q]);
+                }
+            }
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+            scored.clear();
+            for (int j : candidates) scored.push_back({std::min(i, j), std::max(i, j), distance(profiles[i], profiles[j])});
+            auto closer = [](const sparse_edge& a, const sparse_edge& b) {
+                return a.d != b.d ? a.d < b.d : (a.i != b.i ? a.i < b.i : a.j < b.j);
+            };
+            if (int(scored.size()) > neighbors) {
+                std::partial_sort(scored.begin(), scored.begin() + neighbors, scored.end(), closer);
+                scored.resize(neighbors);
+            }
+            nearest[i] = scored;
+        }
+    });
+
+    // An edge found from both ends is kept once
+    std::vector<sparse_edge> edges;
+    for (auto& list : nearest) {
+        edges.insert(edges.end(), list.begin(), list.end());
+        std::vector<sparse_edge>().swap(list);
+    }
+    std::sort(edges.begin(), edges.end(), [](const sparse_edge& a, const sparse_edge& b) {
+        return a.i != b.i ? a.i < b.i : a.j < b.j;
+    });
+    edges.erase(std::unique(edges.begin(), edges.end(), [](const sparse_edge& a, const sparse_edge& b) {
+        return a.i == b.i && a.j == b.j;
+    }), edges.end());
+    return edges;
+}
+
+// Average linkage over known leaf pairs. Cluster ids are Tree node ids, so
+// a merge creates the id joinNodes returns. Each link between live clusters
+// holds the sum and number of its known leaf-pair distances, and the heap
+// holds every link created; links to merged clusters are skipped when popped.
+void sparse_upgma(const std::vector<sparse_edge>& edges, Tree& tree, const std::function<float(int, int)>& leaf_distance,
+                  bool verbose, int threads) {
+    int n = tree.leaves();
+    if (n < 2) return;
+    struct link {
+        double sum = 0;
+        int64_t count = 0;
+    };
+    struct candidate {
+        double value;
+        int a, b;
+        bool operator>(const candidate& other) const {
+            return value != other.value ? value > other.value : (a != other.a ? a > other.a : b > other.b);
+        }
+    };
+    auto key = [](int a, int b) { return uint64_t(std::min(a, b)) << 32 | uint32_t(std::max(a, b)); };
+
+    int total = 2 * n - 1;
+    std::vector<std::vector<int>> adjacent(total);
+    std::unordered_map<uint64_t, link> links;
+    std::priority_queue<candidate, std::vector<candidate>, std::greater<candidate>> heap;
+    for (const sparse_edge& e : edges) {
+        link& l = links[key(e.i, e.j)];
+        if (l.count) continue;
+        l = {e.d, 1};
+        adjacent[e.i].push_back(e.j);
+        adjacent[e.j].push_back(e.i);
+        heap.push({double(e.d), e.i, e.j});
+    }
+
+    std::vector<char> alive(total, 0);
+    std::vector<int> size(total, 1), representative(total);
+    std::vector<double> height(total, 0.0);
+    for (int i = 0; i < n; i++) {
+        alive[i] = 1;
+        representative[i] = i;
+    }
+    std::vector<int> stamp(total, -1);
+    int clusters = n;
+
+    while (clusters > 1) {
+        if (heap.empty()) {
+            // The graph fell apart: link the remaining clusters through exact
+            // distances between one leaf of each
+            std::vector<int> live;
+            for (int c = 0; c < tree.size(); c++) {
+                if (alive[c]) live.push_back(c);
+            }
+            if (verbose) {
+                std::cout << "Joining " << live.size() << " unconnected components by exact distances" << std::endl;
+            }
+            std::vector<float> d(live.size() * live.size());
+            parallel_for(0, live.size(), threads, [&](int x) {
+                for (size_t y = 0; y < size_t(x); y++) {
+                    d[x * live.size() + y] = leaf_distance(representative[live[x]], representative[live[y]]);
+                }
+            });
+            for (size_t x = 0; x < live.size(); x++) {
+                for (size_t y = 0; y < x; y++) {
+                    int a = live[x], b = live[y];
+                    links[key(a, b)] = {double(d[x * live.size() + y]) * size[a] * size[b], int64_t(size[a]) * size[b]};
+                    adjacent[a].push_back(b);
+                    adjacent[b].push_back(a);
+                    heap.push({d[x * live.size() + y], std::min(a, b), std::max(a, b)});
+                }
+            }
+        }
+
+        candidate best = heap.top();
+        heap.pop();
+        if (!alive[best.a] || !alive[best.b]) continue;
+        int a = best.a, b = best.b;
+
+        double h = best.value / 2.0;
+        int merged = tree.joinNodes(a, b, h - height[a], h - height[b]);
+        if (verbose) {
+            std::cout << "Merging nodes " << tree.label(a) << " and " << tree.label(b)
+                      << " (distance = " << best.value << ")\n";
+        }
+        alive[a] = alive[b] = 0;
+        alive[merged] = 1;
+        size[merged] = size[a] + size[b];
+        height[merged] = h;
+        representative[merged] = representative[a];
+        clusters--;
+
+        // Links to a and b are summed into links to the merged cluster
+        links.erase(key(a, b));
+        for (int side : {a, b}) {
+            for (int k : adjacent[side]) {
+                if (!alive[k]) continue;
+                auto found = links.find(key(side, k));
+                if (found == links.end()) continue;
+                link& target = links[key(merged, k)];
+                target.sum += found->second.sum;
+                target.count += found->second.count;
+                links.erase(found);
+                if (stamp[k] != merged) {
+                    stamp[k] = merged;
+                    adjacent[merged].push_back(k);
+                    adjacent[k].push_back(merged);
+                }
+            }
+            std::vector<int>().swap(adjacent[side]);
+        }
+        for (int k : adjacent[merged]) {
+            const link& l = links[key(merged, k)];
+            heap.push({l.sum / l.count, std::min(merged, k), std::max(merged, k)});
+        }
+    }
+}
@@ -0,0 +1,191 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+// Items in flight per worker; together with the stage sizes this caps the
+// records and profiles held between stages
+static const size_t queue_depth = 16;
+
+// Arrived profiles and their rows live in fixed blocks that never move, so
+// workers read earlier profiles without holding the lock while new ones arrive
+static const size_t block_size = 4096;
+
+struct fasta_record {
+    size_t index = 0;
+    std::string name, seq;
+};
+
+struct counted_profile {
+    size_t index = 0;
+    kmer_profile profile;
+};
+
+// The k-th profile to arrive, with its distances to the k profiles before it
+template <typename T>
+struct arrived_profile {
+    size_t index = 0;
+    kmer_profile profile;
+    std::vector<T> row;
+};
+
+template <typename T>
+static bool staged_triangle(const std::string& filename, const pipeline_options& options,
+                            std::vector<std::string>& names, packed_triangle<T>& D) {
+    fasta_reader reader(filename, options.threads);
+    if (!reader.good()) {
+        std::cerr << "Error opening '" << filename << "'" << std::endl;
+        return false;
+    }
+
+    int threads = resolve_threads(options.threads);
+    int counters = std::max(1, threads / 4);
+    int comparers = std::max(1, threads - counters);
+    bounded_queue<fasta_record> records(queue_depth * counters);
+    bounded_queue<counted_profile> profiles(queue_depth * comparers);
+    profile_distance_fn distance = profile_distance_function(parse_distance_method(options.method));
+
+    // Stage 1: one reader numbering records in file order
+    names.clear();
+    std::thread read_stage([&]() {
+        fasta_record record;
+        while (reader.next(record.name, record.seq)) {
+            names.push_back(record.name);
+            records.push(std::move(record));
+            record.index = names.size();
+        }
+        records.close();
+    });
+
+    // Stage 2: k-mer counting, one record at a time
+    std::atomic<int> counting(counters);
+    std::vector<std::thread> count_stage;
+    for (int c = 0; c < counters; c++) {
+        count_stage.emplace_back([&]() {
+            fasta_record record;
+            while (records.pop(record)) {
+                sequence_view view;
+                view.seq.push_back(record.seq);
+                view.name.push_back(record.name);
+                counted_profile counted;
+                counted.index = record.index;
+                counted.profile = std::move(count_kmer_profiles(view, options.kmer_length, options.canonical, options.alphabet, 1)[0]);
+                profiles.push(std::move(counted));
+            }
+            if (--counting == 0) profiles.close();
+        });
+    }
+
+    // Stage 3: each arriving profile is compared against every profile that
+    // arrived before it, so each pair is computed exactly once
+    std::mutex store_mutex;
+    std::vector<std::unique_ptr<arrived_profile<T>[]>> blocks;
+    size_t arrived = 0;
+    std::vector<std::thread> compare_stage;
+    for (int d = 0; d < comparers; d++) {
+        compare_stage.emplace_back([&]() {
+            counted_profile counted;
+            std::vector<arrived_profile<T>*> store;
+            while (profiles.pop(counted)) {
+                size_t k;
+                {
+                    std::lock_guard<std::mutex> lock(store_mutex);
+                    k = arrived++;
+                    if (k % block_size == 0) blocks.emplace_back(new arrived_profile<T>[block_size]);
+                    arrived_profile<T>& slot = blocks[k / block_size][k % block_size];
+                    slot.index = counted.index;
+                    slot.profile = std::move(counted.profile);
+                    store.clear();
+                    for (const auto& block : blocks) store.push_back(block.get());
+                }
+                arrived_profile<T>& self = store[k / block_size][k % block_size];
+                self.row.resize(k);
+                for (size_t j = 0; j < k; j++) {
+                    self.row[j] = T(distance(store[j / block_size][j % block_size].profile, self.profile));
+                }
+            }
+        });
+    }
+
+    read_stage.join();
+    for (auto& worker : count_stage) worker.join();
+    for (auto& worker : compare_stage) worker.join();
+    if (options.verbose) {
+        std::cout << "Counted and compared " << arrived << " sequences with " << counters
+                  << " counting and " << comparers << " distance threads" << std::endl;
+    }
+
+    // Rows are in arrival order; the triangle goes back to file order so the
+    // tree does not depend on thread timing. Rows are freed as they are copied.
+    D = packed_triangle<T>(arrived);
+    for (size_t k = 0; k < arrived; k++) {
+        arrived_profile<T>& a = blocks[k / block_size][k % block_size];
+        for (size_t j = 0; j < k; j++) {
+            size_t b = blocks[j / block_size][j % block_size].index;
+            if (a.index > b) D.row(a.index)[b] = a.row[j];
+            else D.row(b)[a.index] = a.row[j];
+        }
+        std::vector<T>().swap(a.row);
+    }
+    blocks.clear();
+    return true;
+}
+
+template <typename T>
+static pipeline_result staged_tree(const std::string& filename, const pipeline_options& options) {
+    std::vector<std::string> names;
+    packed_triangle<T> D;
+    if (!staged_triangle(filename, options, names, D)) return pipeline_result();
+    return tree_from_triangle(D, names, options);
+}
+
+// The record names alone, to check a checkpoint against the input
+static std::vector<std::string> fasta_names(const std::string& filename, int threads) {
+    fasta_reader reader(filename, threads);
+    std::vector<std::string> names;
+    std::string name, content;
+    while (reader.next(name, content)) names.push_back(name);
+    return names;
+}
+
+pipeline_result build_tree_from_fasta(const std::string& filename, const pipeline_options& options) {
+    // Collapsed builds resume after clustering, inside build_tree
+    bool collapsed = options.dedup || options.collapse_distance > 0;
+    pipeline_result resumed;
+    if (options.resume && !collapsed && !options.checkpoint.empty() &&
+        resume_from_checkpoint(options, fasta_names(filename, options.threads), resumed)) {
+        return resumed;
+    }
+    if (!options.staged || collapsed || options.sparse_neighbors > 0 || options.divide_size > 0 || is_alignment_method(options.method)) {
+        return build_tree(read_fasta(filename, options.threads), options);
+    }
+    switch (options.storage) {
+        case precision::float16: return staged_tree<half>(filename, options);
+        case precision::float64: return staged_tree<double>(filename, options);
+        default: return staged_tree<float>(filename, options);
+    }
+}
+
+template <typename T>
+static std::vector<pipeline_result> algorithm_trees(const std::string& filename, const pipeline_options& options) {
+    std::vector<std::string> names;
+    packed_triangle<T> D;
+    if (options.staged && !is_alignment_method(options.method)) {
+        if (!staged_triangle(filename, options, names, D)) return {};
+    } else {
+        sequence sequences = read_fasta(filename, options.threads);
+        if (!distance_triangle(view_sequences(sequences), options, D)) return {};
+        names = std::move(sequences.name);
+    }
+    return trees_from_triangle(D, names, options);
+}
+
+std::vector<pipeline_result> build_trees_from_fasta(const std::string& filename, const pipeline_options& options) {
+    switch (options.storage) {
+        case precision::float16: return algorithm_trees<half>(filename, options);
+        case precision::float64: return algorithm_trees<double>(filename, options);
+        default: return algorithm_trees<float>(filename, options);
+    }
+}
@@ -1,69 +1,81 @@
 #include "tree.hpp"
 
-Tree::Tree(const sequence& sequences) {
-    node root;
-    root.id = sequences.seq.size();
-    root.parent = -1;
-    root.level = 0;
-    root.isleaf = false;
-    root.name = "root";
-    root.subtree = "";
-    tree.push_back(root);
+Tree::Tree(const sequence& sequences) : Tree(sequences.name) {
+}
+
+Tree::Tree(const std::vector<std::string>& names) {
+    leaf_count = names.size();
+    parent.assign(leaf_count, -1);
+    child1.assign(leaf_count, -1);
+    child2.assign(leaf_count, -1);
+    length.assign(leaf_count, 0.0f);
 
-    for (int i = 0; i < sequences.seq.size(); i++) {
-        node leaf;
-        leaf.id = i;
-        leaf.parent = sequences.seq.size();
-        leaf.level = 1;
-        leaf.isleaf = true;
-        leaf.name = sequences.name[i];
-        leaf.subtree = sequences.name[i];
-        tree.push_back(leaf);
+    // Each distinct name is stored once in the pool
+    std::unordered_map<std::string_view, uint32_t> interned;
+    std::vector<std::pair<uint32_t, uint32_t>> spans;
+    leaf_names.resize(leaf_count);
+    for (int i = 0; i < leaf_count; i++) {
+        auto found = interned.find(names[i]);
+        if (found == interned.end()) {
+            spans.emplace_back(name_pool.size(), names[i].size());
+            name_pool += names[i];
+            found = interned.emplace(names[i], spans.size() - 1).first;
+        }
+        leaf_names[i] = found->second;
     }
+    name_spans = std::move(spans);
 }
 
-Tree::Tree(const std::vector<dmatrix_row>& D, const std::vector<std::string>& names) {
-    node root;
-    root.id = D.size();
-    root.parent = -1;
-    root.level = 0;
-    root.isleaf = false;
-    root.name = "root";
-    root.subtree = "";
-    tree.push_back(root);
+int Tree::joinNodes(int first, int second, float first_distance, float second_distance) {
+    int joined = parent.size();
+    parent.push_back(-1);
+    child1.push_back(first);
+    child2.push_back(second);
+    length.push_back(0.0f);
 
-    for (int i = 0; i < D.size(); i++) {
-        node leaf;
-        leaf.id = i;
-        leaf.parent = D.size();
-        leaf.level = 1;
-        leaf.isleaf = true;
-        leaf.name = names[i];
-        leaf.subtree = names[i];
-        tree.push_back(leaf);
-    }
+    parent[first] = joined;
+    parent[second] = joined;
+    length[first] = first_distance;
+    length[second] = second_distance;
+    return joined;
+}
+
+std::string_view Tree::name(int leaf) const {
+    const auto& span = name_spans[leaf_names[leaf]];
+    return std::string_view(name_pool).substr(span.first, span.second);
 }
 
-void Tree::joinNodes(int child1, int child2, float child1_distance, float child2_distance) {
-    node new_node;
-    new_node.id = tree.size();
-    new_node.parent = tree[child1].parent;
-    new_node.level = tree[child1].level;
-    new_node.isleaf = false;
-    new_node.child1 = child1;
-    new_node.child2 = child2;
-    new_node.child1_distance = child1_distance;
-    new_node.child2_distance = child2_distance;
-    new_node.name = "(" + tree[child1].name + "," + tree[child2].name + ")";
+// Walks the subtree without recursion; `branch` adds ":length" after each child
+static std::string write_subtree(const Tree& tree, int root, bool branch) {
+    std::string out;
+    std::vector<std::pair<int, int>> stack = {{root, 0}};
+    while (!stack.empty()) {
+        auto& [v, state] = stack.back();
+        if (tree.is_leaf(v)) {
+            out += tree.name(v);
+        } else if (state < 2) {
+            out += state == 0 ? '(' : ',';
+            int child = state == 0 ? tree.child1[v] : tree.child2[v];
+            state++;
+            stack.emplace_back(child, 0);
+            continue;
+        } else {
+            out += ')';
+        }
+        if (branch && v != root) {
+            out += ':';
+            out += std::to_string(tree.length[v]);
+        }
+        stack.pop_back();
+    }
+    return out;
+}
 
-    tree[child1].parent = new_node.id;
-    tree[child1].level++;
-    tree[child2].parent = new_node.id;
-    tree[child2].level++;
+std::string Tree::label(int node) const {
+    return write_subtree(*this, node, false);
+}
 
-    new_node.subtree = "(" + tree[child1].subtree + ":" + std::to_string(child1_distance) + 
-                      "," + tree[child2].subtree + ":" + std::to_string(child2_distance) + ")";
-    
-    tree.push_back(new_node);
-    newick = new_node.subtree + ";";
+std::string Tree::newick() const {
+    if (size() == leaf_count) return "";
+    return write_subtree(*this, size() - 1, true) + ";";
 }
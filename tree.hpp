@@ -3,15 +3,18 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <map>
-
-// Define the nodes of the tree
-struct node {
-    int id, parent, level, child1, child2;
-    float child1_distance, child2_distance;
-    bool isleaf;
-    std::string name, subtree;
-};
+#include <unordered_map>
+#include <cstdint>
+#include <functional>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 // Sequences and their names
 struct sequence {
@@ -19,6 +22,34 @@ struct sequence {
     std::vector<std::string> name;
 };
 
+// Borrowed view over sequences and names owned by the caller
+struct sequence_view {
+    std::vector<std::string_view> seq;
+    std::vector<std::string_view> name;
+};
+
+// Sparse k-mer profile: packed k-mer codes (2 bits per base, 5 per amino acid,
+// fewer for reduced alphabets) in ascending order and their counts
+struct kmer_profile {
+    std::vector<uint64_t> kmers;
+    std::vector<float> counts;
+    float total = 0;
+};
+
+// Aligned nucleotides packed 64 sites per word into three bit planes per
+// sequence: pyrimidine bit, second bit and valid (A/C/G/T) bit
+struct packed_alignment {
+    size_t count = 0, sites = 0, words = 0;
+    std::vector<uint64_t> bits;
+
+    uint64_t* plane(size_t seq, int p) { return bits.data() + (seq * 3 + p) * words; }
+    const uint64_t* plane(size_t seq, int p) const { return bits.data() + (seq * 3 + p) * words; }
+};
+
+struct site_counts {
+    uint64_t transitions = 0, transversions = 0, sites = 0;
+};
+
 // Distance matrix struct
 struct dmatrix_row {
     std::vector<float> distances;
@@ -33,27 +64,419 @@ struct dmatrix_row {
     dmatrix_row& operator=(dmatrix_row&&) = default;
 };
 
-// Tree class declaration
+// Storage precision of distance matrices; distances and tree building
+// accumulate in double whatever the storage type
+enum class precision { float32, float64, float16 };
+bool parse_precision(const std::string& name, precision& out);
+
+// IEEE binary16 storage, rounded to nearest even
+inline uint16_t float_to_half(float value) {
+    uint32_t x;
+    std::memcpy(&x, &value, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int exponent = int((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = x & 0x7fffff;
+
+    if (((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);  // inf, nan
+    if (exponent >= 31) return sign | 0x7c00;                                        // overflow
+    if (exponent <= 0) {                                                             // subnormal
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t h = mantissa >> shift, rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (h & 1))) h++;
+        return sign | h;
+    }
+    uint32_t h = (uint32_t(exponent) << 10) | (mantissa >> 13), rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) h++;
+    return sign | h;
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    int exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff, x;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            x = sign;
+        } else {
+            exponent = 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            x = sign | (uint32_t(exponent + 127 - 15) << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    } else if (exponent == 31) {
+        x = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        x = sign | (uint32_t(exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    float value;
+    std::memcpy(&value, &x, sizeof(value));
+    return value;
+}
+
+struct half {
+    uint16_t bits = 0;
+    half() = default;
+    half(float value) : bits(float_to_half(value)) {}
+    operator float() const { return half_to_float(bits); }
+};
+
+// Symmetric distance matrix stored as its strict lower triangle, row i holding
+// D(i, 0..i-1) contiguously. The tree builders use it as their working matrix:
+// a merged node takes one slot and the last slot is moved into the other, so
+// the active nodes always occupy slots 0..m-1.
+template <typename T>
+struct packed_triangle {
+    int n = 0;
+    std::vector<T> values;
+
+    packed_triangle() = default;
+    explicit packed_triangle(int size) : n(size), values(size > 1 ? size_t(size) * (size - 1) / 2 : 0) {}
+    explicit packed_triangle(const std::vector<dmatrix_row>& D) : packed_triangle(D.size()) {
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < i; j++) row(i)[j] = D[i].distances[j];
+        }
+    }
+
+    T* row(int i) { return values.data() + size_t(i) * (i - 1) / 2; }
+    const T* row(int i) const { return values.data() + size_t(i) * (i - 1) / 2; }
+
+    double get(int i, int j) const {
+        if (i == j) return 0;
+        return i > j ? double(row(i)[j]) : double(row(j)[i]);
+    }
+    void set(int i, int j, double d) {
+        if (i > j) row(i)[j] = T(d);
+        else if (j > i) row(j)[i] = T(d);
+    }
+
+    // Move slot `last` into slot `slot` (both < m), dropping slot's old contents
+    void move_slot(int last, int slot) {
+        for (int k = 0; k < last; k++) {
+            if (k != slot) set(slot, k, get(last, k));
+        }
+    }
+
+    std::vector<dmatrix_row> to_rows() const {
+        std::vector<dmatrix_row> D(n);
+        for (int i = 0; i < n; i++) {
+            D[i].distances.assign(n, 0.0f);
+            D[i].id = i;
+            D[i].sum = 0;
+        }
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < i; j++) {
+                D[i].distances[j] = D[j].distances[i] = float(row(i)[j]);
+                D[i].sum += D[i].distances[j];
+                D[j].sum += D[i].distances[j];
+            }
+        }
+        return D;
+    }
+};
+
+// Tree in structure-of-arrays form: leaves are nodes 0..n-1 in input order
+// and each joined node is appended after both its children, so the last node
+// is the root. Leaf names are interned once in a shared pool.
 class Tree {
 public:
-    std::vector<node> tree;
-    std::string newick;
+    std::vector<int32_t> parent, child1, child2;  // -1 where there is none
+    std::vector<float> length;                    // branch length to the parent
+
     Tree(const sequence&);
-    Tree(const std::vector<dmatrix_row>&, const std::vector<std::string>&);
-    void joinNodes(int, int, float, float);
+    Tree(const std::vector<std::string>&);
+    int joinNodes(int, int, float, float);  // returns the new node
+
+    int size() const { return parent.size(); }
+    int leaves() const { return leaf_count; }
+    bool is_leaf(int node) const { return node < leaf_count; }
+    std::string_view name(int leaf) const;
+    std::string label(int node) const;  // leaf name, or the clade as "(a,(b,c))"
+    std::string newick() const;         // empty until two nodes have been joined
+
+private:
+    int leaf_count = 0;
+    std::string name_pool;
+    std::vector<std::pair<uint32_t, uint32_t>> name_spans;  // offset and length in name_pool
+    std::vector<uint32_t> leaf_names;                       // span of each leaf
+};
+
+// Tree as flat arrays: nodes 0..leaves-1 are the leaves in name-table order
+// and internal nodes follow, each after all of its children, with the root last
+struct compact_tree {
+    int leaves = 0;
+    std::vector<int32_t> parent;  // -1 for the root
+    std::vector<float> length;    // branch length to the parent
+    std::vector<float> support;   // empty, or one value per node
 };
 
+// Borrowed compact tree, e.g. straight from a mapped archive
+struct tree_view {
+    int leaves = 0, nodes = 0;
+    const int32_t* parent = nullptr;
+    const float* length = nullptr;
+    const float* support = nullptr;
+};
+
+// Binary multi-tree file sharing one name table; trees are read in place
+// from a read-only mapping and can be accessed in any order
+class tree_archive {
+public:
+    std::vector<std::string> names;
+    tree_archive() = default;
+    tree_archive(const tree_archive&) = delete;
+    tree_archive& operator=(const tree_archive&) = delete;
+    ~tree_archive();
+    bool open(const std::string& filename);
+    void close();
+    size_t size() const { return count; }
+    tree_view view(size_t index) const;
+    compact_tree tree(size_t index) const;
+
+private:
+    const char* data = nullptr;
+    size_t size_bytes = 0;
+    const uint64_t* offsets = nullptr;
+    size_t count = 0;
+};
+
+compact_tree to_compact_tree(const Tree& tree);
+tree_view view_tree(const compact_tree& tree);
+// Children of each node in CSR form: children[first[v]..first[v + 1]) in index order
+void tree_children(const tree_view& tree, std::vector<int>& first, std::vector<int>& children);
+// Newick with shortest round-trip numbers and supports as internal labels
+std::string to_newick(const tree_view& tree, const std::vector<std::string>& names);
+std::string to_newick(const compact_tree& tree, const std::vector<std::string>& names);
+// Leaves are looked up in names; an empty names is filled in reading order
+bool parse_newick(const std::string& text, std::vector<std::string>& names, compact_tree& tree);
+bool write_tree_archive(const std::string& filename, const std::vector<std::string>& names, const std::vector<compact_tree>& trees);
+bool is_tree_archive(const std::string& filename);
+// Trees of an archive or Newick file, one at a time, with leaves in names
+// order (names is filled from the file when empty)
+bool for_each_tree(const std::string& filename, std::vector<std::string>& names, const std::function<void(const tree_view&)>& visit);
+bool read_tree_file(const std::string& filename, std::vector<std::string>& names, std::vector<compact_tree>& trees);
+
+// Robinson-Foulds distances between trees over the same leaves, from 64-bit
+// hashed bipartitions: each leaf gets a random key and a clade hashes to the
+// XOR of its keys. Normalized distances divide by the number of splits.
+std::vector<uint64_t> leaf_keys(int leaves);
+std::vector<uint64_t> tree_bipartitions(const tree_view& tree, const std::vector<uint64_t>& keys);
+std::vector<dmatrix_row> robinson_foulds_matrix(const std::vector<std::vector<uint64_t>>& splits, bool normalized, int threads);
+std::vector<dmatrix_row> robinson_foulds_matrix(const std::vector<tree_view>& trees, bool normalized, int threads);
+
+// Consensus of a stream of trees over the same leaves. Split counts and
+// lengths are kept per hashed split, so the trees themselves need not be
+// kept; build() gives the majority-rule tree, or with greedy the extended
+// majority-rule tree, with supports in percent and mean branch lengths.
+class consensus_builder {
+public:
+    explicit consensus_builder(int leaves);
+    void add(const tree_view& tree);
+    compact_tree build(bool greedy) const;
+    size_t trees() const { return count; }
+
+private:
+    struct split_entry {
+        size_t count = 0, offset = 0;
+        double length = 0;
+    };
+    int leaves, words;
+    size_t count = 0;
+    std::vector<uint64_t> keys;
+    std::unordered_map<uint64_t, split_entry> entries;
+    std::vector<uint64_t> leaf_sets;
+    std::vector<double> leaf_length;
+    bool compatible(const uint64_t* a, const uint64_t* b) const;
+};
+
+// Path lengths between the nodes of a tree. Leaves are laid out so every
+// clade covers a contiguous range of positions, which gives one leaf's
+// distances to all others in a single walk to the root; an Euler tour with a
+// sparse table of minima answers lowest common ancestor queries in O(1).
+class tree_distances {
+public:
+    explicit tree_distances(const tree_view& tree);
+    int lca(int a, int b) const;
+    double distance(int a, int b) const;
+    double depth(int node) const { return depths[node]; }
+    // row[j] = distance(i, j) for leaves j < i; scratch is reused between calls
+    void leaf_row(int i, double* row, std::vector<double>& scratch) const;
+    // Every leaf pair, in O(n^2) over rows split across threads
+    template <typename T>
+    void all_pairs(packed_triangle<T>& out, int threads = 0) const;
+
+private:
+    int leaves, nodes;
+    std::vector<int32_t> parent, level, count, start, position;
+    std::vector<double> depths;
+    std::vector<int32_t> tour, first_visit;
+    std::vector<std::vector<int32_t>> sparse;
+};
+
+// How well a tree's path lengths d reproduce a distance matrix D
+struct tree_fit {
+    size_t pairs = 0;
+    double tree_length = 0;           // sum of branch lengths
+    double sum_squares = 0;           // sum of (D - d)^2
+    double weighted_sum_squares = 0;  // sum of (D - d)^2 / D^power over D > 0
+    double mean_residual = 0;         // mean of D - d
+    double max_residual = 0;          // largest |D - d|
+    double percent_sd = 0;            // Fitch-Margoliash percent standard deviation
+};
+// power 2 weights as Fitch-Margoliash does, 0 gives ordinary least squares
+template <typename T>
+tree_fit evaluate_tree_fit(const tree_view& tree, const packed_triangle<T>& D, double power = 2, int threads = 0);
+tree_fit evaluate_tree_fit(const tree_view& tree, const std::vector<dmatrix_row>& D, double power = 2, int threads = 0);
+
 // Function declarations for sequence processing
-sequence read_fasta(std::string filename);
+sequence read_fasta(std::string filename, int threads = 0);
+
+// gzip input, recognised by its magic bytes: BGZF files are inflated a batch
+// of blocks at a time across threads, other gzip files as one stream.
+// Returns nullptr for uncompressed files.
+std::unique_ptr<std::streambuf> open_decompressed(std::istream& file, const std::string& filename, int threads);
+
+// Reads FASTA records one at a time, so a file never has to fit in memory,
+// compressed or not
+class fasta_reader {
+public:
+    explicit fasta_reader(const std::string& filename, int threads = 0);
+    explicit fasta_reader(std::streambuf* source) : input(source) {}
+    bool good() const { return input.good(); }
+    bool next(std::string& name, std::string& content);
+
+private:
+    std::ifstream file;
+    std::unique_ptr<std::streambuf> inflater;
+    std::istream input;
+    std::string line, pending_name;
+};
+
+// Blocking FIFO of at most `capacity` items between pipeline stages: push()
+// waits while it is full, pop() waits while it is empty and returns false
+// once the queue is closed and drained
+template <typename T>
+class bounded_queue {
+public:
+    explicit bounded_queue(size_t capacity) : capacity(capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [&]() { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&]() { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_full, not_empty;
+};
 std::vector<std::vector<float>> count_kmer_frequencies(sequence& sequences, int& kmer_length);
+std::vector<std::vector<float>> count_kmer_frequencies(const sequence_view& sequences, int kmer_length);
 std::vector<dmatrix_row> distance_matrix(std::vector<std::vector<float>>& frequencies, sequence& sequences, int kmer_length, std::string method);
+std::vector<dmatrix_row> distance_matrix(const std::vector<std::vector<float>>& frequencies, std::string method);
+
+// Sparse k-mer profiles over an alphabet: "dna" (k <= 32), "protein" (k <= 12),
+// "murphy10" (k <= 16) or "dayhoff6" (k <= 21). Canonical counting merges each DNA
+// k-mer with its reverse complement. The multi-k overload fills
+// profiles[k_index][sequence] from one scan of each sequence. Sequences, and
+// chunks of long ones, are counted on `threads` threads; the profiles do not
+// depend on the thread count.
+bool is_alphabet(const std::string& alphabet);
+int max_kmer_length(const std::string& alphabet);
+std::vector<kmer_profile> count_kmer_profiles(const sequence_view& sequences, int kmer_length, bool canonical, const std::string& alphabet = "dna", int threads = 0);
+std::vector<std::vector<kmer_profile>> count_kmer_profiles(const sequence_view& sequences, const std::vector<int>& kmer_lengths, bool canonical, const std::string& alphabet = "dna", int threads = 0);
+
+// K-mer distance measures; the method is resolved once to a specialized kernel
+enum class distance_method { fractional, mahalanobis, cosine };
+// True for the k-mer measures and the alignment methods
+bool is_distance_method(const std::string& method);
+distance_method parse_distance_method(const std::string& method);
+using profile_distance_fn = float (*)(const kmer_profile&, const kmer_profile&);
+profile_distance_fn profile_distance_function(distance_method method);
+float profile_distance(const kmer_profile& a, const kmer_profile& b, const std::string& method);
+std::vector<dmatrix_row> distance_matrix(const std::vector<kmer_profile>& profiles, std::string method, int threads = 0);
+std::vector<std::vector<dmatrix_row>> distance_matrices(const std::vector<std::vector<kmer_profile>>& profiles, std::string method, int threads = 0);
+// Instantiated for float, double and half
+template <typename T>
+packed_triangle<T> profile_distance_triangle(const std::vector<kmer_profile>& profiles, distance_method method, int threads);
+
+// The packed_triangle overloads of the builders use D as their working matrix
+// and are instantiated for float, double and half storage. Their pair searches
+// and updates run on `threads` threads with results independent of the count.
+
+// Smallest scale * D(i, j) - bias[i] - bias[j] over slots j < i < m (just
+// D(i, j) when bias is null); ties go to the first pair in row-major order
+struct min_pair {
+    double value;
+    int i, j;
+};
+template <typename T>
+min_pair find_min_pair(const packed_triangle<T>& D, int m, double scale, const double* bias, int threads);
+
+// State of an NJ, UPGMA or ME merge loop between two joins
+struct merge_state {
+    int m = 0;                   // active slots; 0 when nothing was restored
+    std::vector<int> nodes;      // tree node held by each slot
+    std::vector<double> values;  // per-slot builder state (NJ row sums, UPGMA heights and sizes)
+};
+
+// Snapshots of a merge loop, taken at most every `interval` seconds: the
+// joins so far, the merge state and the m active rows of the working matrix.
+// A snapshot without joins holds just the matrix. load() restores D and
+// `restored`; replay() then redoes the joins on a Tree built from the names.
+class merge_checkpoint {
+public:
+    merge_checkpoint(const std::string& filename, const std::string& algorithm, double interval);
+    bool due() const;
+    template <typename T>
+    bool save(const packed_triangle<T>& D, const Tree& tree, const merge_state& state);
+    template <typename T>
+    bool load(std::vector<std::string>& names, packed_triangle<T>& D);
+    void replay(Tree& tree) const;
+    void remove() const;
+    merge_state restored;
+
+private:
+    std::string filename, algorithm;
+    double interval;
+    std::chrono::steady_clock::time_point last;
+    std::vector<int32_t> joined1, joined2;
+    std::vector<float> lengths1, lengths2;
+};
 
 // Neighbor Joining algorithm declarations
 void neighbor_joining(std::vector<dmatrix_row>& D, Tree& tree, bool verbose);
+template <typename T>
+void neighbor_joining(packed_triangle<T>& D, Tree& tree, bool verbose, int threads = 0, merge_checkpoint* checkpoint = nullptr);
 void neighbor_joining_tree(std::vector<dmatrix_row>& D, std::string output, bool verbose);
 
 // Fitch-Margoliash algorithm declarations
 void fitch_margoliash(std::vector<dmatrix_row>& D, Tree& tree, bool verbose);
+template <typename T>
+void fitch_margoliash(const packed_triangle<T>& D, Tree& tree, bool verbose);
 void fitch_margoliash_tree(std::vector<dmatrix_row>& D, std::string output, bool verbose);
 float calculate_tree_fit(const Tree& tree, const std::vector<dmatrix_row>& D);
 void optimize_branch_lengths(Tree& tree, const std::vector<dmatrix_row>& D);
@@ -67,12 +490,262 @@ void help();
 
 // UPGMA algorithm declarations
 void upgma(std::vector<dmatrix_row>& D, Tree& tree, bool verbose);
+template <typename T>
+void upgma(packed_triangle<T>& D, Tree& tree, bool verbose, int threads = 0, merge_checkpoint* checkpoint = nullptr);
 void upgma_tree(std::vector<dmatrix_row>& D, std::string output, bool verbose);
 
 // Minimum Evolution algorithm declarations
 void minimum_evolution(std::vector<dmatrix_row>& D, Tree& tree, bool verbose);
+template <typename T>
+void minimum_evolution(packed_triangle<T>& D, Tree& tree, bool verbose, int threads = 0, merge_checkpoint* checkpoint = nullptr);
 void minimum_evolution_tree(std::vector<dmatrix_row>& D, std::string output, bool verbose);
 
+// Alignment-based distances: "p", "jc69" or "k2p"
+bool is_alignment_method(const std::string& method);
+packed_alignment pack_alignment(const sequence_view& alignment);
+site_counts compare_sites(const packed_alignment& packed, size_t a, size_t b);
+std::vector<dmatrix_row> alignment_distance_matrix(const packed_alignment& packed, std::string method, int threads);
+std::vector<dmatrix_row> alignment_distance_matrix(const sequence_view& alignment, std::string method, int threads);
+
+// Sharded distance computation: profiles are saved once, independent processes
+// each compute a range of lower-triangle tiles into a tile file, and the tile
+// files are merged back into a full matrix
+struct profile_set {
+    int kmer_length = 8;
+    bool canonical = false;
+    std::string alphabet = "dna";
+    std::vector<std::string> names;
+    std::vector<kmer_profile> profiles;
+};
+
+bool write_profile_set(const std::string& filename, const profile_set& set);
+bool read_profile_set(const std::string& filename, profile_set& set, const std::vector<bool>* wanted = nullptr);
+bool compute_distance_tiles(const std::string& profile_file, int shard, int shards, int tile_size,
+                            const std::string& method, int threads, const std::string& output);
+template <typename T>
+bool merge_distance_tiles(const std::vector<std::string>& tile_files, int n, packed_triangle<T>& D);
+
+// Sparse k-nearest-neighbour graph: profiles whose one-permutation MinHash
+// signatures agree on a band are candidates, and only candidates get exact
+// distances, so the work grows with n rather than n^2. Edges have i < j.
+struct sparse_edge {
+    int32_t i, j;
+    float d;
+};
+std::vector<sparse_edge> knn_graph(const std::vector<kmer_profile>& profiles, int neighbors,
+                                   profile_distance_fn distance, int threads);
+// One-permutation MinHash of a profile's k-mers; the share of the values
+// two signatures agree on estimates the Jaccard similarity of their k-mers
+const int minhash_size = 64;
+void minhash_signature(const kmer_profile& profile, uint64_t* signature);
+
+// Reference sketch database: each reference's MinHash signature, k-mer
+// profile and name, read in place from a read-only mapping. Every build
+// appends a segment, so a database grows without being rewritten.
+struct sketch_neighbor {
+    size_t reference;
+    float distance;
+};
+
+class sketch_database {
+public:
+    int kmer_length = 0;
+    bool canonical = false;
+    std::string alphabet;
+    sketch_database() = default;
+    sketch_database(const sketch_database&) = delete;
+    sketch_database& operator=(const sketch_database&) = delete;
+    ~sketch_database();
+    bool open(const std::string& filename);
+    void close();
+    size_t size() const { return count; }
+    size_t complete_size() const { return complete_bytes; }  // file bytes up to the last complete segment
+    std::string name(size_t index) const;
+    kmer_profile profile(size_t index) const;
+    // The `neighbors` nearest references by exact distance, among those
+    // whose signatures agree most with the query's
+    std::vector<sketch_neighbor> nearest(const kmer_profile& query, int neighbors, profile_distance_fn distance, int threads) const;
+
+private:
+    struct segment {
+        size_t first = 0, count = 0;
+        const uint16_t* signatures = nullptr;
+        const uint64_t* offsets = nullptr;
+        const float* totals = nullptr;
+        const uint64_t* name_offsets = nullptr;
+        const uint64_t* kmers = nullptr;
+        const float* counts = nullptr;
+        const char* names = nullptr;
+    };
+    const char* data = nullptr;
+    size_t size_bytes = 0;
+    std::vector<segment> segments;
+    size_t count = 0;
+    size_t complete_bytes = 0;
+    const segment& locate(size_t index, size_t& local) const;
+};
+
+// Creates the database, or appends to one built with the same k-mers
+bool append_sketch_database(const std::string& filename, const profile_set& set, int threads);
+
+// UPGMA over the graph: a cluster pair's distance is the mean of the leaf
+// pairs joined by an edge. Components the graph leaves apart are joined by
+// leaf_distance between one leaf of each.
+void sparse_upgma(const std::vector<sparse_edge>& edges, Tree& tree, const std::function<float(int, int)>& leaf_distance,
+                  bool verbose, int threads);
+
+// Threading helpers; threads <= 0 means one per hardware thread
+int resolve_threads(int threads);
+void parallel_for(int begin, int end, int threads, const std::function<void(int)>& body);
+// body(lo, hi) over consecutive blocks of `block` indices, for cheap iterations
+void parallel_for_blocks(int begin, int end, int block, int threads, const std::function<void(int, int)>& body);
+
+// In-memory pipeline: sequences in, distance matrix and Newick tree out.
+// fasta_to_newick(filename, options, output) in main.cpp wraps it for files.
+struct pipeline_options {
+    int kmer_length = 8;
+    bool canonical = false;
+    std::string alphabet = "dna";
+    std::string method = "fractional";
+    std::string algorithm = "nj";
+    precision storage = precision::float32;
+    bool keep_matrix = true;  // return the full matrix in pipeline_result
+    bool staged = false;      // overlap reading, counting and distances (build_tree_from_fasta)
+    bool fit = false;         // score the tree against a copy of the matrix
+    std::string checkpoint;   // path prefix for <prefix>.profiles and <prefix>.merge snapshots
+    double checkpoint_interval = 600;  // seconds between merge snapshots
+    bool resume = false;      // continue from the checkpoint files when they exist
+    bool dedup = false;       // build on one of each set of identical sequences
+    double collapse_distance = 0;  // also merge sequences within this k-mer distance
+    int sparse_neighbors = 0;      // > 0: average linkage over a k-nearest-neighbour graph
+    int divide_size = 0;           // > 0: join trees of subsets of at most this many taxa
+    std::string matrix_output;     // write the distance matrix here in PHYLIP format
+    bool matrix_lower = false;     // ... as a lower triangle instead of square
+    std::vector<std::string> algorithms;  // build_trees_from_*: one tree per algorithm from one matrix
+    std::chrono::steady_clock::time_point deadline{};  // when set, FM and ME refine an NJ tree until then
+    std::string progress_output;   // ... writing the best tree so far here
+    int threads = 0;
+    bool verbose = false;
+};
+
+struct pipeline_result {
+    std::vector<dmatrix_row> matrix;
+    std::string newick;
+    compact_tree tree;
+    tree_fit fit;  // filled when options.fit is set
+};
+
+sequence_view view_sequences(const sequence& sequences);
+
+// Sequences grouped under representatives before tree building: exact
+// duplicates by hashing, then optionally everything within a k-mer distance
+// of an earlier representative (greedy leader clustering in input order)
+struct sequence_clusters {
+    std::vector<int> representatives;  // sequence index of each cluster's representative
+    std::vector<int> cluster_of;       // cluster of every sequence
+    std::vector<int> duplicate_of;     // first identical sequence, or the sequence itself
+    std::vector<float> offset;         // distance to the representative, for the first copies
+};
+sequence_clusters exact_duplicates(const sequence_view& sequences);
+// profiles holds one profile per current cluster and keeps only the leaders'
+void collapse_near_duplicates(sequence_clusters& clusters, std::vector<kmer_profile>& profiles,
+                              profile_distance_fn distance, double threshold, int threads);
+// The tree on the representatives with copies attached to their first copy
+// and clustered sequences to their representative, by zero-length joins
+pipeline_result graft_clusters(const pipeline_result& reduced, const sequence_clusters& clusters,
+                               const std::vector<std::string>& names);
+// "nj", "upgma", "me" or "fm"
+bool is_algorithm(const std::string& algorithm);
+void build_tree_from_matrix(std::vector<dmatrix_row>& D, Tree& tree, std::string algorithm, bool verbose);
+template <typename T>
+void build_tree_from_matrix(packed_triangle<T>& D, Tree& tree, std::string algorithm, bool verbose, int threads = 0, merge_checkpoint* checkpoint = nullptr);
+pipeline_result build_tree(const sequence_view& sequences, const pipeline_options& options);
+pipeline_result build_tree(const sequence& sequences, const pipeline_options& options);
+// Instantiated for float, double and half; D is consumed by the builder
+template <typename T>
+pipeline_result tree_from_triangle(packed_triangle<T>& D, const std::vector<std::string>& names, const pipeline_options& options);
+// One tree per entry of options.algorithms, built concurrently from the same
+// matrix; D is left as it is
+template <typename T>
+std::vector<pipeline_result> trees_from_triangle(const packed_triangle<T>& D, const std::vector<std::string>& names,
+                                                 const pipeline_options& options);
+// The full matrix of the sequences: k-mer or alignment distances by options.method
+template <typename T>
+bool distance_triangle(const sequence_view& sequences, const pipeline_options& options, packed_triangle<T>& D);
+// Anytime FM and ME (options.deadline): `tree`, a neighbour-joining tree, is
+// refined against D until the deadline or convergence. FM fits weighted
+// least-squares branch lengths; ME makes balanced minimum evolution NNIs.
+template <typename T>
+void refine_tree(const packed_triangle<T>& D, Tree& tree, const std::vector<std::string>& names, const pipeline_options& options);
+// Divide and conquer (options.divide_size): a UPGMA guide tree over the
+// sketch graph is cut into subsets of at most divide_size taxa, their trees
+// are built concurrently with options.algorithm, each rooted by an outgroup,
+// and a backbone tree of one taxon per subset joins them
+template <typename T>
+pipeline_result divide_tree(const std::vector<kmer_profile>& profiles, const std::vector<std::string>& names, const pipeline_options& options);
+// Continues from the files under options.checkpoint; false when there is
+// nothing to resume from or the files were written for taxa other than `names`
+bool resume_from_checkpoint(const pipeline_options& options, const std::vector<std::string>& names, pipeline_result& result);
+// Reads the FASTA file itself (or resumes, with options.resume); with options.staged, records are counted and
+// compared while the rest of the file is still being read
+pipeline_result build_tree_from_fasta(const std::string& filename, const pipeline_options& options);
+// The options.algorithms trees of one FASTA file, its matrix computed once
+// (streamed with options.staged)
+std::vector<pipeline_result> build_trees_from_fasta(const std::string& filename, const pipeline_options& options);
+
+pipeline_result build_tree(std::vector<dmatrix_row> matrix, const std::vector<std::string>& names, const pipeline_options& options);
+// One tree per k-mer length, counted in a single pass over the sequences;
+// options.matrix_output is named per length by kmer_output_name
+std::string kmer_output_name(const std::string& output, int kmer_length);
+std::vector<pipeline_result> build_trees(const sequence_view& sequences, const pipeline_options& options, const std::vector<int>& kmer_lengths);
+
+// PHYLIP distance matrices: a taxon count, then one row per taxon of a name
+// and its distances, either square or lower-triangular (with or without the
+// diagonal). The file is mapped and rows are parsed in parallel straight into
+// the packed triangle; rows wrapped over several lines are read in order.
+template <typename T>
+bool read_phylip_matrix(const std::string& filename, std::vector<std::string>& names, packed_triangle<T>& D, int threads = 0);
+template <typename T>
+bool write_phylip_matrix(const std::string& filename, const std::vector<std::string>& names,
+                         const packed_triangle<T>& D, bool lower, int threads = 0);
+pipeline_result build_tree_from_phylip(const std::string& filename, const pipeline_options& options);
+std::vector<pipeline_result> build_trees_from_phylip(const std::string& filename, const pipeline_options& options);
+
+// Memory planning for -max-mem. The input is sized from a samtools .fai
+// index when there is one, otherwise from one pass over the records.
+struct input_summary {
+    size_t sequences = 0, residues = 0, longest = 0, name_bytes = 0;
+    size_t file_bytes = 0;    // size of a PHYLIP matrix file
+    bool compressed = false;  // gzip or BGZF
+    bool indexed = false;     // sized from the .fai index
+    bool matrix = false;      // a PHYLIP matrix rather than sequences
+};
+bool summarize_fasta(const std::string& filename, input_summary& summary, int threads = 0);
+bool summarize_matrix(const std::string& filename, input_summary& summary);
+bool parse_memory_size(const std::string& text, size_t& bytes);  // "512M", "16G", ...
+// Estimates the peak footprint of the requested build and, when it does not
+// fit, switches to -staged, fewer threads, no -fit, lower precision and
+// finally (UPGMA only) the sparse neighbour graph, in that order
+struct memory_plan {
+    bool fits = false;
+    size_t bytes = 0;                  // estimated peak of the chosen plan
+    pipeline_options options;          // the request, adjusted to fit
+    std::vector<std::string> report;   // the plan, one line per part and change
+};
+memory_plan plan_memory(const input_summary& input, const pipeline_options& options, size_t budget);
+
+// Daemon on a Unix domain socket: each connection sends "panel FILE" and
+// other "key value" lines followed by FASTA records, and gets back the Newick
+// tree of the panel plus those records. Panel profiles and distances stay in
+// memory, so a request computes only the rows of its own sequences.
+bool run_server(const std::string& socket_path, const pipeline_options& options);
+
+// Nearest references of each query in a FASTA file, streamed one query at a
+// time: "query reference distance" lines go to output, and with a tree_output
+// a tree over each query and its neighbours, one Newick tree per line
+bool run_sketch_queries(const std::string& database_file, const std::string& query_file, int neighbors, const pipeline_options& options,
+                        const std::string& output, const std::string& tree_output);
+
 void computeTransitionTransversionRatio(const std::vector<std::string> &names, const std::vector<std::string> &sequences);
 std::vector<std::vector<std::string>> bootstrapSequences(const std::vector<std::string> &sequences, int numBootstrap);
 void performBootstrapAnalysis(const std::vector<std::string> &sequences, int numBootstrap, const std::string &outputFile);
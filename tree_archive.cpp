@@ -0,0 +1,457 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Archive file (native byte order, every section 8-byte aligned):
+//   "PHYTREE1", leaf count, tree count
+//   name table: per leaf its length and bytes, padded to 8
+//   tree count offsets from the start of the file
+//   per tree: node count, flags (1 = has support), parent[nodes],
+//             length[nodes], support[nodes] if flagged, padded to 8
+static const char archive_magic[8] = {'P', 'H', 'Y', 'T', 'R', 'E', 'E', '1'};
+static const uint32_t has_support = 1;
+
+static size_t padded(size_t size) {
+    return (size + 7) & ~size_t(7);
+}
+
+// Tree already keeps leaves first and parents after their children
+compact_tree to_compact_tree(const Tree& tree) {
+    compact_tree compact;
+    compact.leaves = tree.leaves();
+    compact.parent = tree.parent;
+    compact.length = tree.length;
+    return compact;
+}
+
+static void append_number(std::string& out, float value) {
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, result.ptr);
+}
+
+void tree_children(const tree_view& tree, std::vector<int>& first, std::vector<int>& children) {
+    first.assign(tree.nodes + 1, 0);
+    children.resize(tree.nodes);
+    for (int i = 0; i < tree.nodes; i++) {
+        if (tree.parent[i] >= 0) first[tree.parent[i] + 1]++;
+    }
+    for (int i = 0; i < tree.nodes; i++) first[i + 1] += first[i];
+    std::vector<int> fill(first.begin(), first.end() - 1);
+    for (int i = 0; i < tree.nodes; i++) {
+        if (tree.parent[i] >= 0) children[fill[tree.parent[i]]++] = i;
+    }
+}
+
+std::string to_newick(const tree_view& tree, const std::vector<std::string>& names) {
+    if (tree.nodes == 0) return ";";
+
+    std::vector<int> first, children;
+    tree_children(tree, first, children);
+    int root = tree.nodes - 1;
+    for (int i = 0; i < tree.nodes; i++) {
+        if (tree.parent[i] < 0) root = i;
+    }
+
+    // Iterative walk: (node, next child) pairs, so deep caterpillar trees
+    // do not exhaust the call stack
+    std::string out;
+    std::vector<std::pair<int, int>> stack = {{root, 0}};
+    while (!stack.empty()) {
+        auto& [v, next] = stack.back();
+        int count = first[v + 1] - first[v];
+        if (count == 0) {
+            out += v < int(names.size()) ? names[v] : std::to_string(v);
+        } else if (next < count) {
+            out += next == 0 ? '(' : ',';
+            stack.emplace_back(children[first[v] + next++], 0);
+            continue;
+        } else {
+            out += ')';
+            if (tree.support && tree.parent[v] >= 0) append_number(out, tree.support[v]);
+        }
+        if (tree.parent[v] >= 0) {
+            out += ':';
+            append_number(out, tree.length[v]);
+        }
+        stack.pop_back();
+    }
+    return out + ";";
+}
+
+std::string to_newick(const compact_tree& tree, const std::vector<std::string>& names) {
+    return to_newick(view_tree(tree), names);
+}
+
+tree_view view_tree(const compact_tree& tree) {
+    tree_view view;
+    view.leaves = tree.leaves;
+    view.nodes = tree.parent.size();
+    view.parent = tree.parent.data();
+    view.length = tree.length.data();
+    view.support = tree.support.empty() ? nullptr : tree.support.data();
+    return view;
+}
+
+static bool parse_float(const std::string& text, size_t& pos, float& value) {
+    size_t end = text.find_first_of(":,();[ \t\r\n", pos);
+    if (end == std::string::npos) end = text.size();
+    auto result = std::from_chars(text.data() + pos, text.data() + end, value);
+    if (result.ec != std::errc() || result.ptr != text.data() + end) return false;
+    pos = end;
+    return true;
+}
+
+bool parse_newick(const std::string& text, std::vector<std::string>& names, compact_tree& tree) {
+    // Nodes are collected in reading order: leaves keep their name index,
+    // internal nodes are numbered by the order they close in
+    std::vector<int> parent, leaf, closed;
+    std::vector<float> length, support;
+    std::vector<int> open;
+    std::map<std::string, int> index;
+    bool fixed_names = !names.empty();
+    for (size_t i = 0; i < names.size(); i++) index[names[i]] = i;
+
+    bool any_support = false;
+    int closed_count = 0, last = -1;
+    size_t pos = 0;
+    auto fail = [&](const std::string& why) {
+        std::cerr << "Error: " << why << " at offset " << pos << " of Newick tree" << std::endl;
+        return false;
+    };
+    auto add_node = [&](int leaf_index) {
+        parent.push_back(open.empty() ? -1 : open.back());
+        leaf.push_back(leaf_index);
+        closed.push_back(-1);
+        length.push_back(0.0f);
+        support.push_back(0.0f);
+        return int(parent.size()) - 1;
+    };
+
+    while (pos < text.size() && text[pos] != ';') {
+        char c = text[pos];
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ',') {
+            pos++;
+        } else if (c == '(') {
+            open.push_back(add_node(-1));
+            pos++;
+        } else if (c == ')') {
+            if (open.empty()) return fail("unbalanced ')'");
+            last = open.back();
+            open.pop_back();
+            closed[last] = closed_count++;
+            pos++;
+            if (pos < text.size() && text[pos] != ':' && text[pos] != ',' && text[pos] != ')' && text[pos] != ';') {
+                size_t label = pos;
+                if (parse_float(text, pos, support[last])) {
+                    any_support = true;
+                } else {
+                    pos = text.find_first_of(":,();", label);
+                    if (pos == std::string::npos) pos = text.size();
+                }
+            }
+        } else if (c == ':') {
+            pos++;
+            if (last < 0 || !parse_float(text, pos, length[last])) return fail("bad branch length");
+        } else {
+            size_t end = text.find_first_of(":,();", pos);
+            if (end == std::string::npos) end = text.size();
+            std::string name = text.substr(pos, end - pos);
+            auto found = index.find(name);
+            if (found == index.end()) {
+                if (fixed_names) return fail("unknown leaf '" + name + "'");
+                found = index.emplace(name, names.size()).first;
+                names.push_back(name);
+            }
+            last = add_node(found->second);
+            pos = end;
+        }
+    }
+    if (!open.empty()) return fail("unbalanced '('");
+
+    int leaves = names.size();
+    std::vector<int> final_index(parent.size());
+    std::vector<bool> seen(leaves, false);
+    for (size_t i = 0; i < parent.size(); i++) {
+        if (leaf[i] >= 0) {
+            if (seen[leaf[i]]) return fail("duplicate leaf '" + names[leaf[i]] + "'");
+            seen[leaf[i]] = true;
+            final_index[i] = leaf[i];
+        } else {
+            final_index[i] = leaves + closed[i];
+        }
+    }
+    if (std::count(seen.begin(), seen.end(), false) > 0) return fail("missing leaves");
+
+    tree = compact_tree();
+    tree.leaves = leaves;
+    tree.parent.assign(parent.size(), -1);
+    tree.length.assign(parent.size(), 0.0f);
+    if (any_support) tree.support.assign(parent.size(), 0.0f);
+    for (size_t i = 0; i < parent.size(); i++) {
+        int k = final_index[i];
+        tree.parent[k] = parent[i] < 0 ? -1 : final_index[parent[i]];
+        tree.length[k] = length[i];
+        if (any_support) tree.support[k] = support[i];
+    }
+    return true;
+}
+
+template <typename T>
+static void write_value(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static void write_padding(std::ofstream& out, size_t size) {
+    static const char zeros[8] = {};
+    out.write(zeros, padded(size) - size);
+}
+
+bool write_tree_archive(const std::string& filename, const std::vector<std::string>& names, const std::vector<compact_tree>& trees) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cerr << "Error: could not write '" << filename << "'" << std::endl;
+        return false;
+    }
+    out.write(archive_magic, sizeof(archive_magic));
+    write_value<uint64_t>(out, names.size());
+    write_value<uint64_t>(out, trees.size());
+
+    size_t names_size = 0;
+    for (const std::string& name : names) {
+        write_value<uint32_t>(out, name.size());
+        out.write(name.data(), name.size());
+        names_size += sizeof(uint32_t) + name.size();
+    }
+    write_padding(out, names_size);
+
+    // Offsets are known up front, so the trees can be read in any order
+    uint64_t offset = 24 + padded(names_size) + trees.size() * sizeof(uint64_t);
+    for (const compact_tree& tree : trees) {
+        write_value<uint64_t>(out, offset);
+        size_t nodes = tree.parent.size();
+        offset += padded(8 + nodes * (tree.support.empty() ? 8 : 12));
+    }
+
+    for (const compact_tree& tree : trees) {
+        if (tree.leaves != int(names.size())) {
+            std::cerr << "Error: tree with " << tree.leaves << " leaves in an archive of " << names.size() << std::endl;
+            return false;
+        }
+        uint32_t nodes = tree.parent.size();
+        write_value<uint32_t>(out, nodes);
+        write_value<uint32_t>(out, tree.support.empty() ? 0 : has_support);
+        out.write(reinterpret_cast<const char*>(tree.parent.data()), nodes * sizeof(int32_t));
+        out.write(reinterpret_cast<const char*>(tree.length.data()), nodes * sizeof(float));
+        if (!tree.support.empty()) {
+            out.write(reinterpret_cast<const char*>(tree.support.data()), nodes * sizeof(float));
+        }
+        write_padding(out, 8 + nodes * (tree.support.empty() ? 8 : 12));
+    }
+    return bool(out);
+}
+
+// Leaves first, every other node after its children and the root last:
+// each parent is a later internal node, and internal nodes have at least
+// two children
+static bool valid_shape(uint64_t leaves, uint32_t nodes, const int32_t* parent, std::vector<int>& children) {
+    if (nodes < leaves || (nodes == 0) != (leaves == 0)) return false;
+    if (nodes == 0) return true;
+    children.assign(nodes, 0);
+    for (uint32_t v = 0; v + 1 < nodes; v++) {
+        if (parent[v] <= int64_t(v) || uint32_t(parent[v]) >= nodes || uint64_t(parent[v]) < leaves) return false;
+        children[parent[v]]++;
+    }
+    if (parent[nodes - 1] != -1) return false;
+    for (uint32_t v = leaves; v < nodes; v++) {
+        if (children[v] < 2) return false;
+    }
+    return true;
+}
+
+tree_archive::~tree_archive() {
+    close();
+}
+
+void tree_archive::close() {
+    if (data) munmap(const_cast<char*>(data), size_bytes);
+    data = nullptr;
+    size_bytes = 0;
+    offsets = nullptr;
+    count = 0;
+    names.clear();
+}
+
+bool tree_archive::open(const std::string& filename) {
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) ::close(fd);
+        std::cerr << "Error: could not open '" << filename << "'" << std::endl;
+        return false;
+    }
+    size_bytes = info.st_size;
+    void* mapped = size_bytes ? mmap(nullptr, size_bytes, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        size_bytes = 0;
+        std::cerr << "Error: could not map '" << filename << "'" << std::endl;
+        return false;
+    }
+    data = static_cast<const char*>(mapped);
+
+    auto invalid = [&]() {
+        std::cerr << "Error: '" << filename << "' is not a valid tree archive" << std::endl;
+        close();
+        return false;
+    };
+    if (size_bytes < 24 || std::memcmp(data, archive_magic, sizeof(archive_magic)) != 0) return invalid();
+
+    uint64_t leaves, trees;
+    std::memcpy(&leaves, data + 8, sizeof(leaves));
+    std::memcpy(&trees, data + 16, sizeof(trees));
+    size_t pos = 24;
+    names.resize(leaves);
+    for (uint64_t i = 0; i < leaves; i++) {
+        uint32_t length;
+        if (pos + sizeof(length) > size_bytes) return invalid();
+        std::memcpy(&length, data + pos, sizeof(length));
+        pos += sizeof(length);
+        if (pos + length > size_bytes) return invalid();
+        names[i].assign(data + pos, length);
+        pos += length;
+    }
+    pos = 24 + padded(pos - 24);
+    if (trees > (size_bytes - std::min(pos, size_bytes)) / sizeof(uint64_t)) return invalid();
+    offsets = reinterpret_cast<const uint64_t*>(data + pos);
+    count = trees;
+
+    // Check every tree's extent and shape once so view() and the walks over
+    // its trees need no further checks
+    std::vector<int> children;
+    for (size_t t = 0; t < count; t++) {
+        uint64_t offset = offsets[t];
+        if (offset % 8 || offset + 8 > size_bytes) return invalid();
+        uint32_t nodes, flags;
+        std::memcpy(&nodes, data + offset, sizeof(nodes));
+        std::memcpy(&flags, data + offset + 4, sizeof(flags));
+        if (offset + 8 + uint64_t(nodes) * (flags & has_support ? 12 : 8) > size_bytes) return invalid();
+        if (!valid_shape(leaves, nodes, reinterpret_cast<const int32_t*>(data + offset + 8), children)) return invalid();
+    }
+    return true;
+}
+
+tree_view tree_archive::view(size_t index) const {
+    const char* base = data + offsets[index];
+    tree_view tree;
+    uint32_t nodes, flags;
+    std::memcpy(&nodes, base, sizeof(nodes));
+    std::memcpy(&flags, base + 4, sizeof(flags));
+    tree.leaves = names.size();
+    tree.nodes = nodes;
+    tree.parent = reinterpret_cast<const int32_t*>(base + 8);
+    tree.length = reinterpret_cast<const float*>(base + 8 + nodes * sizeof(int32_t));
+    tree.support = flags & has_support ? tree.length + nodes : nullptr;
+    return tree;
+}
+
+compact_tree tree_archive::tree(size_t index) const {
+    tree_view view = this->view(index);
+    compact_tree tree;
+    tree.leaves = view.leaves;
+    tree.parent.assign(view.parent, view.parent + view.nodes);
+    tree.length.assign(view.length, view.length + view.nodes);
+    if (view.support) tree.support.assign(view.support, view.support + view.nodes);
+    return tree;
+}
+
+// Leaves of an archive whose name table is ordered differently are moved
+// to their position in names; internal nodes keep their indices
+static bool remap_leaves(compact_tree& tree, const std::vector<std::string>& from, const std::vector<std::string>& to) {
+    std::map<std::string, int> index;
+    for (size_t i = 0; i < to.size(); i++) index[to[i]] = i;
+    std::vector<int32_t> parent(tree.parent);
+    std::vector<float> length(tree.length), support(tree.support);
+    for (int i = 0; i < tree.leaves; i++) {
+        auto found = index.find(from[i]);
+        if (found == index.end()) return false;
+        parent[found->second] = tree.parent[i];
+        length[found->second] = tree.length[i];
+        if (!support.empty()) support[found->second] = tree.support[i];
+    }
+    tree.parent = std::move(parent);
+    tree.length = std::move(length);
+    tree.support = std::move(support);
+    return true;
+}
+
+bool is_tree_archive(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    char magic[8];
+    return in.read(magic, sizeof(magic)) && std::memcmp(magic, archive_magic, sizeof(magic)) == 0;
+}
+
+bool for_each_tree(const std::string& filename, std::vector<std::string>& names, const std::function<void(const tree_view&)>& visit) {
+    size_t count = 0;
+    if (is_tree_archive(filename)) {
+        tree_archive archive;
+        if (!archive.open(filename)) return false;
+        if (names.empty()) names = archive.names;
+        bool same = archive.names == names;
+        if (!same && archive.names.size() != names.size()) {
+            std::cerr << "Error: '" << filename << "' has " << archive.names.size() << " leaves, expected " << names.size() << std::endl;
+            return false;
+        }
+        // Trees are used in place unless their leaves need reordering
+        for (size_t t = 0; t < archive.size(); t++) {
+            if (same) {
+                visit(archive.view(t));
+                continue;
+            }
+            compact_tree tree = archive.tree(t);
+            if (!remap_leaves(tree, archive.names, names)) {
+                std::cerr << "Error: '" << filename << "' has different leaf names" << std::endl;
+                return false;
+            }
+            visit(view_tree(tree));
+        }
+        return true;
+    }
+
+    // Newick text, one tree per ';', parsed one at a time
+    std::ifstream in(filename);
+    if (!in) {
+        std::cerr << "Error: could not open '" << filename << "'" << std::endl;
+        return false;
+    }
+    std::string text;
+    while (std::getline(in, text, ';')) {
+        if (text.find_first_not_of(" \t\r\n") == std::string::npos) continue;
+        compact_tree tree;
+        if (!parse_newick(text, names, tree)) {
+            std::cerr << "Error: could not read tree " << count + 1 << " of '" << filename << "'" << std::endl;
+            return false;
+        }
+        count++;
+        visit(view_tree(tree));
+    }
+    return true;
+}
+
+bool read_tree_file(const std::string& filename, std::vector<std::string>& names, std::vector<compact_tree>& trees) {
+    return for_each_tree(filename, names, [&](const tree_view& view) {
+        compact_tree tree;
+        tree.leaves = view.leaves;
+        tree.parent.assign(view.parent, view.parent + view.nodes);
+        tree.length.assign(view.length, view.length + view.nodes);
+        if (view.support) tree.support.assign(view.support, view.support + view.nodes);
+        trees.push_back(std::move(tree));
+    });
+}
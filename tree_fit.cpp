@@ -0,0 +1,199 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+tree_distances::tree_distances(const tree_view& tree) : leaves(tree.leaves), nodes(tree.nodes) {
+    parent.assign(tree.parent, tree.parent + nodes);
+
+    // Parents follow their children, so one backward pass sets root-to-node
+    // depths and a forward pass counts the leaves under each node
+    depths.assign(nodes, 0.0);
+    level.assign(nodes, 0);
+    for (int v = nodes - 1; v >= 0; v--) {
+        if (parent[v] < 0) continue;
+        depths[v] = depths[parent[v]] + tree.length[v];
+        level[v] = level[parent[v]] + 1;
+    }
+    count.assign(nodes, 0);
+    for (int v = 0; v < nodes; v++) {
+        if (v < leaves) count[v] = 1;
+        if (parent[v] >= 0) count[parent[v]] += count[v];
+    }
+
+    // Children take consecutive ranges of their parent's range, in the order
+    // tree_children lists them, so a depth-first walk sees leaves in position order
+    std::vector<int> first, children;
+    tree_children(tree, first, children);
+    start.assign(nodes, 0);
+    int next_root = 0;
+    for (int v = nodes - 1; v >= 0; v--) {
+        if (parent[v] < 0) {
+            start[v] = next_root;
+            next_root += count[v];
+        }
+        int cursor = start[v];
+        for (int c = first[v]; c < first[v + 1]; c++) {
+            start[children[c]] = cursor;
+            cursor += count[children[c]];
+        }
+    }
+    position.assign(leaves, 0);
+    for (int i = 0; i < leaves; i++) position[i] = start[i];
+
+    // Euler tour of every root, iteratively: a node is written on entry and
+    // again after each of its children
+    first_visit.assign(nodes, -1);
+    std::vector<std::pair<int, int>> stack;
+    for (int root = nodes - 1; root >= 0; root--) {
+        if (parent[root] >= 0) continue;
+        stack.emplace_back(root, first[root]);
+        first_visit[root] = tour.size();
+        tour.push_back(root);
+        while (!stack.empty()) {
+            auto& [v, c] = stack.back();
+            if (c == first[v + 1]) {
+                stack.pop_back();
+                if (!stack.empty()) tour.push_back(stack.back().first);
+                continue;
+            }
+            int child = children[c++];
+            first_visit[child] = tour.size();
+            tour.push_back(child);
+            stack.emplace_back(child, first[child]);
+        }
+    }
+
+    // sparse[k][i] is the shallowest node among tour[i .. i + 2^k)
+    int size = tour.size();
+    sparse.push_back(tour);
+    for (int span = 1; 2 * span <= size; span *= 2) {
+        const std::vector<int32_t>& below = sparse.back();
+        std::vector<int32_t> above(size - 2 * span + 1);
+        for (size_t i = 0; i < above.size(); i++) {
+            int a = below[i], b = below[i + span];
+            above[i] = level[a] <= level[b] ? a : b;
+        }
+        sparse.push_back(std::move(above));
+    }
+}
+
+int tree_distances::lca(int a, int b) const {
+    int lo = first_visit[a], hi = first_visit[b];
+    if (lo > hi) std::swap(lo, hi);
+    int k = 31 - __builtin_clz(hi - lo + 1);
+    int x = sparse[k][lo], y = sparse[k][hi - (1 << k) + 1];
+    return level[x] <= level[y] ? x : y;
+}
+
+double tree_distances::distance(int a, int b) const {
+    return depths[a] + depths[b] - 2 * depths[lca(a, b)];
+}
+
+// Walking up from leaf i, the leaves that branch off at ancestor p are p's
+// range minus the range just left, and they all meet i at p
+void tree_distances::leaf_row(int i, double* row, std::vector<double>& scratch) const {
+    scratch.resize(leaves);
+    for (int u = i, p = parent[i]; p >= 0; u = p, p = parent[p]) {
+        double meet = depths[p];
+        std::fill(scratch.begin() + start[p], scratch.begin() + start[u], meet);
+        std::fill(scratch.begin() + start[u] + count[u], scratch.begin() + start[p] + count[p], meet);
+    }
+    for (int j = 0; j < i; j++) {
+        row[j] = depths[i] + depths[j] - 2 * scratch[position[j]];
+    }
+}
+
+// Row by row rather than node by node: rows are written contiguously and
+// split evenly across threads, where the root alone holds a quarter of the pairs
+template <typename T>
+void tree_distances::all_pairs(packed_triangle<T>& out, int threads) const {
+    out = packed_triangle<T>(leaves);
+    parallel_for_blocks(1, leaves, 32, threads, [&](int lo, int hi) {
+        std::vector<double> scratch, row(leaves);
+        for (int i = lo; i < hi; i++) {
+            leaf_row(i, row.data(), scratch);
+            T* target = out.row(i);
+            for (int j = 0; j < i; j++) target[j] = T(row[j]);
+        }
+    });
+}
+
+template void tree_distances::all_pairs<float>(packed_triangle<float>&, int) const;
+template void tree_distances::all_pairs<double>(packed_triangle<double>&, int) const;
+template void tree_distances::all_pairs<half>(packed_triangle<half>&, int) const;
+
+// row(i) gives D(i, 0..i-1). Rows are summed separately and reduced in
+// order, so the result does not depend on the thread count.
+template <typename Rows>
+static tree_fit fit_rows(const tree_view& tree, int n, const Rows& row, double power, int threads) {
+    tree_fit fit;
+    if (tree.leaves != n) {
+        std::cerr << "Error: tree has " << tree.leaves << " leaves but the matrix has " << n << " rows" << std::endl;
+        return fit;
+    }
+    tree_distances distances(tree);
+    for (int v = 0; v < tree.nodes; v++) {
+        if (tree.parent[v] >= 0) fit.tree_length += tree.length[v];
+    }
+
+    struct row_sums {
+        double squares = 0, weighted = 0, relative = 0, residual = 0, largest = 0;
+    };
+    std::vector<row_sums> sums(n);
+    parallel_for_blocks(1, n, 32, threads, [&](int lo, int hi) {
+        std::vector<double> scratch, patristic(n);
+        for (int i = lo; i < hi; i++) {
+            distances.leaf_row(i, patristic.data(), scratch);
+            const auto* observed = row(i);
+            row_sums& s = sums[i];
+            for (int j = 0; j < i; j++) {
+                double d = double(observed[j]);
+                double r = d - patristic[j];
+                s.squares += r * r;
+                s.residual += r;
+                s.largest = std::max(s.largest, std::abs(r));
+                if (d > 0) {
+                    double relative = r * r / (d * d);
+                    s.relative += relative;
+                    s.weighted += power == 2 ? relative : power == 0 ? r * r : r * r / std::pow(d, power);
+                }
+            }
+        }
+    });
+
+    double relative = 0;
+    for (int i = 1; i < n; i++) {
+        fit.sum_squares += sums[i].squares;
+        fit.weighted_sum_squares += sums[i].weighted;
+        fit.mean_residual += sums[i].residual;
+        fit.max_residual = std::max(fit.max_residual, sums[i].largest);
+        relative += sums[i].relative;
+    }
+    fit.pairs = size_t(n) * (n - 1) / 2;
+    if (fit.pairs) fit.mean_residual /= fit.pairs;
+    // Percent standard deviation as reported by Fitch-Margoliash programs:
+    // relative residuals over the pairs left after fitting 2n - 3 branches
+    double freedom = double(fit.pairs) - (2.0 * n - 3);
+    fit.percent_sd = 100 * std::sqrt(relative / std::max(freedom, 1.0));
+    return fit;
+}
+
+template <typename T>
+tree_fit evaluate_tree_fit(const tree_view& tree, const packed_triangle<T>& D, double power, int threads) {
+    return fit_rows(tree, D.n, [&](int i) { return D.row(i); }, power, threads);
+}
+
+template tree_fit evaluate_tree_fit<float>(const tree_view&, const packed_triangle<float>&, double, int);
+template tree_fit evaluate_tree_fit<double>(const tree_view&, const packed_triangle<double>&, double, int);
+template tree_fit evaluate_tree_fit<half>(const tree_view&, const packed_triangle<half>&, double, int);
+
+tree_fit evaluate_tree_fit(const tree_view& tree, const std::vector<dmatrix_row>& D, double power, int threads) {
+    return fit_rows(tree, D.size(), [&](int i) { return D[i].distances.data(); }, power, threads);
+}
+
+// Unweighted least-squares error of the tree against D
+float calculate_tree_fit(const Tree& tree, const std::vector<dmatrix_row>& D) {
+    compact_tree compact = to_compact_tree(tree);
+    return evaluate_tree_fit(view_tree(compact), D, 0.0).sum_squares;
+}
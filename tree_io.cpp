@@ -3,38 +3,50 @@
 #include <fstream>
 #include <algorithm>
 
-sequence read_fasta(std::string filename) {
+fasta_reader::fasta_reader(const std::string& filename, int threads) : file(filename, std::ios::binary), input(nullptr) {
+    if (!file) return;
+    inflater = open_decompressed(file, filename, threads);
+    input.rdbuf(inflater ? inflater.get() : file.rdbuf());
+}
+
+// Records without sequence lines are skipped, as read_fasta always did
+bool fasta_reader::next(std::string& name, std::string& content) {
+    content.clear();
+    while (std::getline(input, line)) {
+        if (line.empty()) continue;
+        if (line[0] == '>') {
+            if (!content.empty()) {
+                name = std::move(pending_name);
+                pending_name = line.substr(1);
+                return true;
+            }
+            pending_name = line.substr(1);
+        } else {
+            content += line;
+        }
+    }
+    if (content.empty()) return false;
+    name = std::move(pending_name);
+    pending_name.clear();
+    return true;
+}
+
+sequence read_fasta(std::string filename, int threads) {
     sequence sequence_list;
-    std::ifstream input(filename.c_str());
+    fasta_reader reader(filename, threads);
     
-    if (!input.good()) {
+    if (!reader.good()) {
         std::cerr << "Error opening '" << filename << std::endl;
     }
-    else if (input.good()) {
+    else {
         std::cout << "Reading '" << filename << "'...";
     }
     
-    std::string line, content, name;
-    while (std::getline(input, line).good()) {
-        if (line[0] == '>') {
-            if (!content.empty()) {
-                sequence_list.seq.push_back(content);
-                sequence_list.name.push_back(name);
-                content.clear();
-            }
-            line = line.substr(1, line.length() -1);
-            name = line;
-        }
-        else if (!line.empty()) {
-            content += line;
-        }
-    }
-    // Don't forget to add the last sequence
-    if (!content.empty()) {
+    std::string name, content;
+    while (reader.next(name, content)) {
         sequence_list.seq.push_back(content);
         sequence_list.name.push_back(name);
     }
-    input.close();
     std::cout << "  Number of sequences: " << sequence_list.seq.size() << std::endl;
     return sequence_list;
 }
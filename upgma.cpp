@@ -1,3 +1,4 @@
+#include "tree.hpp"
 #include <iostream>
 #include <vector>
 #include <cmath>
@@ -7,6 +8,7 @@
 #include <algorithm>
 #include <cstdlib>
 #include <ctime>
+#include <limits>
 
 using namespace std;
 
@@ -147,6 +149,100 @@ private:
     }
 };
 
+// UPGMA over the distance matrix, recording joins in the Tree
+// Rows at least this long are updated in parallel, in blocks of update_block
+static const int parallel_update = 8192;
+static const int update_block = 2048;
+
+template <typename T>
+void upgma(packed_triangle<T>& D, Tree& tree, bool verbose, int threads, merge_checkpoint* checkpoint) {
+    int m = D.n;
+    std::vector<int> nodes(m);  // Tree node index held by each matrix slot
+    std::vector<int> cluster_sizes(m, 1);
+    std::vector<double> heights(m, 0.0);
+
+    // Checkpoints keep the heights followed by the cluster sizes
+    if (checkpoint && checkpoint->restored.m) {
+        m = checkpoint->restored.m;
+        nodes = checkpoint->restored.nodes;
+        const std::vector<double>& values = checkpoint->restored.values;
+        heights.assign(values.begin(), values.begin() + m);
+        cluster_sizes.assign(values.begin() + m, values.begin() + 2 * m);
+    } else {
+        for (int i = 0; i < m; i++) {
+            nodes[i] = i;
+        }
+    }
+
+    while (m > 1) {
+        // Find minimum distance pair
+        min_pair best = find_min_pair(D, m, 1.0, nullptr, threads);
+        double min_dist = best.value;
+        int min_i = best.i, min_j = best.j;
+
+        if (verbose) {
+            std::cout << "Merging nodes " << tree.label(nodes[min_i])
+                      << " and " << tree.label(nodes[min_j])
+                      << " (distance = " << min_dist << ")\n";
+            std::cout << "Current matrix size: " << m << std::endl;
+        }
+
+        // Both children hang from a node at half the merge distance
+        double height = min_dist / 2.0;
+        int joined = tree.joinNodes(nodes[min_i], nodes[min_j], height - heights[min_i], height - heights[min_j]);
+        int new_size = cluster_sizes[min_i] + cluster_sizes[min_j];
+
+        // The merged cluster takes slot min_j, averaging over both clusters
+        parallel_for_blocks(0, m, update_block, m >= parallel_update ? threads : 1, [&](int lo, int hi) {
+            for (int k = lo; k < hi; k++) {
+                if (k == min_i || k == min_j) continue;
+                D.set(k, min_j, (cluster_sizes[min_i] * D.get(k, min_i) + cluster_sizes[min_j] * D.get(k, min_j)) / new_size);
+            }
+        });
+        nodes[min_j] = joined;
+        cluster_sizes[min_j] = new_size;
+        heights[min_j] = height;
+
+        // The last slot fills the gap left by min_i
+        int last = m - 1;
+        if (min_i != last) {
+            D.move_slot(last, min_i);
+            nodes[min_i] = nodes[last];
+            cluster_sizes[min_i] = cluster_sizes[last];
+            heights[min_i] = heights[last];
+        }
+        m--;
+
+        if (checkpoint && m > 1 && checkpoint->due()) {
+            merge_state state = {m, {nodes.begin(), nodes.begin() + m}, {heights.begin(), heights.begin() + m}};
+            state.values.insert(state.values.end(), cluster_sizes.begin(), cluster_sizes.begin() + m);
+            checkpoint->save(D, tree, state);
+        }
+    }
+}
+
+template void upgma<float>(packed_triangle<float>&, Tree&, bool, int, merge_checkpoint*);
+template void upgma<double>(packed_triangle<double>&, Tree&, bool, int, merge_checkpoint*);
+template void upgma<half>(packed_triangle<half>&, Tree&, bool, int, merge_checkpoint*);
+
+void upgma(std::vector<dmatrix_row>& D, Tree& tree, bool verbose) {
+    packed_triangle<float> working(D);
+    upgma(working, tree, verbose);
+}
+
+void upgma_tree(std::vector<dmatrix_row>& D, std::string output, bool verbose) {
+    std::vector<std::string> names;
+    for (int i = 0; i < D.size(); i++) {
+        names.push_back(std::to_string(i));
+    }
+    Tree tree(names);
+    upgma(D, tree, verbose);
+    std::vector<std::string> to_write = {tree.newick()};
+    write_to_file(output, to_write);
+}
+
+// Standalone demo on random integer taxa: g++ -DUPGMA_DEMO upgma.cpp
+#ifdef UPGMA_DEMO
 int main() {
     srand(time(0));
     vector<int> taxa;
@@ -164,4 +260,5 @@ int main() {
     cout << upgma.getNewick() << endl;
 
     return 0;
-}
\ No newline at end of file
+}
+#endif